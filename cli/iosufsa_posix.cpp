@@ -0,0 +1,357 @@
+#include "iosufsa.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "exception.hpp"
+#include "log.hpp"
+
+// Host backend for IOSUFSA, so the patch engine can run on extracted
+// titles. Paths are plain host paths, inputs are mapped and outputs are
+// written with pwrite. Asynchronous requests each run on their own thread.
+
+namespace {
+    std::int32_t pwrite_full(int fd, const std::uint8_t *data, std::size_t size, std::size_t offset) {
+        std::size_t done = 0;
+        while (done < size) {
+            ssize_t n = ::pwrite(fd, data + done, size - done, offset + done);
+            if (n <= 0) return -1;
+            done += n;
+        }
+        return static_cast<std::int32_t>(done);
+    }
+
+    // Counts a call as the IOCTL it stands in for, once it returns
+    class Counted {
+    public:
+        Counted(IOSUFSA::Stats &stats, IOSUFSA::Stats::Command command) :
+            stats(stats), command(command), start(IOSUFSA::Stats::now_us()) { }
+        ~Counted() { stats.add(command, IOSUFSA::Stats::now_us() - start, bytes, copied); }
+
+        Counted(const Counted &) = delete;
+        Counted &operator=(const Counted &) = delete;
+
+        std::uint64_t bytes = 0;
+        std::uint64_t copied = 0;
+
+    private:
+        IOSUFSA::Stats &stats;
+        const IOSUFSA::Stats::Command command;
+        const std::uint64_t start;
+    };
+}
+
+IOSUFSA::~IOSUFSA() {
+    close();
+}
+
+void IOSUFSA::open() {
+    fsa_fd = 0;
+}
+
+void IOSUFSA::close() {
+    fsa_fd = -1;
+}
+
+bool IOSUFSA::remove(std::string_view path) const {
+    if (!is_open()) throw error("Host: Remove: Not Open");
+    Counted counted(counters, Stats::REMOVE);
+    return ::remove(std::string(path).c_str()) == 0;
+}
+
+bool IOSUFSA::rename(std::string_view from, std::string_view to) const {
+    if (!is_open()) throw error("Host: Rename: Not Open");
+    Counted counted(counters, Stats::RENAME);
+    return ::rename(std::string(from).c_str(), std::string(to).c_str()) == 0;
+}
+
+bool IOSUFSA::flush_volume(std::string_view) const {
+    if (!is_open()) throw error("Host: FlushVolume: Not Open");
+    Counted counted(counters, Stats::FLUSHVOLUME);
+    return true;
+}
+
+bool IOSUFSA::stat(std::string_view path, Stat &stat) const {
+    if (!is_open()) throw error("Host: GetStat: Not Open");
+    Counted counted(counters, Stats::GETSTAT);
+
+    struct stat st;
+    if (::stat(std::string(path).c_str(), &st) < 0) return false;
+    stat.is_dir = S_ISDIR(st.st_mode);
+    stat.size = static_cast<std::uint32_t>(st.st_size);
+    return true;
+}
+
+IOSUFSA::File::~File() {
+    if (is_open()) try {
+        LOG("File destructed while open");
+        close();
+    } catch (error &e) {
+        LOG("ERROR in ~File: %s", e.what());
+    }
+}
+
+IOSUFSA::File::File(File &&o) :
+        fsa(o.fsa), file_fd(o.file_fd), map(o.map), map_len(o.map_len), pos(o.pos) {
+    o.file_fd = -1;
+    o.map = nullptr;
+    o.map_len = 0;
+}
+
+IOSUFSA::File &IOSUFSA::File::operator=(File &&o) {
+    if (std::addressof(o.fsa) != std::addressof(fsa))
+        throw error("FSA: File Move");
+    close();
+    file_fd = o.file_fd; map = o.map; map_len = o.map_len; pos = o.pos;
+    o.file_fd = -1; o.map = nullptr; o.map_len = 0;
+    return *this;
+}
+
+bool IOSUFSA::File::open(std::string_view path, std::string_view mode) {
+    if (!fsa.is_open()) throw error("Host: FileOpen: FSA Not Open");
+    if (file_fd >= 0) close();
+    Counted counted(fsa.counters, Stats::OPENFILE);
+
+    int flags;
+    if (mode == "rb") flags = O_RDONLY;
+    else if (mode == "wb") flags = O_WRONLY | O_CREAT | O_TRUNC;
+    // Only inputs are mapped, so files opened for update are written to
+    else if (mode == "r+") flags = O_RDWR;
+    else throw error("Host: FileOpen: Mode");
+
+    file_fd = ::open(std::string(path).c_str(), flags | O_CLOEXEC, 0644);
+    if (file_fd < 0) return false;
+    pos = 0;
+
+    if (flags == O_RDONLY) {
+        struct stat st;
+        if (::fstat(file_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            close();
+            return false;
+        }
+        map_len = st.st_size;
+        if (map_len > 0) {
+            void *addr = ::mmap(nullptr, map_len, PROT_READ, MAP_PRIVATE, file_fd, 0);
+            if (addr == MAP_FAILED) {
+                close();
+                return false;
+            }
+            ::madvise(addr, map_len, MADV_SEQUENTIAL);
+            map = reinterpret_cast<const std::uint8_t *>(addr);
+        }
+    }
+    return true;
+}
+
+bool IOSUFSA::File::close() {
+    if (!is_open()) return true;
+    Counted counted(fsa.counters, Stats::CLOSEFILE);
+
+    if (map) ::munmap(const_cast<std::uint8_t *>(map), map_len);
+    map = nullptr;
+    map_len = 0;
+    int res = ::close(file_fd);
+    file_fd = -1;
+    return (res >= 0);
+}
+
+std::int32_t IOSUFSA::File::read(void *data, std::size_t size, std::size_t count) const {
+    if (!is_open()) throw error("Host: FileRead: Not Open");
+    if (size == 0) return 0;
+    Counted counted(fsa.counters, Stats::READFILE);
+
+    std::size_t len = std::min(size * count, map_len - std::min(pos, map_len));
+    len -= len % size;
+    if (data && len > 0) std::memcpy(data, map + pos, len);
+    counted.bytes = len;
+    if (data) counted.copied = len;
+    pos += len;
+    return static_cast<std::int32_t>(len / size);
+}
+
+bool IOSUFSA::File::readall(void *data, std::size_t size) const {
+    if (!is_open()) throw error("Host: FileReadAll: Not Open");
+    return read(data, 1, size) == static_cast<std::int32_t>(size);
+}
+
+bool IOSUFSA::File::readall(Buffer &buffer) const {
+    return readall(buffer.data(), buffer.size());
+}
+
+bool IOSUFSA::File::skip(std::size_t size) const {
+    if (!is_open()) throw error("Host: FileSkip: Not Open");
+    return read(nullptr, 1, size) == static_cast<std::int32_t>(size);
+}
+
+std::int32_t IOSUFSA::File::write(const void *data, std::size_t size, std::size_t count) const {
+    if (!is_open()) throw error("Host: FileWrite: Not Open");
+    if (size == 0) return 0;
+    Counted counted(fsa.counters, Stats::WRITEFILE);
+
+    std::int32_t res = pwrite_full(file_fd, reinterpret_cast<const std::uint8_t *>(data),
+                                   size * count, pos);
+    if (res < 0) return res;
+    counted.bytes = res;
+    pos += res;
+    return res / size;
+}
+
+bool IOSUFSA::File::writeall(const void *data, std::size_t size) const {
+    if (!is_open()) throw error("Host: FileWriteAll: Not Open");
+    if (size == 0) return true;
+    return write(data, 1, size) == static_cast<std::int32_t>(size);
+}
+
+bool IOSUFSA::File::writeall(Buffer &buffer) const {
+    return writeall(buffer.data(), buffer.size());
+}
+
+bool IOSUFSA::File::seek(std::size_t position) const {
+    if (!is_open()) throw error("Host: FileSeek: Not Open");
+    Counted counted(fsa.counters, Stats::SETFILEPOS);
+
+    // As on the console, seeking past the end fails
+    struct stat st;
+    if (::fstat(file_fd, &st) < 0) return false;
+    if (position > static_cast<std::size_t>(st.st_size)) return false;
+    pos = position;
+    return true;
+}
+
+bool IOSUFSA::File::size(std::size_t &size) const {
+    if (!is_open()) throw error("Host: FileStat: Not Open");
+    Counted counted(fsa.counters, Stats::STATFILE);
+
+    struct stat st;
+    if (::fstat(file_fd, &st) < 0) return false;
+    size = st.st_size;
+    return true;
+}
+
+struct IOSUFSA::File::Request::State {
+    std::thread thread;
+    std::int32_t result = 0;
+    // Counted once waited on, but timed to when the thread finished
+    Stats *stats = nullptr;
+    Stats::Command command = Stats::READFILE;
+    std::uint64_t start_us = 0;
+    std::uint64_t end_us = 0;
+
+    void begin(const IOSUFSA &fsa, Stats::Command command) {
+        this->stats = &fsa.counters;
+        this->command = command;
+        start_us = Stats::now_us();
+    }
+};
+
+IOSUFSA::File::Request::Request() : state(std::make_unique<State>()) { }
+
+IOSUFSA::File::Request::~Request() {
+    if (state->thread.joinable()) state->thread.join();
+}
+
+std::int32_t IOSUFSA::File::Request::wait() {
+    if (!busy) throw error("Host: Request: Not Pending");
+    state->thread.join();
+    busy = false;
+    state->stats->add(state->command, state->end_us - state->start_us,
+                      std::max(state->result, std::int32_t{0}));
+    return state->result;
+}
+
+void IOSUFSA::File::read_async(Buffer &buffer, std::size_t size, Request &request) const {
+    if (!is_open()) throw error("Host: FileReadAsync: Not Open");
+    if (request.pending()) throw error("Host: FileReadAsync: Request Busy");
+    if (size > max_io || size > buffer.size()) throw error("Host: FileReadAsync: Size");
+
+    // Requests are ordered by claiming their range of the file up front
+    std::size_t offset = std::min(pos, map_len);
+    std::size_t len = std::min(size, map_len - offset);
+    pos = offset + len;
+
+    Request::State &state = *request.state;
+    state.begin(fsa, Stats::READFILE);
+    state.thread = std::thread([&state, src = map + offset, dest = buffer.data(), len]() {
+        std::memcpy(dest, src, len);
+        state.result = static_cast<std::int32_t>(len);
+        state.end_us = Stats::now_us();
+    });
+    request.busy = true;
+}
+
+void IOSUFSA::File::write_async(Buffer &buffer, std::size_t size, Request &request) const {
+    if (!is_open()) throw error("Host: FileWriteAsync: Not Open");
+    if (request.pending()) throw error("Host: FileWriteAsync: Request Busy");
+    if (size > max_io || size > buffer.size()) throw error("Host: FileWriteAsync: Size");
+
+    std::size_t offset = pos;
+    pos += size;
+
+    Request::State &state = *request.state;
+    state.begin(fsa, Stats::WRITEFILE);
+    state.thread = std::thread([&state, fd = file_fd, src = buffer.data(), size, offset]() {
+        state.result = pwrite_full(fd, src, size, offset);
+        state.end_us = Stats::now_us();
+    });
+    request.busy = true;
+}
+
+IOSUFSA::Dir::~Dir() {
+    if (is_open()) try {
+        LOG("Dir destructed while open");
+        close();
+    } catch (error &e) {
+        LOG("ERROR in ~Dir: %s", e.what());
+    }
+}
+
+bool IOSUFSA::Dir::open(std::string_view path) {
+    if (!fsa.is_open()) throw error("Host: DirOpen: FSA Not Open");
+    if (dir_fd >= 0) close();
+    Counted counted(fsa.counters, Stats::OPENDIR);
+
+    DIR *stream = ::opendir(std::string(path).c_str());
+    if (!stream) return false;
+    dir = stream;
+    dir_fd = ::dirfd(stream);
+    return true;
+}
+
+bool IOSUFSA::Dir::close() {
+    if (!is_open()) return true;
+    Counted counted(fsa.counters, Stats::CLOSEDIR);
+
+    int res = ::closedir(reinterpret_cast<DIR *>(dir));
+    dir = nullptr;
+    dir_fd = -1;
+    return (res >= 0);
+}
+
+bool IOSUFSA::Dir::read(Entry &entry) const {
+    if (!is_open()) throw error("Host: DirRead: Not Open");
+    Counted counted(fsa.counters, Stats::READDIR);
+
+    while (const dirent *ent = ::readdir(reinterpret_cast<DIR *>(dir))) {
+        if (std::strcmp(ent->d_name, ".") == 0 || std::strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        struct stat st;
+        if (::fstatat(dir_fd, ent->d_name, &st, 0) < 0) continue;
+        entry.name = ent->d_name;
+        entry.is_dir = S_ISDIR(st.st_mode);
+        entry.size = static_cast<std::uint32_t>(st.st_size);
+        return true;
+    }
+    return false;
+}
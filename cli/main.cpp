@@ -0,0 +1,346 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "exception.hpp"
+#include "hachi_patch.hpp"
+#include "iosufsa.hpp"
+#include "log.hpp"
+#include "ntr_patch.hpp"
+#include "patch.hpp"
+#include "patch_cache.hpp"
+#include "patch_worker.hpp"
+#include "progress.hpp"
+#include "task_graph.hpp"
+#include "thread.hpp"
+#include "util.hpp"
+
+using namespace std::string_view_literals;
+
+// Offline patcher for extracted titles, each a directory holding
+// code/hachihachi_ntr.rpx and content/0010/rom.zip. Titles are worked
+// through in parallel across all cores.
+
+namespace {
+    enum class Command {
+        SCAN,
+        PATCH,
+        BATCH,
+        SEED,
+    };
+
+    struct Job {
+        std::string path;
+        Patch::Status status = Patch::Status::UNTESTED;
+        bool patched = false;
+        std::string error;
+        Progress::Snapshot progress;
+    };
+
+    const char *status_str(Patch::Status status) {
+        switch (status) {
+            case Patch::Status::UNTESTED: return "untested";
+            case Patch::Status::RPX_ONLY: return "rpx only";
+            case Patch::Status::IS_JPN: return "JPN";
+            case Patch::Status::IS_USA: return "USA";
+            case Patch::Status::IS_EUR: return "EUR";
+            case Patch::Status::IS_KOR: return "KOR";
+            case Patch::Status::PATCHED: return "already patched";
+            case Patch::Status::MISSING_RPX: return "missing rpx";
+            case Patch::Status::INVALID_RPX: return "invalid rpx";
+            case Patch::Status::INVALID_NTR: return "invalid ntr";
+            case Patch::Status::IS_HAXCHI: return "haxchi";
+            case Patch::Status::INVALID_ZIP: return "invalid zip";
+            case Patch::Status::UNKNOWN_ERR: return "unknown error";
+        }
+        return "unknown error";
+    }
+
+    bool patchable(Patch::Status status) {
+        return status >= Patch::Status::IS_JPN;
+    }
+
+    // IOCTLs of every session, for --stats
+    std::mutex io_mutex;
+    IOSUFSA::Stats io_total;
+
+    void tally(const IOSUFSA::Stats &stats) {
+        std::lock_guard<std::mutex> lock(io_mutex);
+        io_total += stats;
+    }
+
+    Patch::Status check_title(const IOSUFSA &fsa, std::string_view path) {
+        Patch::Status res = hachi_check(fsa, path);
+        if (res < Patch::Status::UNTESTED) return res;
+        return ntr_check(fsa, path);
+    }
+
+    // Headless stand-in for the console UI, driving the same worker. On a
+    // terminal, the progress is shown on stderr.
+    void watch(PatchWorker &worker, const Progress &progress, const char *label, bool show) {
+        while (!worker.done()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(show ? 100 : 10));
+            if (!show) continue;
+            Progress::Snapshot snap = progress.snapshot();
+            char running[Progress::steps + 1] = { };
+            for (std::size_t i = 0; i < Progress::steps; ++i)
+                running[i] = snap.is_running(i + 1) ? '1' + i : '-';
+            std::fprintf(stderr, "\r%s: title %u/%u, steps %s, %3u%%, %.2f MiB/s, ETA %us  ",
+                         label, std::min(snap.titles_done + 1, snap.titles), snap.titles,
+                         running, snap.permille() / 10, snap.rate() / double(0x10'0000),
+                         snap.eta_ms() / 1000);
+        }
+        if (show) std::fputc('\n', stderr);
+        try {
+            worker.join();
+        } catch (...) {
+            tally(worker.io_stats());
+            throw;
+        }
+        tally(worker.io_stats());
+    }
+
+    void watch_patch(Job &job, const IOSUFSA &fsa, const PatchOptions &options, bool show) {
+        Progress progress;
+        PatchWorker worker(fsa, { job.path }, progress, nullptr, nullptr, options);
+        watch(worker, progress, job.path.c_str(), show);
+        job.progress = progress.snapshot();
+    }
+
+    // How the worker's time went: the work done by all tasks together, and
+    // the part of it on the critical path, against the time taken
+    void print_trace(const std::vector<TaskGraph::Span> &spans, bool all) {
+        std::uint32_t work = 0, critical = 0, tasks = 0;
+        for (const TaskGraph::Span &span : spans) {
+            if (!span.ran) continue;
+            std::uint32_t ms = span.end_ms - span.start_ms;
+            work += ms;
+            if (span.critical) {
+                critical += ms;
+                ++tasks;
+            }
+            if (all) std::printf("trace: %-20s %7u - %7u ms%s\n", span.name.c_str(),
+                                 span.start_ms, span.end_ms, span.critical ? " *" : "");
+        }
+        std::printf("batch: %u ms of work, critical path of %u tasks taking %u ms\n",
+                    work, tasks, critical);
+    }
+
+    // Patches every eligible job through one worker, whose Hachi and NTR
+    // chains run side by side and move on to the next title when done
+    void run_batch(std::vector<Job> &jobs, const PatchOptions &options, bool trace, bool show) {
+        std::vector<Job *> eligible;
+        std::vector<std::string> paths;
+        for (Job &job : jobs) {
+            if (job.error.empty() && patchable(job.status)) {
+                eligible.push_back(&job);
+                paths.push_back(job.path);
+            }
+        }
+        if (eligible.empty()) return;
+
+        IOSUFSA fsa;
+        fsa.open();
+        Progress progress;
+        std::vector<TaskGraph::Span> spans;
+        {
+            PatchWorker worker(fsa, std::move(paths), progress, nullptr, nullptr, options);
+            // The worker names the title that failed, as titles overlap.
+            // Otherwise, every title left unfinished is blamed.
+            auto fail = [&worker, &eligible](const char *what) {
+                std::size_t failed = worker.failed();
+                for (std::size_t i = 0; i < eligible.size(); ++i) {
+                    bool done = worker.title_progress(i).finished;
+                    if (i == failed || (failed == PatchWorker::no_title && !done))
+                        eligible[i]->error = what;
+                }
+            };
+            try {
+                watch(worker, progress, "batch", show);
+            } catch (error &e) {
+                fail(e.what());
+            } catch (std::exception &e) {
+                fail(e.what());
+            }
+            spans = worker.trace();
+            for (std::size_t i = 0; i < eligible.size(); ++i) {
+                eligible[i]->progress = worker.title_progress(i);
+                eligible[i]->patched = eligible[i]->progress.finished;
+            }
+        }
+        fsa.close();
+
+        Progress::Snapshot snap = progress.snapshot();
+        std::printf("batch: %u of %u titles in %u ms, %u.%02u titles/min%s\n",
+                    snap.titles_done, snap.titles, snap.elapsed_ms,
+                    snap.titles_per_min() / 100, snap.titles_per_min() % 100,
+                    options.pipeline ? "" : " (serial)");
+        print_trace(spans, trace);
+    }
+
+    // Fills the cache from patched copies of the eligible titles, leaving
+    // the titles as they were. With the cache copied to the SD card, the
+    // installer restores those titles instead of patching them.
+    void run_seed(std::vector<Job> &jobs, const std::string &dir, const PatchOptions &options,
+                  bool show) {
+        namespace fs = std::filesystem;
+        fs::path temp = fs::path(dir) / "seed.tmp";
+        std::vector<std::string> originals(jobs.size());
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+            Job &job = jobs[i];
+            if (!job.error.empty() || !patchable(job.status)) continue;
+            fs::path copy = temp / std::to_string(i);
+            std::error_code ec;
+            for (std::string_view file : { hachi_file, zip_file }) {
+                fs::path to = copy / fs::path(file).relative_path();
+                if (!ec) fs::create_directories(to.parent_path(), ec);
+                if (!ec) fs::copy_file(util::concat_sv({ job.path, file }), to,
+                                       fs::copy_options::overwrite_existing, ec);
+            }
+            if (ec) {
+                job.error = ec.message();
+                continue;
+            }
+            originals[i] = std::move(job.path);
+            job.path = copy.string();
+        }
+
+        run_batch(jobs, options, false, show);
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+            if (!originals[i].empty()) jobs[i].path = std::move(originals[i]);
+        }
+        std::error_code ec;
+        fs::remove_all(temp, ec);
+    }
+
+    void run_job(Job &job, Command command, const PatchOptions &options, bool show) {
+        // Sessions are cheap on the host, so each job has its own
+        IOSUFSA fsa;
+        fsa.open();
+        try {
+            job.status = check_title(fsa, job.path);
+            // The worker tallies its own
+            tally(fsa.stats());
+            if (command == Command::PATCH && patchable(job.status)) {
+                watch_patch(job, fsa, options, show);
+                job.patched = true;
+            }
+        } catch (error &e) {
+            job.error = e.what();
+        } catch (std::exception &e) {
+            job.error = e.what();
+        }
+        fsa.close();
+    }
+
+    void usage(const char *name) {
+        std::fprintf(stderr, "usage: %s scan [--stats] <title dir>...\n"
+                             "       %s patch [--stats] [--in-place|--stream] [--cache <dir>] "
+                             "<title dir>...\n"
+                             "       %s batch [--stats] [--serial] [--trace] [--in-place|--stream] "
+                             "[--cache <dir>] <title dir>...\n"
+                             "       %s seed <cache dir> [--stats] [--in-place|--stream] "
+                             "<title dir>...\n",
+                     name, name, name, name);
+    }
+}
+
+int main(int argc, char **argv) {
+    LOGINIT();
+    if (argc < 3) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    Command command;
+    if (argv[1] == "scan"sv) command = Command::SCAN;
+    else if (argv[1] == "patch"sv) command = Command::PATCH;
+    else if (argv[1] == "batch"sv) command = Command::BATCH;
+    else if (argv[1] == "seed"sv) command = Command::SEED;
+    else {
+        usage(argv[0]);
+        return 2;
+    }
+
+    int first = 2;
+    PatchOptions options;
+    bool trace = false, stats = false;
+    std::string cache_dir;
+    while (first < argc) {
+        bool batch = command == Command::BATCH;
+        bool patches = command != Command::SCAN;
+        if (command == Command::SEED && cache_dir.empty()) cache_dir = argv[first];
+        else if (batch && argv[first] == "--serial"sv) options.pipeline = false;
+        else if (batch && argv[first] == "--trace"sv) trace = true;
+        else if (argv[first] == "--stats"sv) stats = true;
+        else if (patches && argv[first] == "--in-place"sv)
+            options.hachi_mode = HachiMode::IN_PLACE;
+        else if (patches && argv[first] == "--stream"sv)
+            options.hachi_mode = HachiMode::STREAM;
+        else if (patches && argv[first] == "--cache"sv && first + 1 < argc)
+            cache_dir = argv[++first];
+        else break;
+        ++first;
+    }
+    if (first >= argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::vector<Job> jobs(argc - first);
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+        std::string_view path = argv[i + first];
+        while (path.size() > 1 && path.back() == '/') path.remove_suffix(1);
+        jobs[i].path = path;
+    }
+
+    // Batches check every title in parallel first, then patch them in turn
+    bool tty = ::isatty(STDERR_FILENO);
+    bool show = jobs.size() == 1 && tty;
+    std::unique_ptr<PatchCache> cache;
+    if (!cache_dir.empty()) cache = std::make_unique<PatchCache>(cache_dir);
+    options.cache = cache.get();
+    Command checks = (command == Command::PATCH) ? Command::PATCH : Command::SCAN;
+    parallel_for(jobs.size(), [&jobs, checks, &options, show](std::size_t i) {
+        run_job(jobs[i], checks, options, show);
+    });
+    if (command == Command::BATCH) run_batch(jobs, options, trace, tty);
+    if (command == Command::SEED) run_seed(jobs, cache_dir, options, tty);
+
+    // Reported in argument order once everything is done
+    int failed = 0;
+    for (const Job &job : jobs) {
+        if (!job.error.empty()) {
+            std::printf("%s: %s: FAILED: %s\n", job.path.c_str(),
+                        status_str(job.status), job.error.c_str());
+            ++failed;
+        } else if (job.patched) {
+            const Progress::Snapshot &p = job.progress;
+            std::printf("%s: %s: %s, %u KiB read, %u KiB inflated, %u KiB deflated, "
+                        "%u KiB written in %u ms\n", job.path.c_str(), status_str(job.status),
+                        command == Command::SEED ? "cached" : "patched",
+                        p.total(Progress::Bytes::READ) / 0x400,
+                        p.total(Progress::Bytes::INFLATED) / 0x400,
+                        p.total(Progress::Bytes::DEFLATED) / 0x400,
+                        p.total(Progress::Bytes::WRITTEN) / 0x400, p.elapsed_ms);
+        } else {
+            std::printf("%s: %s\n", job.path.c_str(), status_str(job.status));
+        }
+    }
+
+    if (stats) io_total.write(stdout);
+
+    LOGFINISH();
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,59 @@
+#include "alloc_count.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace {
+    std::atomic<std::size_t> in_use { 0 };
+    std::atomic<std::size_t> most { 0 };
+
+    // Each block starts with a header at least as aligned as the block,
+    // whose last two words hold the size asked for and the header's size
+    void *allocate(std::size_t size, std::size_t align) {
+        align = std::max(align, alignof(std::max_align_t));
+        std::size_t head = std::max(align, 2 * sizeof(std::size_t));
+        std::size_t total = (head + size + align - 1) / align * align;
+        std::uint8_t *base = static_cast<std::uint8_t *>(std::aligned_alloc(align, total));
+        if (base == nullptr) throw std::bad_alloc();
+        std::size_t *words = reinterpret_cast<std::size_t *>(base + head);
+        words[-2] = size;
+        words[-1] = head;
+
+        std::size_t now = in_use.fetch_add(size) + size;
+        std::size_t seen = most.load();
+        while (now > seen && !most.compare_exchange_weak(seen, now)) { }
+        return base + head;
+    }
+
+    void deallocate(void *ptr) {
+        if (ptr == nullptr) return;
+        std::size_t *words = static_cast<std::size_t *>(ptr);
+        in_use.fetch_sub(words[-2]);
+        std::free(static_cast<std::uint8_t *>(ptr) - words[-1]);
+    }
+}
+
+std::size_t alloc_count::current() { return in_use.load(); }
+std::size_t alloc_count::peak() { return most.load(); }
+void alloc_count::reset_peak() { most.store(in_use.load()); }
+
+void *operator new(std::size_t size) { return allocate(size, 0); }
+void *operator new[](std::size_t size) { return allocate(size, 0); }
+void *operator new(std::size_t size, std::align_val_t align) {
+    return allocate(size, static_cast<std::size_t>(align));
+}
+void *operator new[](std::size_t size, std::align_val_t align) {
+    return allocate(size, static_cast<std::size_t>(align));
+}
+
+void operator delete(void *ptr) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr) noexcept { deallocate(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { deallocate(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept { deallocate(ptr); }
@@ -0,0 +1,17 @@
+#ifndef TEST_ALLOC_COUNT_HPP
+#define TEST_ALLOC_COUNT_HPP
+
+#include <cstddef>
+
+// Linked into every test, replacing the global operator new and delete to
+// count the bytes they hand out. Memory zlib allocates itself, with malloc,
+// and files the host backend maps are not counted.
+namespace alloc_count {
+    // Bytes allocated and not yet freed
+    std::size_t current();
+    // Most bytes allocated at once since the last reset_peak
+    std::size_t peak();
+    void reset_peak();
+}
+
+#endif // TEST_ALLOC_COUNT_HPP
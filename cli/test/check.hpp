@@ -0,0 +1,16 @@
+#ifndef TEST_CHECK_HPP
+#define TEST_CHECK_HPP
+
+#include <cstdio>
+#include <cstdlib>
+
+// Host tests are plain programs, run by make check, that stop at the first
+// failed check. Errors thrown by the engine fail the test as well.
+#define CHECK(X) do { \
+        if (!(X)) { \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #X); \
+            std::exit(1); \
+        } \
+    } while(0)
+
+#endif // TEST_CHECK_HPP
@@ -0,0 +1,81 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include <zlib.h>
+
+#include "check.hpp"
+#include "fixture.hpp"
+#include "thread.hpp"
+#include "zlib.hpp"
+
+// The Deflater's output is set by its input alone, so patched files can be
+// made ahead of time on any machine and still match the console's, and it
+// is the stream compress gives for the whole input at once. Its
+// blocks are spread by parallel_for, whose threads serve call after call.
+namespace {
+    fixture::bytes deflate(const fixture::bytes &data, std::size_t chunk) {
+        fixture::bytes out;
+        Zlib::Deflater deflater(true, [&out](const std::uint8_t *data, std::size_t size) {
+            out.insert(out.end(), data, data + size);
+        });
+        for (std::size_t off = 0; off < data.size(); off += chunk)
+            deflater.write(data.data() + off, std::min(chunk, data.size() - off));
+        deflater.finish();
+        CHECK(deflater.crc() == ::crc32(0, data.data(), data.size()));
+        return out;
+    }
+
+    // The same stream as compress, without its length prefix
+    void check_compress(std::size_t len) {
+        fixture::bytes data = fixture::make_rom(0x200000);
+        data.resize(len);
+        Zlib::bytes cmp = Zlib::compress(data, true);
+        for (std::size_t chunk : { std::max<std::size_t>(len, 1), std::size_t(0x8000) })
+            CHECK(deflate(data, chunk) == fixture::bytes(cmp.begin() + 4, cmp.end()));
+    }
+
+    void check_chunking() {
+        fixture::bytes data = fixture::make_rom();
+        fixture::bytes whole = deflate(data, data.size());
+        for (std::size_t chunk : { 1000, 0x8000, 0x20001, 0x61234 })
+            CHECK(deflate(data, chunk) == whole);
+
+        fixture::bytes dec(data.size());
+        uLongf dec_len = dec.size();
+        CHECK(::uncompress(dec.data(), &dec_len, whole.data(), whole.size()) == Z_OK);
+        CHECK(dec_len == data.size() && dec == data);
+    }
+
+    void check_parallel_for() {
+        for (std::size_t round = 0; round < 100; ++round) {
+            std::vector<std::atomic<std::uint32_t>> hits(37);
+            parallel_for(hits.size(), [&hits](std::size_t i) { hits[i].fetch_add(1); });
+            for (const auto &hit : hits) CHECK(hit.load() == 1);
+        }
+
+        bool thrown = false;
+        try {
+            parallel_for(16, [](std::size_t i) {
+                if (i == 5) throw std::runtime_error("parallel_for");
+            });
+        } catch (std::runtime_error &e) {
+            thrown = true;
+        }
+        CHECK(thrown);
+        std::atomic<std::size_t> after { 0 };
+        parallel_for(8, [&after](std::size_t) { after.fetch_add(1); });
+        CHECK(after.load() == 8);
+    }
+}
+
+int main() {
+    // Empty, one byte, and either side of a full set of flushed blocks
+    for (std::size_t len : { 0, 1, 0x30000 - 1, 0x30000, 0x30000 + 1, 0x60000, 0x1A0000 })
+        check_compress(len);
+    check_chunking();
+    check_parallel_for();
+    return 0;
+}
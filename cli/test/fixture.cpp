@@ -0,0 +1,324 @@
+#include "fixture.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+
+#include <zlib.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+    constexpr std::uint32_t section_count = 29;
+    constexpr std::uint32_t section_table = 0x40;
+    constexpr std::uint32_t crcs_type = 0x80000003;
+    constexpr std::uint32_t zlib_flag = 0x08000000;
+
+    // The CRCs hachi_check expects in section 27 of an unpatched RPX
+    constexpr std::uint32_t expected_crcs[section_count] = {
+        0x00000000, 0x14596B94, 0x165C39F2, 0xFA312336,
+        0x9BF039EE, 0xB3241733, 0x00000000, 0x60DA42CF,
+        0xEB7267F9, 0xF124402E, 0x01F80C21, 0x5E06092F,
+        0xD4CE0752, 0x72FA23E0, 0x940942DB, 0xBCFBF24D,
+        0x6B6574C9, 0x8D5FEDD5, 0x040E8EE3, 0xD5CEFF4A,
+        0xCFB2B47E, 0xE94CF6E0, 0x085C47BB, 0x279F690F,
+        0x598C85C9, 0x82F59D73, 0x2316975E, 0x00000000,
+        0x7D6C2996,
+    };
+
+    // Repeatable filler, limited to a few symbols so it compresses somewhat
+    class Filler {
+    public:
+        explicit Filler(std::uint32_t seed) : state(seed) { }
+
+        void fill(std::uint8_t *data, std::size_t size, std::uint8_t mask) {
+            for (std::size_t i = 0; i < size; ++i) {
+                state = state * 1103515245 + 12345;
+                data[i] = (state >> 16) & mask;
+            }
+        }
+
+    private:
+        std::uint32_t state;
+    };
+
+    void put_be16(fixture::bytes &out, std::uint16_t value) {
+        out.push_back(value >> 8);
+        out.push_back(value);
+    }
+
+    void put_be32(fixture::bytes &out, std::uint32_t value) {
+        put_be16(out, value >> 16);
+        put_be16(out, value);
+    }
+
+    void put_le16(fixture::bytes &out, std::uint16_t value) {
+        out.push_back(value);
+        out.push_back(value >> 8);
+    }
+
+    void put_le32(fixture::bytes &out, std::uint32_t value) {
+        put_le16(out, value);
+        put_le16(out, value >> 16);
+    }
+
+    void set_be32(std::uint8_t *out, std::uint32_t value) {
+        out[0] = value >> 24;
+        out[1] = value >> 16;
+        out[2] = value >> 8;
+        out[3] = value;
+    }
+
+    fixture::bytes make_rpx() {
+        std::vector<fixture::bytes> sections(section_count);
+        std::vector<std::uint32_t> types(section_count, 1);
+        std::vector<std::uint32_t> flags(section_count, 2);
+        Filler filler(1);
+
+        fixture::bytes text(fixture::text_size);
+        filler.fill(text.data(), text.size(), 0x0F);
+        uLongf cmp_len = ::compressBound(text.size());
+        sections[2].resize(4 + cmp_len);
+        set_be32(sections[2].data(), text.size());
+        if (::compress2(sections[2].data() + 4, &cmp_len, text.data(), text.size(), 6) != Z_OK)
+            throw std::runtime_error("fixture: compress text");
+        sections[2].resize(4 + cmp_len);
+        flags[2] = zlib_flag | 6;
+
+        for (std::size_t i = 3; i < 3 + fixture::other_count; ++i) {
+            sections[i].resize(fixture::other_size);
+            filler.fill(sections[i].data(), sections[i].size(), 0xFF);
+        }
+        for (std::size_t i = 3 + fixture::other_count; i < section_count; ++i) {
+            if (i == 6 || i == 27) continue;
+            sections[i].resize(0x100 + 0x40 * i);
+            filler.fill(sections[i].data(), sections[i].size(), 0xFF);
+        }
+
+        for (std::uint32_t crc : expected_crcs) put_be32(sections[27], crc);
+        types[27] = crcs_type;
+        flags[27] = 0;
+
+        fixture::bytes rpx;
+        const std::uint8_t ident[16] = { 0x7F, 'E', 'L', 'F', 1, 2, 1, 0xCA, 0xFE };
+        rpx.insert(rpx.end(), ident, ident + sizeof(ident));
+        put_be16(rpx, 0xFE01);          // e_type
+        put_be16(rpx, 20);              // e_machine
+        put_be32(rpx, 1);               // e_version
+        put_be32(rpx, 0x02026798);      // e_entry
+        put_be32(rpx, 0);               // e_phoff
+        put_be32(rpx, section_table);   // e_shoff
+        put_be32(rpx, 0);               // e_flags
+        put_be16(rpx, 52);              // e_ehsize
+        put_be16(rpx, 0);               // e_phentsize
+        put_be16(rpx, 0);               // e_phnum
+        put_be16(rpx, 40);              // e_shentsize
+        put_be16(rpx, section_count);   // e_shnum
+        put_be16(rpx, 26);              // e_shstrndx
+        rpx.resize(section_table);
+
+        std::uint32_t offset = section_table + 40 * section_count;
+        for (std::size_t i = 0; i < section_count; ++i) {
+            if (sections[i].empty()) {
+                rpx.resize(rpx.size() + 40);
+                continue;
+            }
+            offset = (offset + 0x3F) & ~0x3F;
+            std::uint32_t shdr[10] = { 0, types[i], flags[i], 0, offset,
+                                       static_cast<std::uint32_t>(sections[i].size()), 0, 0, 4, 0 };
+            for (std::uint32_t field : shdr) put_be32(rpx, field);
+            offset += sections[i].size();
+        }
+        for (const fixture::bytes &section : sections) {
+            if (section.empty()) continue;
+            rpx.resize((rpx.size() + 0x3F) & ~0x3F);
+            rpx.insert(rpx.end(), section.begin(), section.end());
+        }
+        rpx.resize((rpx.size() + 0x3F) & ~0x3F);
+        return rpx;
+    }
+
+    fixture::bytes deflate_rom(const fixture::bytes &rom) {
+        fixture::bytes data(::compressBound(rom.size()));
+        z_stream strm = { };
+        if (::deflateInit2(&strm, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("fixture: deflateInit2");
+        strm.next_in = const_cast<Bytef *>(rom.data());
+        strm.avail_in = rom.size();
+        strm.next_out = data.data();
+        strm.avail_out = data.size();
+        int ret = ::deflate(&strm, Z_FINISH);
+        data.resize(strm.total_out);
+        ::deflateEnd(&strm);
+        if (ret != Z_STREAM_END) throw std::runtime_error("fixture: deflate rom");
+        return data;
+    }
+
+    fixture::bytes make_zip(const fixture::bytes &rom, bool stored) {
+        const fixture::bytes data = stored ? rom : deflate_rom(rom);
+        const std::uint16_t method = stored ? 0 : 8;
+
+        const std::string name = "rom.nds";
+        std::uint32_t crc = ::crc32(0, rom.data(), rom.size());
+        fixture::bytes zip;
+        put_le32(zip, 0x04034B50);
+        put_le16(zip, 20);              // min_ver
+        put_le16(zip, 0);               // flags
+        put_le16(zip, method);          // method
+        put_le32(zip, 0);               // mod_time, mod_date
+        put_le32(zip, crc);
+        put_le32(zip, data.size());
+        put_le32(zip, rom.size());
+        put_le16(zip, name.size());
+        put_le16(zip, 0);               // extra_len
+        zip.insert(zip.end(), name.begin(), name.end());
+        zip.insert(zip.end(), data.begin(), data.end());
+
+        std::uint32_t central_offset = zip.size();
+        put_le32(zip, 0x02014B50);
+        put_le16(zip, 20);              // gen_ver
+        put_le16(zip, 20);              // min_ver
+        put_le16(zip, 0);               // flags
+        put_le16(zip, method);          // method
+        put_le32(zip, 0);               // mod_time, mod_date
+        put_le32(zip, crc);
+        put_le32(zip, data.size());
+        put_le32(zip, rom.size());
+        put_le16(zip, name.size());
+        put_le16(zip, 0);               // extra_len
+        put_le16(zip, 0);               // comment_len
+        put_le16(zip, 0);               // disk_start
+        put_le16(zip, 0);               // int_attr
+        put_le32(zip, 0);               // ext_attr
+        put_le32(zip, 0);               // local_offset
+        zip.insert(zip.end(), name.begin(), name.end());
+        std::uint32_t central_size = zip.size() - central_offset;
+
+        put_le32(zip, 0x06054B50);
+        put_le16(zip, 0);               // disk
+        put_le16(zip, 0);               // central_disk
+        put_le16(zip, 1);               // central_count
+        put_le16(zip, 1);               // central_count_total
+        put_le32(zip, central_size);
+        put_le32(zip, central_offset);
+        put_le16(zip, 0);               // comment_len
+        return zip;
+    }
+}
+
+fixture::TempDir::TempDir() {
+    const char *tmp = std::getenv("TMPDIR");
+    std::string pattern = std::string(tmp ? tmp : "/tmp") + "/am64ds-test-XXXXXX";
+    if (::mkdtemp(pattern.data()) == nullptr) throw std::runtime_error("fixture: mkdtemp");
+    dir = pattern;
+}
+
+fixture::TempDir::~TempDir() {
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+}
+
+fixture::bytes fixture::make_rom(std::size_t size) {
+    bytes rom(size);
+    Filler filler(2);
+    filler.fill(rom.data() + 0x8000, rom.size() - 0x8000, 0x07);
+    std::memcpy(rom.data(), "SUPERMARIO64", 12);
+    std::memcpy(rom.data() + 0x0C, "ASME", 4);
+    std::memcpy(rom.data() + 0x10, "01", 2);
+    rom[0x1E] = 0;
+    return rom;
+}
+
+void fixture::make_title(const std::string &dir, std::size_t rom_size, bool stored) {
+    fs::create_directories(dir + "/code");
+    fs::create_directories(dir + "/content/0010");
+    write_file(dir + "/code/hachihachi_ntr.rpx", make_rpx());
+    write_file(dir + "/content/0010/rom.zip", make_zip(make_rom(rom_size), stored));
+}
+
+fixture::bytes fixture::read_file(const std::string &path) {
+    bytes data;
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr) throw std::runtime_error("fixture: open " + path);
+    std::uint8_t buf[0x10000];
+    for (std::size_t n; (n = std::fread(buf, 1, sizeof(buf), file)) > 0; )
+        data.insert(data.end(), buf, buf + n);
+    std::fclose(file);
+    return data;
+}
+
+void fixture::write_file(const std::string &path, const bytes &data) {
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr) throw std::runtime_error("fixture: create " + path);
+    bool good = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    if (std::fclose(file) != 0 || !good) throw std::runtime_error("fixture: write " + path);
+}
+
+std::uint32_t fixture::be32(const std::uint8_t *data) {
+    return (std::uint32_t(data[0]) << 24) | (std::uint32_t(data[1]) << 16) |
+           (std::uint32_t(data[2]) << 8) | data[3];
+}
+
+std::uint32_t fixture::le32(const std::uint8_t *data) {
+    return (std::uint32_t(data[3]) << 24) | (std::uint32_t(data[2]) << 16) |
+           (std::uint32_t(data[1]) << 8) | data[0];
+}
+
+std::vector<fixture::Section> fixture::rpx_sections(const bytes &rpx) {
+    std::vector<Section> sections;
+    if (rpx.size() < section_table + 40 * section_count) return sections;
+    for (std::size_t i = 0; i < section_count; ++i) {
+        const std::uint8_t *shdr = rpx.data() + section_table + 40 * i;
+        sections.push_back({ be32(shdr + 4), be32(shdr + 8), be32(shdr + 16), be32(shdr + 20) });
+    }
+    return sections;
+}
+
+bool fixture::rpx_section(const bytes &rpx, const Section &section, bytes &data) {
+    if (section.offset + section.size > rpx.size()) return false;
+    const std::uint8_t *stored = rpx.data() + section.offset;
+    if (!(section.flags & zlib_flag)) {
+        data.assign(stored, stored + section.size);
+        return true;
+    }
+    if (section.size < 4) return false;
+    // Inflate with room to spare, so a wrong prefix shows as a mismatch
+    // rather than a truncated stream
+    std::uint32_t prefix = be32(stored);
+    data.resize(text_size * 2);
+    uLongf dec_len = data.size();
+    if (::uncompress(data.data(), &dec_len, stored + 4, section.size - 4) != Z_OK) return false;
+    data.resize(dec_len);
+    return prefix == dec_len;
+}
+
+bool fixture::zip_rom(const bytes &zip, bytes &rom, std::uint32_t &crc) {
+    if (zip.size() < 30 || le32(zip.data()) != 0x04034B50) return false;
+    std::uint16_t method = zip[8] | (zip[9] << 8);
+    crc = le32(zip.data() + 14);
+    std::uint32_t cmp_size = le32(zip.data() + 18);
+    std::uint32_t dec_size = le32(zip.data() + 22);
+    std::size_t data_off = 30 + (zip[26] | (zip[27] << 8)) + (zip[28] | (zip[29] << 8));
+    if (data_off + cmp_size > zip.size()) return false;
+
+    rom.resize(dec_size);
+    if (method == 0) {
+        if (cmp_size != dec_size) return false;
+        std::memcpy(rom.data(), zip.data() + data_off, dec_size);
+        return true;
+    }
+    if (method != 8) return false;
+    z_stream strm = { };
+    if (::inflateInit2(&strm, -MAX_WBITS) != Z_OK) return false;
+    strm.next_in = const_cast<Bytef *>(zip.data() + data_off);
+    strm.avail_in = cmp_size;
+    strm.next_out = rom.data();
+    strm.avail_out = rom.size();
+    int ret = ::inflate(&strm, Z_FINISH);
+    bool good = ret == Z_STREAM_END && strm.total_out == dec_size;
+    ::inflateEnd(&strm);
+    return good;
+}
@@ -0,0 +1,64 @@
+#ifndef TEST_FIXTURE_HPP
+#define TEST_FIXTURE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Synthetic titles for the host tests. They are laid out like the real
+// files closely enough for the patches, but built with plain zlib rather
+// than the engine's Zlib, so the engine's output is checked independently.
+namespace fixture {
+    using bytes = std::vector<std::uint8_t>;
+
+    // Directory for a test's titles, removed with everything in it
+    class TempDir {
+    public:
+        TempDir();
+        ~TempDir();
+
+        TempDir(const TempDir &) = delete;
+        TempDir &operator=(const TempDir &) = delete;
+
+        const std::string &path() const noexcept { return dir; }
+
+    private:
+        std::string dir;
+    };
+
+    // Sizes of the RPX sections make_title writes: the text, which is
+    // stored compressed, and three sections stored as they are
+    constexpr std::size_t text_size = 0x100000;
+    constexpr std::size_t other_size = 0x100000;
+    constexpr std::size_t other_count = 3;
+    // ROM in the ZIP, a USA revision 0 header followed by filler
+    constexpr std::size_t rom_size = 0x200000;
+
+    bytes make_rom(std::size_t size = rom_size);
+    // Writes code/hachihachi_ntr.rpx and content/0010/rom.zip under dir.
+    // The ROM is deflated unless stored is set.
+    void make_title(const std::string &dir, std::size_t rom_size = fixture::rom_size,
+                    bool stored = false);
+
+    bytes read_file(const std::string &path);
+    void write_file(const std::string &path, const bytes &data);
+
+    std::uint32_t be32(const std::uint8_t *data);
+    std::uint32_t le32(const std::uint8_t *data);
+
+    struct Section {
+        std::uint32_t type;
+        std::uint32_t flags;
+        std::uint32_t offset;
+        std::uint32_t size;
+    };
+    std::vector<Section> rpx_sections(const bytes &rpx);
+    // Stored data of an RPX section, inflated if compressed. The length
+    // prefix of a compressed section must match what it inflates to.
+    bool rpx_section(const bytes &rpx, const Section &section, bytes &data);
+
+    // ROM held by a single-file ZIP, with the CRC32 its local header gives
+    bool zip_rom(const bytes &zip, bytes &rom, std::uint32_t &crc);
+}
+
+#endif // TEST_FIXTURE_HPP
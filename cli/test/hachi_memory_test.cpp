@@ -0,0 +1,45 @@
+#include <cstdio>
+#include <string>
+
+#include "alloc_count.hpp"
+#include "check.hpp"
+#include "fixture.hpp"
+#include "hachi_patch.hpp"
+#include "iosufsa.hpp"
+
+// STREAM copies the sections it leaves alone a chunk at a time, so it must
+// never hold them as REWRITE does. Both are measured on the same title.
+namespace {
+    // Returns the most bytes allocated at once by the patch
+    std::size_t measure(const IOSUFSA &fsa, HachiMode mode) {
+        fixture::TempDir dir;
+        fixture::make_title(dir.path());
+
+        alloc_count::reset_peak();
+        std::size_t before = alloc_count::current();
+        {
+            auto patch = hachi_patch(fsa, dir.path(), mode);
+            patch->Read();
+            patch->Modify();
+            patch->Write();
+        }
+        std::size_t peak = alloc_count::peak() - before;
+        std::printf("RPX patch, %s: peak %zu KiB allocated\n",
+                    mode == HachiMode::STREAM ? "STREAM" : "REWRITE", peak >> 10);
+        CHECK(hachi_check(fsa, dir.path()) == Patch::Status::PATCHED);
+        return peak;
+    }
+}
+
+int main() {
+    IOSUFSA fsa;
+    fsa.open();
+    std::size_t rewrite = measure(fsa, HachiMode::REWRITE);
+    std::size_t stream = measure(fsa, HachiMode::STREAM);
+    // REWRITE holds the other sections while the text is compressed, which
+    // is when either mode peaks. STREAM's own buffers are only a few chunks,
+    // so it must save well over a section's worth.
+    CHECK(rewrite > stream + fixture::other_size);
+    fsa.close();
+    return 0;
+}
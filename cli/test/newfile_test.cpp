@@ -0,0 +1,131 @@
+#include <filesystem>
+#include <string>
+
+#include "check.hpp"
+#include "fixture.hpp"
+#include "hachi_patch.hpp"
+#include "iosufsa.hpp"
+
+// What a commit cut short leaves beside the file, and how it's put back
+namespace {
+    const fixture::bytes old_data = { 'o', 'l', 'd' };
+    const fixture::bytes new_data = { 'n', 'e', 'w' };
+
+    bool exists(const std::string &path) {
+        return std::filesystem::exists(path);
+    }
+
+    void check_commit(const IOSUFSA &fsa, const std::string &path) {
+        fixture::write_file(path, old_data);
+        {
+            IOSUFSA::NewFile file(fsa, path);
+            CHECK(file.open());
+            CHECK(file.writeall(new_data.data(), new_data.size()));
+            // The old file is still there to read until the commit
+            CHECK(fixture::read_file(path) == old_data);
+            CHECK(file.commit());
+        }
+        CHECK(fixture::read_file(path) == new_data);
+        CHECK(!exists(path + ".tmp") && !exists(path + ".bak"));
+
+        // Without a commit, the old file is kept and the new one removed
+        {
+            IOSUFSA::NewFile file(fsa, path);
+            CHECK(file.open());
+            CHECK(file.writeall(old_data.data(), old_data.size()));
+        }
+        CHECK(fixture::read_file(path) == new_data);
+        CHECK(!exists(path + ".tmp"));
+    }
+
+    void check_recover(const IOSUFSA &fsa, const std::string &path) {
+        std::filesystem::remove(path);
+
+        // Old file moved aside, new one complete but not yet moved
+        fixture::write_file(path + ".tmp", new_data);
+        fixture::write_file(path + ".bak", old_data);
+        CHECK(IOSUFSA::NewFile::recover(fsa, path));
+        CHECK(fixture::read_file(path) == new_data);
+        CHECK(!exists(path + ".tmp") && !exists(path + ".bak"));
+        std::filesystem::remove(path);
+
+        // Old file moved aside, and the new one lost
+        fixture::write_file(path + ".bak", old_data);
+        CHECK(IOSUFSA::NewFile::recover(fsa, path));
+        CHECK(fixture::read_file(path) == old_data);
+        CHECK(!exists(path + ".bak"));
+
+        // Nothing is touched while the file is in place
+        fixture::write_file(path + ".tmp", new_data);
+        CHECK(IOSUFSA::NewFile::recover(fsa, path));
+        CHECK(fixture::read_file(path) == old_data);
+        CHECK(exists(path + ".tmp"));
+        std::filesystem::remove(path);
+
+        // A new file that was never committed may be cut short, so it
+        // isn't taken even with nothing else left
+        CHECK(!IOSUFSA::NewFile::recover(fsa, path));
+        CHECK(!exists(path));
+        std::filesystem::remove(path + ".tmp");
+
+        CHECK(!IOSUFSA::NewFile::recover(fsa, path));
+    }
+
+    // A write cut short leaves part of the new file beside the old one.
+    // It's never taken over the old file, and the next write removes it.
+    void check_interrupted(const IOSUFSA &fsa, const std::string &path) {
+        fixture::write_file(path, old_data);
+        // Never destructed, as if the console lost power mid-write
+        IOSUFSA::NewFile *cut = new IOSUFSA::NewFile(fsa, path);
+        CHECK(cut->open());
+        CHECK(cut->writeall(new_data.data(), 1));
+        CHECK(cut->close());
+        CHECK(exists(path + ".tmp"));
+
+        CHECK(IOSUFSA::NewFile::recover(fsa, path));
+        CHECK(fixture::read_file(path) == old_data);
+        CHECK(exists(path + ".tmp"));
+
+        {
+            IOSUFSA::NewFile file(fsa, path);
+            CHECK(file.open());
+            CHECK(std::filesystem::file_size(path + ".tmp") == 0);
+        }
+        CHECK(fixture::read_file(path) == old_data);
+        CHECK(!exists(path + ".tmp") && !exists(path + ".bak"));
+
+        // A commit cut short is finished before the next write starts
+        fixture::write_file(path + ".bak", old_data);
+        fixture::write_file(path + ".tmp", new_data);
+        std::filesystem::remove(path);
+        {
+            IOSUFSA::NewFile file(fsa, path);
+            CHECK(file.open());
+        }
+        CHECK(fixture::read_file(path) == new_data);
+        CHECK(!exists(path + ".tmp") && !exists(path + ".bak"));
+    }
+
+    // A scan finishes the commit instead of reporting the RPX missing
+    void check_scan(const IOSUFSA &fsa, const std::string &title) {
+        fixture::make_title(title);
+        std::string rpx = title + std::string(hachi_file);
+        std::filesystem::copy_file(rpx, rpx + ".bak");
+        std::filesystem::rename(rpx, rpx + ".tmp");
+        CHECK(hachi_stat_check(fsa, title) == Patch::Status::UNTESTED);
+        CHECK(exists(rpx) && !exists(rpx + ".tmp") && !exists(rpx + ".bak"));
+        CHECK(hachi_check(fsa, title) == Patch::Status::RPX_ONLY);
+    }
+}
+
+int main() {
+    IOSUFSA fsa;
+    fsa.open();
+    fixture::TempDir dir;
+    check_commit(fsa, dir.path() + "/file");
+    check_recover(fsa, dir.path() + "/file");
+    check_interrupted(fsa, dir.path() + "/interrupted");
+    check_scan(fsa, dir.path() + "/title");
+    fsa.close();
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+
+#include <zlib.h>
+
+#include "alloc_count.hpp"
+#include "check.hpp"
+#include "exception.hpp"
+#include "fixture.hpp"
+#include "iosufsa.hpp"
+#include "ntr_patch.hpp"
+#include "thread.hpp"
+
+// The ROM is streamed from the old ZIP into the new one, so the patch
+// never holds it whole, and a ROM that doesn't match the CRC32 in its
+// local header is refused before anything is committed
+namespace {
+    void patch(const IOSUFSA &fsa, const std::string &title) {
+        auto ntr = ntr_patch(fsa, title);
+        ntr->Read();
+        ntr->Modify();
+        ntr->Write();
+    }
+
+    // What the patch may hold at once: four 64 KiB FSA chunks, the 64 KiB
+    // copy window, the Deflater's 224 KiB of input and 221 KiB of output and
+    // the inflate state, rounded up, then a 256 KiB deflate state for each
+    // block compressed at once. That is 1.6 MiB on the console's three cores.
+    std::size_t peak_budget() {
+        return 0xE0000 + std::min<std::size_t>(Thread::cores(), 3) * 0x40000;
+    }
+
+    // Returns the most bytes allocated at once by the patch
+    std::size_t check_stream(const IOSUFSA &fsa, const std::string &title,
+                             std::size_t rom_size, bool stored = false) {
+        fixture::make_title(title, rom_size, stored);
+        CHECK(ntr_check(fsa, title) == Patch::Status::IS_USA);
+
+        alloc_count::reset_peak();
+        std::size_t before = alloc_count::current();
+        patch(fsa, title);
+        std::size_t peak = alloc_count::peak() - before;
+        std::printf("NTR patch of a %zu KiB ROM: peak %zu KiB allocated\n",
+                    rom_size >> 10, peak >> 10);
+        CHECK(peak <= peak_budget());
+
+        fixture::bytes zip = fixture::read_file(title + std::string(zip_file));
+        fixture::bytes rom;
+        std::uint32_t crc;
+        CHECK(fixture::zip_rom(zip, rom, crc));
+        // The ROM keeps the method it was stored with
+        CHECK((zip[8] | (zip[9] << 8)) == (stored ? 0 : 8));
+        if (stored) CHECK(fixture::le32(zip.data() + 18) == rom_size);
+        CHECK(rom.size() == rom_size);
+        CHECK(::crc32(0, rom.data(), rom.size()) == crc);
+        // Only the branch and the padding it jumps to are changed
+        fixture::bytes original = fixture::make_rom(rom_size);
+        for (std::size_t i = 0; i < rom_size; ++i) {
+            bool edited = (i >= 0x495C && i < 0x4960) || (i >= 0x65A0 && i < 0x65A0 + 0xA60);
+            if (!edited) CHECK(rom[i] == original[i]);
+        }
+        CHECK(!std::equal(rom.begin() + 0x65A0, rom.begin() + 0x65A0 + 0xA60,
+                          original.begin() + 0x65A0));
+        return peak;
+    }
+
+    void check_bad_crc(const IOSUFSA &fsa, const std::string &title) {
+        fixture::make_title(title);
+        std::string zip = title + std::string(zip_file);
+        fixture::bytes data = fixture::read_file(zip);
+        data[14] ^= 0xFF;
+        fixture::write_file(zip, data);
+
+        bool refused = false;
+        try {
+            patch(fsa, title);
+        } catch (error &e) {
+            refused = true;
+        }
+        CHECK(refused);
+        CHECK(fixture::read_file(zip) == data);
+        CHECK(!std::filesystem::exists(zip + ".tmp"));
+    }
+}
+
+int main() {
+    IOSUFSA fsa;
+    fsa.open();
+    fixture::TempDir dir;
+    // What the patch holds is set by its buffers, not by the ROM
+    std::size_t small = check_stream(fsa, dir.path() + "/small", fixture::rom_size);
+    std::size_t large = check_stream(fsa, dir.path() + "/large", fixture::rom_size * 8);
+    CHECK(large < small + small / 8);
+    check_stream(fsa, dir.path() + "/stored", fixture::rom_size, true);
+    check_bad_crc(fsa, dir.path() + "/bad_crc");
+    fsa.close();
+    return 0;
+}
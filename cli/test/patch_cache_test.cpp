@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <zlib.h>
+
+#include "check.hpp"
+#include "fixture.hpp"
+#include "hachi_patch.hpp"
+#include "iosufsa.hpp"
+#include "patch_cache.hpp"
+
+// A cached RPX is only used if its text is sound, even when the entry's
+// own CRC32 matches, as it does for entries made by a broken build
+namespace {
+    constexpr std::size_t entry_header = 28;
+
+    // Stands in for the patch when the entry must be a hit
+    class NoPatch : public Patch {
+    public:
+        virtual void Read() override { CHECK(!"patched on a hit"); }
+        virtual void Modify() override { CHECK(!"patched on a hit"); }
+        virtual void Write() override { CHECK(!"patched on a hit"); }
+    };
+
+    void run(const IOSUFSA &fsa, const PatchCache &cache, const std::string &title,
+             bool hit = false) {
+        std::unique_ptr<Patch> inner;
+        if (hit) inner = std::make_unique<NoPatch>();
+        else inner = hachi_patch(fsa, title);
+        auto patch = cache.wrap(std::move(inner), fsa, title + std::string(hachi_file),
+                                "hachi", hachi_version(), hachi_cache_check);
+        patch->Read();
+        patch->Modify();
+        patch->Write();
+    }
+
+    std::string only_entry(const std::string &dir) {
+        std::string entry;
+        for (const auto &file : std::filesystem::directory_iterator(dir)) {
+            CHECK(entry.empty());
+            entry = file.path().string();
+        }
+        CHECK(!entry.empty());
+        return entry;
+    }
+
+    std::uint32_t text_prefix(const fixture::bytes &rpx) {
+        return fixture::be32(rpx.data() + fixture::rpx_sections(rpx)[2].offset);
+    }
+
+    void set_be32(std::uint8_t *data, std::uint32_t value) {
+        data[0] = value >> 24;
+        data[1] = value >> 16;
+        data[2] = value >> 8;
+        data[3] = value;
+    }
+}
+
+int main() {
+    IOSUFSA fsa;
+    fsa.open();
+    fixture::TempDir dir;
+    std::string cache_dir = dir.path() + "/cache";
+    std::string first = dir.path() + "/first", second = dir.path() + "/second";
+    fixture::make_title(first);
+    fixture::make_title(second);
+    PatchCache cache(cache_dir);
+
+    // A miss patches the title and stores the output
+    run(fsa, cache, first);
+    std::string entry = only_entry(cache_dir);
+    fixture::bytes patched = fixture::read_file(first + std::string(hachi_file));
+    fixture::bytes stored = fixture::read_file(entry);
+    CHECK(stored.size() == entry_header + patched.size());
+    CHECK(std::equal(patched.begin(), patched.end(), stored.begin() + entry_header));
+
+    // Swap the text's length prefix in the entry, as a little-endian build
+    // stored it, and give the entry the CRC32 of what it now holds
+    fixture::bytes bad(stored.begin() + entry_header, stored.end());
+    std::uint8_t *prefix = bad.data() + fixture::rpx_sections(bad)[2].offset;
+    std::swap(prefix[0], prefix[3]);
+    std::swap(prefix[1], prefix[2]);
+    set_be32(stored.data() + 20, ::crc32(0, bad.data(), bad.size()));
+    std::copy(bad.begin(), bad.end(), stored.begin() + entry_header);
+    fixture::write_file(entry, stored);
+
+    // The bad entry is a miss, so the title is patched and the entry replaced
+    run(fsa, cache, second);
+    fixture::bytes repatched = fixture::read_file(second + std::string(hachi_file));
+    CHECK(repatched == patched);
+    CHECK(text_prefix(repatched) != text_prefix(bad));
+    CHECK(fixture::read_file(only_entry(cache_dir)) != stored);
+
+    // A good entry is a hit, with the same output
+    fixture::TempDir other;
+    fixture::make_title(other.path());
+    run(fsa, cache, other.path(), true);
+    CHECK(fixture::read_file(other.path() + std::string(hachi_file)) == patched);
+
+    fsa.close();
+    return 0;
+}
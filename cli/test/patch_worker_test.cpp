@@ -0,0 +1,65 @@
+#include <string>
+#include <vector>
+
+#include "check.hpp"
+#include "exception.hpp"
+#include "fixture.hpp"
+#include "iosufsa.hpp"
+#include "ntr_patch.hpp"
+#include "patch.hpp"
+#include "patch_worker.hpp"
+#include "progress.hpp"
+
+// A batch where the middle title's ROM doesn't match its CRC32. The worker
+// must name that title, whatever else was running, and keep the progress of
+// the titles patched before it.
+namespace {
+    std::vector<std::string> make_titles(const std::string &dir) {
+        std::vector<std::string> titles;
+        for (const char *name : { "/first", "/bad", "/last" }) {
+            titles.push_back(dir + name);
+            fixture::make_title(titles.back());
+        }
+        std::string zip = titles[1] + std::string(zip_file);
+        fixture::bytes data = fixture::read_file(zip);
+        data[14] ^= 0xFF;
+        fixture::write_file(zip, data);
+        return titles;
+    }
+
+    void check_batch(const IOSUFSA &fsa, bool pipeline) {
+        fixture::TempDir dir;
+        Progress progress;
+        PatchOptions options;
+        options.pipeline = pipeline;
+        PatchWorker worker(fsa, make_titles(dir.path()), progress, nullptr, nullptr, options);
+        bool thrown = false;
+        try {
+            worker.join();
+        } catch (error &e) {
+            thrown = true;
+        }
+        CHECK(thrown);
+        CHECK(worker.failed() == 1);
+        CHECK(!worker.title_progress(1).finished);
+        CHECK(!worker.title_progress(2).finished);
+        if (pipeline) return;
+
+        // Serially, the first title is done before the second starts
+        const Progress::Snapshot &first = worker.title_progress(0);
+        CHECK(first.finished && first.titles_done == 1);
+        CHECK(first.get(Progress::Stage::HACHI, Progress::Bytes::READ) > 0);
+        CHECK(first.get(Progress::Stage::NTR, Progress::Bytes::WRITTEN) > 0);
+        Progress::Snapshot batch = progress.snapshot();
+        CHECK(first.total(Progress::Bytes::READ) < batch.total(Progress::Bytes::READ));
+    }
+}
+
+int main() {
+    IOSUFSA fsa;
+    fsa.open();
+    check_batch(fsa, false);
+    check_batch(fsa, true);
+    fsa.close();
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "check.hpp"
+#include "fixture.hpp"
+#include "hachi_patch.hpp"
+#include "iosufsa.hpp"
+#include "zlib.hpp"
+
+// The compressed text of a patched RPX is read back with plain zlib. Its
+// length prefix must be big-endian, as the console reads it, and match the
+// inflated text, whose CRC must be the one stored in section 27.
+namespace {
+    void check_prefix() {
+        Zlib::bytes text(0x60100);
+        for (std::size_t i = 0; i < text.size(); ++i) text[i] = (i * 7) & 0x0F;
+        Zlib::bytes cmp = Zlib::compress(text, true);
+        CHECK(cmp.size() > 4);
+        CHECK(cmp[0] == 0x00 && cmp[1] == 0x06 && cmp[2] == 0x01 && cmp[3] == 0x00);
+
+        fixture::bytes dec(text.size());
+        uLongf dec_len = dec.size();
+        CHECK(::uncompress(dec.data(), &dec_len, cmp.data() + 4, cmp.size() - 4) == Z_OK);
+        CHECK(dec_len == text.size() && dec == text);
+    }
+
+    void check_patched(const IOSUFSA &fsa, HachiMode mode) {
+        fixture::TempDir dir;
+        fixture::make_title(dir.path());
+        CHECK(hachi_check(fsa, dir.path()) == Patch::Status::RPX_ONLY);
+
+        auto patch = hachi_patch(fsa, dir.path(), mode);
+        patch->Read();
+        patch->Modify();
+        patch->Write();
+        CHECK(hachi_check(fsa, dir.path()) == Patch::Status::PATCHED);
+
+        fixture::bytes rpx = fixture::read_file(dir.path() + std::string(hachi_file));
+        std::vector<fixture::Section> sections = fixture::rpx_sections(rpx);
+        CHECK(sections.size() == 29);
+        CHECK(sections[2].flags & 0x08000000);
+        CHECK(sections[27].size == 29 * 4);
+
+        fixture::bytes text;
+        CHECK(fixture::rpx_section(rpx, sections[2], text));
+        CHECK(text.size() > fixture::text_size);
+        std::uint32_t crc = fixture::be32(rpx.data() + sections[27].offset + 2 * 4);
+        CHECK(::crc32(0, text.data(), text.size()) == crc);
+    }
+}
+
+int main() {
+    check_prefix();
+
+    IOSUFSA fsa;
+    fsa.open();
+    check_patched(fsa, HachiMode::REWRITE);
+    check_patched(fsa, HachiMode::STREAM);
+    check_patched(fsa, HachiMode::IN_PLACE);
+    fsa.close();
+    return 0;
+}
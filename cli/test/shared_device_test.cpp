@@ -0,0 +1,73 @@
+#include <cstddef>
+
+#include "check.hpp"
+#include "shared_device.hpp"
+
+// The installer's sessions, played against a stand-in for the IOSUHAX
+// device: while main keeps its session for the whole run, the scan, patch
+// and rescan sessions reuse the device instead of each starting it again
+namespace {
+    struct StandIn {
+        SharedDevice shared;
+        std::size_t opens = 0;
+        std::size_t closes = 0;
+        bool fail = false;
+
+        bool open() {
+            if (fail) return false;
+            ++opens;
+            return true;
+        }
+        bool close() {
+            ++closes;
+            return true;
+        }
+    };
+
+    void acquire(StandIn &device) {
+        CHECK(device.shared.acquire([&device]() -> bool { return device.open(); }));
+    }
+
+    void release(StandIn &device) {
+        CHECK(device.shared.release([&device]() -> bool { return device.close(); }));
+    }
+
+    // A scan, then a patch with a session per file, then the rescan after
+    void run_sessions(StandIn &device) {
+        acquire(device);
+        release(device);
+
+        acquire(device);
+        acquire(device);
+        release(device);
+        release(device);
+
+        acquire(device);
+        release(device);
+    }
+}
+
+int main() {
+    StandIn held;
+    acquire(held);
+    run_sessions(held);
+    CHECK(held.opens == 1 && held.closes == 0);
+    release(held);
+    CHECK(held.opens == 1 && held.closes == 1);
+    CHECK(held.shared.users() == 0);
+
+    StandIn unheld;
+    run_sessions(unheld);
+    CHECK(unheld.opens == 3 && unheld.closes == 3);
+
+    // A failed open leaves no user behind, so the next session tries again
+    StandIn failing;
+    failing.fail = true;
+    CHECK(!failing.shared.acquire([&failing]() -> bool { return failing.open(); }));
+    CHECK(failing.shared.users() == 0);
+    failing.fail = false;
+    acquire(failing);
+    release(failing);
+    CHECK(failing.opens == 1 && failing.closes == 1);
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include <array>
 #include <cstdint>
 #include <cstring>
+#include <memory>
 #include <numeric>
 #include <string>
 #include <string_view>
@@ -15,6 +16,7 @@
 #include "exception.hpp"
 #include "iosufsa.hpp"
 #include "log.hpp"
+#include "patch_cache.hpp"
 #include "util.hpp"
 #include "zlib.hpp"
 
@@ -30,7 +32,6 @@ namespace {
     constexpr Elf32_Word RPX_CRCS = 0x80000003;
     constexpr std::uint32_t ZLIB_SECT = 0x08000000;
 
-    constexpr std::string_view hachi_file = "/code/hachihachi_ntr.rpx"sv;
     constexpr std::uint32_t magic_amds = util::magic_const("AMDS");
 
     static_assert(sizeof(Elf32_Ehdr) == 52);
@@ -55,6 +56,37 @@ namespace {
         0x7D6C2996,
     };
 
+    // The RPX headers are stored big-endian. These convert between that
+    // and the native order, and do nothing on the console.
+    void be_ehdr(Elf32_Ehdr &ehdr) {
+        ehdr.e_type = util::be(ehdr.e_type);
+        ehdr.e_machine = util::be(ehdr.e_machine);
+        ehdr.e_version = util::be(ehdr.e_version);
+        ehdr.e_entry = util::be(ehdr.e_entry);
+        ehdr.e_phoff = util::be(ehdr.e_phoff);
+        ehdr.e_shoff = util::be(ehdr.e_shoff);
+        ehdr.e_flags = util::be(ehdr.e_flags);
+        ehdr.e_ehsize = util::be(ehdr.e_ehsize);
+        ehdr.e_phentsize = util::be(ehdr.e_phentsize);
+        ehdr.e_phnum = util::be(ehdr.e_phnum);
+        ehdr.e_shentsize = util::be(ehdr.e_shentsize);
+        ehdr.e_shnum = util::be(ehdr.e_shnum);
+        ehdr.e_shstrndx = util::be(ehdr.e_shstrndx);
+    }
+
+    void be_shdr(Elf32_Shdr &shdr) {
+        shdr.sh_name = util::be(shdr.sh_name);
+        shdr.sh_type = util::be(shdr.sh_type);
+        shdr.sh_flags = util::be(shdr.sh_flags);
+        shdr.sh_addr = util::be(shdr.sh_addr);
+        shdr.sh_offset = util::be(shdr.sh_offset);
+        shdr.sh_size = util::be(shdr.sh_size);
+        shdr.sh_link = util::be(shdr.sh_link);
+        shdr.sh_info = util::be(shdr.sh_info);
+        shdr.sh_addralign = util::be(shdr.sh_addralign);
+        shdr.sh_entsize = util::be(shdr.sh_entsize);
+    }
+
     bool good_layout(const std::vector<Elf32_Shdr> &shdr, const std::vector<std::size_t> &sorted) {
         std::uint32_t last_off = 0x40 + sizeof(Elf32_Shdr) * shdr.size();
         for (std::size_t i : sorted) {
@@ -66,31 +98,41 @@ namespace {
         return true;
     }
 
-    bool decompress_sect(Elf32_Shdr &shdr, std::vector<std::uint8_t> &data) {
-        if (!(shdr.sh_flags & ZLIB_SECT)) return true;
+    // Both use scratch for the new contents and swap it with data, so the
+    // old buffer is left in scratch to be reused
+    bool decompress_sect(Elf32_Shdr &shdr, IOSUFSA::Buffer &data,
+                         IOSUFSA::Buffer &scratch, std::uint32_t &crc) {
+        if (!(shdr.sh_flags & ZLIB_SECT)) {
+            crc = Zlib::crc32(0, data.data(), data.size());
+            return true;
+        }
         if (shdr.sh_size != data.size()) return false;
         if (shdr.sh_size < 4) return false;
-        std::uint32_t dec_len = *reinterpret_cast<const std::uint32_t *>(data.data());
+        std::uint32_t dec_len = util::be(*reinterpret_cast<const std::uint32_t *>(data.data()));
 
         LOG("Inflate");
-        data = Zlib::decompress(data, dec_len, true);
+        scratch.resize(dec_len);
+        Zlib::decompress_into(data.data(), data.size(), scratch.data(), dec_len, true, crc);
+        data.swap(scratch);
 
         shdr.sh_size = dec_len;
         shdr.sh_flags &= ~ZLIB_SECT;
         return true;
     }
 
-    bool compress_sect(Elf32_Shdr &shdr, std::vector<std::uint8_t> &data) {
+    bool compress_sect(Elf32_Shdr &shdr, IOSUFSA::Buffer &data, IOSUFSA::Buffer &scratch) {
         if (shdr.sh_flags & ZLIB_SECT) return true;
         if (shdr.sh_size != data.size()) return false;
 
-        std::vector<std::uint8_t> cmp;
         LOG("Deflate");
-        cmp = Zlib::compress(data, true);
-
-        if (cmp.size() < data.size()) {
-            shdr.sh_size = cmp.size();
-            data = std::move(cmp);
+        scratch.resize(Zlib::compress_bound(data.size(), true));
+        std::size_t cmp_len = Zlib::compress_into(data.data(), data.size(),
+                                                  scratch.data(), scratch.size(), true);
+
+        if (cmp_len < data.size()) {
+            scratch.resize(cmp_len);
+            shdr.sh_size = cmp_len;
+            data.swap(scratch);
             shdr.sh_flags |= ZLIB_SECT;
         }
         return true;
@@ -110,21 +152,144 @@ namespace {
         }
     }
 
-    void make_b(std::vector<std::uint8_t> &data, std::size_t offset, std::size_t target) {
+    // Writes value at offset and updates crc, the CRC32 of data, to match
+    template<typename T>
+    void patch_crc(IOSUFSA::Buffer &data, std::uint32_t &crc,
+                   std::size_t offset, T value) {
+        T &dest = *reinterpret_cast<T *>(data.data() + offset);
+        crc = Zlib::crc32_patch(crc, data.size(), offset, &dest, &value, sizeof(T));
+        dest = value;
+    }
+
+    void make_b(IOSUFSA::Buffer &data, std::uint32_t &crc,
+                std::size_t offset, std::size_t target) {
         std::uint32_t inst = (0x48000000 | (target - offset)) & 0xFFFFFFFC;
-        *reinterpret_cast<std::uint32_t *>(data.data() + offset) = inst;
+        patch_crc(data, crc, offset, util::be(inst));
     }
 
-    void make_u16(std::vector<std::uint8_t> &data, std::size_t offset, std::uint16_t value) {
-        *reinterpret_cast<std::uint16_t *>(data.data() + offset) = value;
+    void make_u16(IOSUFSA::Buffer &data, std::uint32_t &crc,
+                  std::size_t offset, std::uint16_t value) {
+        patch_crc(data, crc, offset, util::be(value));
     }
 
     const std::uint8_t zero_pad[0x40] = { };
 
+    // Sections streamed from the old file are copied in chunks of this size
+    constexpr std::size_t stream_chunk = 0x40000;
+
+    // Copies length bytes at offset in src to dest
+    bool copy_range(const IOSUFSA::File &src, std::size_t offset, std::size_t length,
+                    IOSUFSA::AsyncWriter &dest) {
+        if (!src.seek(offset)) return false;
+        IOSUFSA::AsyncReader reader(src, length, stream_chunk);
+        while (const IOSUFSA::Buffer *chunk = reader.next()) {
+            if (!dest.write(chunk->data(), chunk->size())) return false;
+        }
+        return true;
+    }
+
+    // Follows a patched RPX as it's streamed, inflating the text a window
+    // at a time as it goes by
+    class HachiCacheCheck : public PatchCache::Check {
+    public:
+        HachiCacheCheck() : inflater(true) { }
+        virtual ~HachiCacheCheck() override = default;
+
+        virtual void feed(const std::uint8_t *data, std::size_t size) override {
+            if (bad) return;
+            try {
+                feed_headers(data, size);
+                if (!bad && parsed) feed_sections(data, size);
+            } catch (error &e) {
+                LOG("RPX Check: %s", e.what());
+                bad = true;
+            }
+            pos += size;
+        }
+
+        virtual bool good() override {
+            return !bad && parsed && pos >= text_end && pos >= crcs_end &&
+                   inflater.finished() && text_len == util::be(text_prefix) &&
+                   inflater.crc() == util::be(crcs[2]);
+        }
+
+    private:
+        static constexpr std::size_t headers_len =
+            expected_ehdr.e_shoff + expected_ehdr.e_shnum * sizeof(Elf32_Shdr);
+
+        Zlib::Inflater inflater;
+        std::array<std::uint8_t, 0x8000> window;
+        std::array<std::uint8_t, headers_len> headers;
+        std::size_t pos = 0;
+        bool parsed = false;
+        bool bad = false;
+
+        Elf32_Shdr text;
+        Elf32_Shdr crcs_hdr;
+        std::uint32_t text_end = 0;
+        std::uint32_t crcs_end = 0;
+        std::uint32_t text_prefix = 0;
+        std::size_t text_len = 0;
+        std::array<std::uint32_t, expected_ehdr.e_shnum> crcs = { };
+
+        void feed_headers(const std::uint8_t *data, std::size_t size) {
+            if (pos >= headers_len) return;
+            std::size_t len = std::min(size, headers_len - pos);
+            std::memcpy(headers.data() + pos, data, len);
+            if (pos + len < headers_len) return;
+
+            Elf32_Ehdr ehdr;
+            std::memcpy(&ehdr, headers.data(), sizeof(ehdr));
+            be_ehdr(ehdr);
+            std::uint32_t magic;
+            std::memcpy(&magic, headers.data() + sizeof(ehdr), sizeof(magic));
+            std::memcpy(&text, headers.data() + ehdr.e_shoff + 2 * sizeof(Elf32_Shdr),
+                        sizeof(text));
+            std::memcpy(&crcs_hdr, headers.data() + ehdr.e_shoff + 27 * sizeof(Elf32_Shdr),
+                        sizeof(crcs_hdr));
+            be_shdr(text);
+            be_shdr(crcs_hdr);
+            parsed = true;
+
+            bad = !util::memequal(ehdr, expected_ehdr) || util::be(magic) != magic_amds ||
+                  !(text.sh_flags & ZLIB_SECT) || text.sh_size < sizeof(text_prefix) ||
+                  text.sh_offset < headers_len || crcs_hdr.sh_type != RPX_CRCS ||
+                  crcs_hdr.sh_size != sizeof(crcs) || crcs_hdr.sh_offset < headers_len;
+            text_end = text.sh_offset + text.sh_size;
+            crcs_end = crcs_hdr.sh_offset + crcs_hdr.sh_size;
+        }
+
+        // Copies the part of data at pos that falls within [off, off + len)
+        // of the file into dest, which holds that range
+        void capture(const std::uint8_t *data, std::size_t size,
+                     std::uint32_t off, std::uint32_t len, void *dest) {
+            std::size_t begin = std::max<std::size_t>(pos, off);
+            std::size_t end = std::min<std::size_t>(pos + size, off + len);
+            if (begin >= end) return;
+            std::memcpy(reinterpret_cast<std::uint8_t *>(dest) + (begin - off),
+                        data + (begin - pos), end - begin);
+        }
+
+        void feed_sections(const std::uint8_t *data, std::size_t size) {
+            capture(data, size, crcs_hdr.sh_offset, crcs_hdr.sh_size, crcs.data());
+            capture(data, size, text.sh_offset, sizeof(text_prefix), &text_prefix);
+
+            std::size_t begin = std::max<std::size_t>(pos, text.sh_offset + sizeof(text_prefix));
+            std::size_t end = std::min<std::size_t>(pos + size, text_end);
+            if (begin >= end) return;
+            inflater.input(data + (begin - pos), end - begin);
+            while (!inflater.finished()) {
+                std::size_t len = inflater.inflate(window.data(), window.size());
+                if (len == 0) break;
+                text_len += len;
+            }
+        }
+    };
+
     class HachiPatch : public Patch {
     public:
-        HachiPatch(const IOSUFSA &fsa, std::string_view title) :
-            fsa(fsa), path(util::concat_sv({ title, hachi_file })) { }
+        HachiPatch(const IOSUFSA &fsa, std::string_view title, HachiMode mode) :
+            fsa(fsa), path(util::concat_sv({ title, hachi_file })), mode(mode) { }
         virtual ~HachiPatch() override = default;
 
         virtual void Read() override {
@@ -134,6 +299,8 @@ namespace {
 
             LOG("Read Header");
             if (!rpx.readall(&ehdr, sizeof(ehdr))) throw error("RPX: Read Header");
+            count(Progress::Bytes::READ, sizeof(ehdr));
+            be_ehdr(ehdr);
             if (!util::memequal(ehdr, expected_ehdr)) throw error("RPX: Invalid Header");
 
             LOG("Read Sections Table");
@@ -142,6 +309,8 @@ namespace {
             if (!rpx.seek(ehdr.e_shoff)) throw error("RPX: Seek Sections");
             LOG("Read Sections Table - read");
             if (!rpx.readall(shdr)) throw error("RPX: Read Sections");
+            count(Progress::Bytes::READ, sizeof(Elf32_Shdr) * shdr.size());
+            std::for_each(shdr.begin(), shdr.end(), be_shdr);
             LOG("Read Sections Table - done");
 
             LOG("Get Sorted Sections");
@@ -156,13 +325,18 @@ namespace {
             LOG("Validate Sorted Sections");
             if (!good_layout(shdr, sorted_sects)) throw error("RPX: Bad Layout");
 
+            if (mode == HachiMode::IN_PLACE && !rpx.size(file_size)) throw error("RPX: Read Size");
+            // Where each section starts in the old file, for those streamed
+            for (const Elf32_Shdr &sect : shdr) src_offsets.push_back(sect.sh_offset);
             sections.resize(ehdr.e_shnum);
             for (std::size_t i : sorted_sects) {
+                if (!held(i)) continue;
                 if (shdr[i].sh_size > 0) {
                     LOG("Read Section %d", i);
                     sections[i].resize(shdr[i].sh_size);
                     if (!rpx.seek(shdr[i].sh_offset)) throw error("RPX: Seek Sect");
                     if (!rpx.readall(sections[i])) throw error("RPX: Read Sect");
+                    count(Progress::Bytes::READ, sections[i].size());
                 }
             }
 
@@ -172,80 +346,204 @@ namespace {
 
         virtual void Modify() override {
             Elf32_Shdr &text_hdr = shdr[2];
-            std::vector<std::uint8_t> &text = sections[2];
+            IOSUFSA::Buffer &text = sections[2];
 
             LOG("Decompress Text");
-            if (!decompress_sect(text_hdr, text)) throw error("RPX: Decompress Text");
+            std::uint32_t crc;
+            bool compressed = text_hdr.sh_flags & ZLIB_SECT;
+            if (!decompress_sect(text_hdr, text, scratch, crc)) throw error("RPX: Decompress Text");
+            if (compressed) count(Progress::Bytes::INFLATED, text.size());
 
             LOG("Patch Loaded Text");
-            make_u16(text, 0x006CEA, 0x6710);
-            make_b(  text, 0x00CC1C, text.size() + off_inject_apply_angle - off_inject_start);
-            make_b(  text, 0x01DA28, text.size() + off_inject_comp_angle - off_inject_start);
-            make_u16(text, 0x01DA42, 0x0018); // vpad->rstick.y offset
-            make_u16(text, 0x01DAD2, 0x0014); // vpad->rstick.x offset
-            make_u16(text, 0x03ED0E, 0x0BB0);
-            make_b(  text, 0x050938, text.size() + off_inject_init_angle - off_inject_start);
-            make_b(  text, 0x053F70, text.size() + off_inject_get_angle - off_inject_start);
-            text.insert(text.end(), inject_bin, inject_bin_end);
+            make_u16(text, crc, 0x006CEA, 0x6710);
+            make_b(  text, crc, 0x00CC1C, text.size() + off_inject_apply_angle - off_inject_start);
+            make_b(  text, crc, 0x01DA28, text.size() + off_inject_comp_angle - off_inject_start);
+            make_u16(text, crc, 0x01DA42, 0x0018); // vpad->rstick.y offset
+            make_u16(text, crc, 0x01DAD2, 0x0014); // vpad->rstick.x offset
+            make_u16(text, crc, 0x03ED0E, 0x0BB0);
+            make_b(  text, crc, 0x050938, text.size() + off_inject_init_angle - off_inject_start);
+            make_b(  text, crc, 0x053F70, text.size() + off_inject_get_angle - off_inject_start);
+            std::size_t text_len = text.size();
+            text.resize(text_len + inject_bin_size);
+            std::memcpy(text.data() + text_len, inject_bin, inject_bin_size);
             text_hdr.sh_size += inject_bin_size;
+            crc = Zlib::crc32(crc, inject_bin, inject_bin_size);
 
-            LOG("CRC Calc");
-            std::uint32_t crc = Zlib::crc32(text);
-            reinterpret_cast<std::uint32_t *>(sections[27].data())[2] = crc;
+            LOG("Store CRC");
+            reinterpret_cast<std::uint32_t *>(sections[27].data())[2] = util::be(crc);
 
             LOG("Compress Text");
-            if (!compress_sect(text_hdr, text)) throw error("RPX: Compress Text");
-
-            LOG("Shift for Resize");
-            shift_for_resize(2, shdr, sorted_sects);
+            count(Progress::Bytes::DEFLATED, text.size());
+            if (!compress_sect(text_hdr, text, scratch)) throw error("RPX: Compress Text");
+
+            if (mode == HachiMode::IN_PLACE) {
+                LOG("Move Text to End");
+                text_hdr.sh_offset = (file_size + 0x3F) & ~0x3F;
+            } else {
+                LOG("Shift for Resize");
+                shift_for_resize(2, shdr, sorted_sects);
+            }
         }
 
         virtual void Write() override {
+            if (mode == HachiMode::IN_PLACE) return write_in_place();
+
+            // Streaming, the old file is read while the new one is written
+            bool stream = mode == HachiMode::STREAM;
+            IOSUFSA::File src(fsa);
+            if (stream && !src.open(path, "rb")) throw error("RPX: Stream FileOpen");
+
             LOG("Open RPX Write");
-            IOSUFSA::File rpx(fsa);
-            if (!rpx.open(path, "wb"))  throw error("RPX: Write FileOpen");
+            IOSUFSA::NewFile rpx(fsa, path);
+            if (!rpx.open())  throw error("RPX: Write FileOpen");
+
+            // Headers, padding and sections are gathered into max_io writes
+            IOSUFSA::AsyncWriter writer(rpx, IOSUFSA::max_io);
 
             LOG("Write Header");
-            if (!rpx.writeall(&ehdr, sizeof(ehdr))) throw error("RPX: Write Header");
+            Elf32_Ehdr ehdr_out = ehdr;
+            be_ehdr(ehdr_out);
+            if (!writer.write(&ehdr_out, sizeof(ehdr_out))) throw error("RPX: Write Header");
 
             LOG("Write Pad");
-            if (!rpx.writeall(&magic_amds, sizeof(magic_amds))) throw error("RPX: Write Magic");
-            if (!rpx.writeall(zero_pad, ehdr.e_shoff - sizeof(ehdr) - sizeof(magic_amds)))
+            const std::uint32_t magic = util::be(magic_amds);
+            if (!writer.write(&magic, sizeof(magic))) throw error("RPX: Write Magic");
+            if (!writer.write(zero_pad, ehdr.e_shoff - sizeof(ehdr) - sizeof(magic_amds)))
                 throw error("RPX: Write ShPad");
 
             LOG("Write Section Table");
-            if (!rpx.writeall(shdr)) throw error("RPX: Write Sections");
+            std::vector<Elf32_Shdr> shdr_out = shdr;
+            std::for_each(shdr_out.begin(), shdr_out.end(), be_shdr);
+            if (!writer.write(shdr_out.data(), sizeof(Elf32_Shdr) * shdr_out.size()))
+                throw error("RPX: Write Sections");
 
             std::uint32_t last_off = 0x40 + sizeof(Elf32_Shdr) * shdr.size();
             for (std::size_t i : sorted_sects) {
                 if (shdr[i].sh_size > 0) {
                     LOG("Write Section %d", i);
                     const Elf32_Shdr &sect = shdr[i];
-                    if (!rpx.writeall(zero_pad, sect.sh_offset - last_off))
+                    if (!writer.write(zero_pad, sect.sh_offset - last_off))
                         throw error("RPX: Write StPad");
-                    if (!rpx.writeall(sections[i])) throw error("RPX: Write Sect");
+                    if (held(i)) {
+                        if (!writer.write(sections[i].data(), sections[i].size()))
+                            throw error("RPX: Write Sect");
+                    } else {
+                        if (!copy_range(src, src_offsets[i], sect.sh_size, writer))
+                            throw error("RPX: Stream Sect");
+                        count(Progress::Bytes::READ, sect.sh_size);
+                    }
                     last_off = sect.sh_offset + sect.sh_size;
                 }
             }
-            if (!rpx.writeall(zero_pad, -last_off & 0x3F)) throw error("RPX: Write FlPad");
+            if (!writer.write(zero_pad, -last_off & 0x3F)) throw error("RPX: Write FlPad");
+            if (!writer.flush()) throw error("RPX: Write Data");
+            count(Progress::Bytes::WRITTEN, last_off + (-last_off & 0x3F));
+
+            if (!src.close()) throw error("RPX: Stream FileClose");
+            LOG("Commit RPX Write");
+            if (!rpx.commit()) throw error("RPX: Write Commit");
+        }
 
-            LOG("Close RPX Write");
-            if (!rpx.close()) throw error("RPX: Write FileClose");
+        // The old text is left where it was, unreferenced, and the new one
+        // written past the end of the file. Then only the signature, the
+        // text's entry in the section table and the CRCs are overwritten.
+        void write_in_place() {
+            LOG("Open RPX Update");
+            IOSUFSA::File rpx(fsa);
+            if (!rpx.open(path, "r+")) throw error("RPX: Update FileOpen");
+
+            LOG("Append Text");
+            const Elf32_Shdr &text_hdr = shdr[2];
+            std::uint32_t end = text_hdr.sh_offset + text_hdr.sh_size;
+            if (!rpx.seek(file_size)) throw error("RPX: Seek End");
+            if (!rpx.writeall(zero_pad, text_hdr.sh_offset - file_size))
+                throw error("RPX: Write StPad");
+            if (!rpx.writeall(sections[2])) throw error("RPX: Write Sect");
+            if (!rpx.writeall(zero_pad, -end & 0x3F)) throw error("RPX: Write FlPad");
+
+            LOG("Update Section Table");
+            Elf32_Shdr text_out = text_hdr;
+            be_shdr(text_out);
+            if (!rpx.seek(ehdr.e_shoff + 2 * sizeof(Elf32_Shdr))) throw error("RPX: Seek Sections");
+            if (!rpx.writeall(&text_out, sizeof(text_out))) throw error("RPX: Write Sections");
+
+            LOG("Update CRCs");
+            if (!rpx.seek(shdr[27].sh_offset)) throw error("RPX: Seek CRCs");
+            if (!rpx.writeall(sections[27])) throw error("RPX: Write CRCs");
+
+            // The magic is what makes hachi_check report the file patched, so
+            // it's only written once everything else has been closed out to
+            // the filesystem. Cut short before then, the file is never taken
+            // for a patched one.
+            LOG("Close RPX Update");
+            if (!rpx.close()) throw error("RPX: Update FileClose");
+
+            LOG("Write Magic");
+            const std::uint32_t magic = util::be(magic_amds);
+            if (!rpx.open(path, "r+")) throw error("RPX: Magic FileOpen");
+            if (!rpx.seek(sizeof(ehdr))) throw error("RPX: Seek Magic");
+            if (!rpx.writeall(&magic, sizeof(magic))) throw error("RPX: Write Magic");
+            if (!rpx.close()) throw error("RPX: Magic FileClose");
+            count(Progress::Bytes::WRITTEN, (end + (-end & 0x3F) - file_size) + sizeof(magic) +
+                  sizeof(text_out) + sections[27].size());
         }
 
     private:
         const IOSUFSA &fsa;
         std::string path;
+        HachiMode mode;
+        std::size_t file_size = 0;
+        std::vector<std::uint32_t> src_offsets;
 
         Elf32_Ehdr ehdr;
         std::vector<Elf32_Shdr> shdr;
         std::vector<std::size_t> sorted_sects;
-        std::vector<std::vector<std::uint8_t>> sections;
+        std::vector<IOSUFSA::Buffer> sections;
+        IOSUFSA::Buffer scratch;
+
+        // Whether section i is read into sections, rather than left in the
+        // file. Only the text and CRCs are changed.
+        bool held(std::size_t i) const {
+            return mode == HachiMode::REWRITE || i == 2 || i == 27;
+        }
     };
 }
 
+Patch::Status hachi_stat_check(const IOSUFSA &fsa, std::string_view title) {
+    std::uint32_t size;
+    return hachi_stat_check(fsa, title, size);
+}
+
+Patch::Status hachi_stat_check(const IOSUFSA &fsa, std::string_view title, std::uint32_t &size) {
+    // Smallest RPX that holds the expected section table and CRC data
+    constexpr std::uint32_t min_size = expected_ehdr.e_shoff +
+        expected_ehdr.e_shnum * sizeof(Elf32_Shdr) + sizeof(expected_crcs);
+
+    std::string path = util::concat_sv({ title, hachi_file });
+    IOSUFSA::Stat stat;
+    bool found = fsa.stat(path, stat);
+    // A commit cut short is finished here, or the title would be dropped
+    if (!found) found = IOSUFSA::NewFile::recover(fsa, path) && fsa.stat(path, stat);
+    if (!found || stat.is_dir) return Patch::Status::MISSING_RPX;
+    if (stat.size < min_size) return Patch::Status::INVALID_RPX;
+    size = stat.size;
+    return Patch::Status::UNTESTED;
+}
+
 #define ret(X) do { rpx.close(); return X; } while(0)
 
+Patch::Status hachi_header_check(const IOSUFSA &fsa, std::string_view title) {
+    std::string rpx_path = util::concat_sv({ title, hachi_file });
+    IOSUFSA::File rpx(fsa);
+    if (!rpx.open(rpx_path, "rb")) ret(Patch::Status::MISSING_RPX);
+
+    Elf32_Ehdr ehdr;
+    if (!rpx.readall(&ehdr, sizeof(ehdr))) ret(Patch::Status::INVALID_RPX);
+    be_ehdr(ehdr);
+    if (!util::memequal(ehdr, expected_ehdr)) ret(Patch::Status::INVALID_RPX);
+    ret(Patch::Status::UNTESTED);
+}
+
 Patch::Status hachi_check(const IOSUFSA &fsa, std::string_view title) {
     std::string rpx_path = util::concat_sv({ title, hachi_file });
     LOG("Open RPX");
@@ -255,17 +553,19 @@ Patch::Status hachi_check(const IOSUFSA &fsa, std::string_view title) {
     LOG("Read Header");
     Elf32_Ehdr ehdr;
     if (!rpx.readall(&ehdr, sizeof(ehdr))) ret(Patch::Status::INVALID_RPX);
+    be_ehdr(ehdr);
     if (!util::memequal(ehdr, expected_ehdr)) ret(Patch::Status::INVALID_RPX);
 
     LOG("Read Patch Signature");
     std::uint32_t sig;
     if (!rpx.readall(&sig, sizeof(sig))) ret(Patch::Status::INVALID_RPX);
-    if (sig == magic_amds) ret(Patch::Status::PATCHED);
+    if (util::be(sig) == magic_amds) ret(Patch::Status::PATCHED);
 
     LOG("Read CRC Section Header");
     Elf32_Shdr crc_shdr;
     if (!rpx.seek(ehdr.e_shoff + 27 * sizeof(Elf32_Shdr))) ret(Patch::Status::INVALID_RPX);
     if (!rpx.readall(&crc_shdr, sizeof(crc_shdr))) ret(Patch::Status::INVALID_RPX);
+    be_shdr(crc_shdr);
     if (crc_shdr.sh_type != RPX_CRCS) ret(Patch::Status::INVALID_RPX);
     if (crc_shdr.sh_size != sizeof(expected_crcs)) ret(Patch::Status::INVALID_RPX);
 
@@ -273,12 +573,26 @@ Patch::Status hachi_check(const IOSUFSA &fsa, std::string_view title) {
     std::array<std::uint32_t, expected_ehdr.e_shnum> crcs;
     if (!rpx.seek(crc_shdr.sh_offset)) ret(Patch::Status::INVALID_RPX);
     if (!rpx.readall(&crcs, sizeof(crcs))) ret(Patch::Status::INVALID_RPX);
+    for (std::uint32_t &crc : crcs) crc = util::be(crc);
     if (!util::memequal(crcs, expected_crcs)) ret(Patch::Status::INVALID_RPX);
 
     LOG("HACHI GOOD");
     ret(Patch::Status::RPX_ONLY);
 }
 
-std::unique_ptr<Patch> hachi_patch(const IOSUFSA &fsa, std::string_view title) {
-    return std::make_unique<HachiPatch>(fsa, title);
+std::unique_ptr<Patch> hachi_patch(const IOSUFSA &fsa, std::string_view title, HachiMode mode) {
+    return std::make_unique<HachiPatch>(fsa, title, mode);
+}
+
+std::unique_ptr<PatchCache::Check> hachi_cache_check() {
+    return std::make_unique<HachiCacheCheck>();
+}
+
+std::uint32_t hachi_version(HachiMode mode) {
+    // Bump along with any change to Modify or Write. The payload speaks
+    // for itself, and updating in place lays the file out differently.
+    // Streaming writes the same file as rewriting.
+    constexpr std::uint32_t revision = 2;
+    std::uint32_t crc = Zlib::crc32(revision, inject_bin, inject_bin_size);
+    return mode == HachiMode::IN_PLACE ? crc + 1 : crc;
 }
@@ -1,13 +1,45 @@
 #ifndef HACHI_PATCH_HPP
 #define HACHI_PATCH_HPP
 
+#include <cstdint>
 #include <memory>
 #include <string_view>
 
 #include "iosufsa.hpp"
 #include "patch.hpp"
+#include "patch_cache.hpp"
 
+// RPX patched, relative to the title path
+constexpr std::string_view hachi_file = "/code/hachihachi_ntr.rpx";
+
+// How hachi_patch writes the RPX. REWRITE writes the whole file again, with
+// the sections after the grown text moved along. IN_PLACE appends the text
+// to the end of the file and overwrites only the headers and CRCs that
+// change, so the other sections are neither read nor written. It edits the
+// file itself rather than replacing it through a NewFile, so an update cut
+// short leaves an RPX that is neither the old one nor marked patched. STREAM
+// writes the same file as REWRITE, but copies the sections it leaves alone
+// from the old file a chunk at a time instead of holding them, so only the
+// text is ever held whole.
+enum class HachiMode {
+    REWRITE,
+    IN_PLACE,
+    STREAM,
+};
+
+// Quick checks that reject most titles before hachi_check. They return
+// UNTESTED when the title may still be valid.
+Patch::Status hachi_stat_check(const IOSUFSA &fsa, std::string_view title);
+// Also gives the size of the RPX, once it passes
+Patch::Status hachi_stat_check(const IOSUFSA &fsa, std::string_view title, std::uint32_t &size);
+Patch::Status hachi_header_check(const IOSUFSA &fsa, std::string_view title);
 Patch::Status hachi_check(const IOSUFSA &fsa, std::string_view title);
-std::unique_ptr<Patch> hachi_patch(const IOSUFSA &fsa, std::string_view title);
+std::unique_ptr<Patch> hachi_patch(const IOSUFSA &fsa, std::string_view title,
+                                   HachiMode mode = HachiMode::REWRITE);
+// Changes whenever the RPX hachi_patch writes for a given input would
+std::uint32_t hachi_version(HachiMode mode = HachiMode::REWRITE);
+// Checks a cached RPX: the text must inflate to the length its prefix
+// gives, and to the CRC32 stored for it in the CRCs section
+std::unique_ptr<PatchCache::Check> hachi_cache_check();
 
 #endif // HACHI_PATCH_HPP
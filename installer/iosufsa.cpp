@@ -4,14 +4,18 @@
 #include <cstdint>
 #include <cstring>
 #include <initializer_list>
+#include <utility>
 
+#include <coreinit/event.h>
 #include <coreinit/ios.h>
 #include <coreinit/mcp.h>
+#include <coreinit/mutex.h>
 #include <coreinit/thread.h>
 #include <coreinit/time.h>
 
 #include "aligned.hpp"
 #include "log.hpp"
+#include "shared_device.hpp"
 
 namespace {
     constexpr std::int32_t IOCTL_CHECK_IF_IOSUHAX = 0x5B;
@@ -20,18 +24,33 @@ namespace {
     constexpr std::int32_t IOCTL_FSA_OPEN = 0x40;
     constexpr std::int32_t IOCTL_FSA_CLOSE = 0x41;
 
+    constexpr std::int32_t IOCTL_FSA_OPENDIR = 0x45;
+    constexpr std::int32_t IOCTL_FSA_READDIR = 0x46;
+    constexpr std::int32_t IOCTL_FSA_CLOSEDIR = 0x47;
+
+    constexpr std::int32_t IOCTL_FSA_GETSTAT = 0x4F;
     constexpr std::int32_t IOCTL_FSA_REMOVE = 0x50;
+    constexpr std::int32_t IOCTL_FSA_RENAME = 0x53;
     constexpr std::int32_t IOCTL_FSA_FLUSHVOLUME = 0x59;
 
     constexpr std::int32_t IOCTL_FSA_OPENFILE = 0x49;
     constexpr std::int32_t IOCTL_FSA_CLOSEFILE = 0x4D;
     constexpr std::int32_t IOCTL_FSA_READFILE = 0x4A;
     constexpr std::int32_t IOCTL_FSA_WRITEFILE = 0x4B;
+    constexpr std::int32_t IOCTL_FSA_STATFILE = 0x4C;
     constexpr std::int32_t IOCTL_FSA_SETFILEPOS = 0x4E;
 
     constexpr std::int32_t ERROR_INVALID_ARG = -0x1D;
 
-    constexpr std::size_t max_io = 0x10'0000; // 1MiB
+    // Packed fileStat_s, which directoryEntry_s follows with the entry name
+    constexpr std::size_t stat_size = 0x64;
+    constexpr std::size_t stat_flag_off = 0x00;
+    constexpr std::size_t stat_size_off = 0x10;
+    constexpr std::size_t dir_name_size = 0x100;
+    constexpr std::uint32_t DIR_ENTRY_IS_DIRECTORY = 0x80000000;
+
+    // Bounce buffers kept in each session's pool
+    constexpr std::size_t max_pooled = 2;
 
     template<std::size_t Align>
     aligned::vector<std::uint8_t, Align> make_msg_strings(
@@ -57,91 +76,150 @@ namespace {
         return msg;
     }
 
-    void nullfuncvp(IOSError, void *) { }
-}
+    // How long IOSUHAX gets to come up or shut down on the MCP path
+    constexpr std::uint64_t mcp_timeout_ms = 1000;
+
+    // The IOSUHAX device is shared by every session. Sessions may be
+    // opened and closed from any thread, as background scans open their
+    // own, so its users are counted under a lock.
+    struct Device {
+        Device() { OSInitMutex(&lock); }
+
+        int iosu_fd = -1;
+        int mcp_fd = -1;
+        SharedDevice shared;
+        OSEvent mcp_exit;
+        OSMutex lock;
+    } device;
+
+    class DeviceLock {
+    public:
+        DeviceLock() { OSLockMutex(&device.lock); }
+        ~DeviceLock() { OSUnlockMutex(&device.lock); }
+
+        DeviceLock(const DeviceLock &) = delete;
+        DeviceLock &operator=(const DeviceLock &) = delete;
+    };
+
+    void mcp_exit_callback(IOSError, void *) {
+        OSSignalEvent(&device.mcp_exit);
+    }
 
-IOSUFSA::~IOSUFSA() {
-    if (is_open()) try {
-        LOG("IOSUFSA destructed while open");
-        close();
-    } catch (error &e) {
-        LOG("ERROR in ~IOSUFSA: %s", e.what());
+    bool check_iosuhax(int fd) {
+        alignas(0x40) std::int32_t recv[1];
+        recv[0] = 0;
+        int res = IOS_Ioctl(fd, IOCTL_CHECK_IF_IOSUHAX, nullptr, 0, recv, sizeof(recv));
+        return res >= 0 && recv[0] == IOSUHAX_MAGIC_WORD;
     }
-}
 
-bool IOSUFSA::open_dev() {
-    iosu_fd = IOS_Open("/dev/iosuhax", (IOSOpenMode) 0);
-    return (iosu_fd >= 0);
-}
+    bool open_dev() {
+        device.iosu_fd = IOS_Open("/dev/iosuhax", (IOSOpenMode) 0);
+        return (device.iosu_fd >= 0);
+    }
 
-bool IOSUFSA::close_dev() {
-    int res = IOS_Close(iosu_fd);
-    iosu_fd = -1;
-    return (res >= 0);
-}
+    bool close_dev() {
+        int res = IOS_Close(device.iosu_fd);
+        device.iosu_fd = -1;
+        return (res >= 0);
+    }
 
-bool IOSUFSA::open_mcp() {
-    mcp_fd = MCP_Open();
-    if (mcp_fd < 0) return false;
+    bool close_mcp() {
+        bool good = true;
 
-    int res = IOS_IoctlAsync(mcp_fd, 0x62, nullptr, 0, nullptr, 0, nullfuncvp, nullptr);
-    if (res < 0) {
-        // Cleanup MCP
-        MCP_Close(mcp_fd);
-        mcp_fd = -1;
-        return false;
-    }
-    OSSleepTicks(OSSecondsToTicks(1));
-
-    iosu_fd = IOS_Open("/dev/mcp", (IOSOpenMode) 0);
-    if (iosu_fd < 0) {
-        // Cleanup MCP
-        MCP_Close(mcp_fd);
-        mcp_fd = -1;
-        return false;
-    }
+        int res = IOS_Close(device.iosu_fd);
+        device.iosu_fd = -1;
+        good &= (res >= 0);
+        // IOSUHAX returns from the hijacked IOCTL once it has shut down
+        if (!OSWaitEventWithTimeout(&device.mcp_exit,
+                                    OSMillisecondsToTicks(mcp_timeout_ms)))
+            LOG("IOSUHAX Shutdown Timed Out");
 
-    // Check if actually IOSUHAX
-    alignas(0x40) std::int32_t recv[1];
-    recv[0] = 0;
-    res = IOS_Ioctl(iosu_fd, IOCTL_CHECK_IF_IOSUHAX, nullptr, 0, recv, sizeof(recv));
-    if (res < 0 || recv[0] != IOSUHAX_MAGIC_WORD) {
-        close_mcp();
-        return false;
+        res = MCP_Close(device.mcp_fd);
+        device.mcp_fd = -1;
+        good &= (res >= 0);
+
+        return good;
     }
 
-    return true;
-}
+    bool open_mcp() {
+        device.mcp_fd = MCP_Open();
+        if (device.mcp_fd < 0) return false;
+
+        OSInitEvent(&device.mcp_exit, false, OS_EVENT_MODE_MANUAL);
+        int res = IOS_IoctlAsync(device.mcp_fd, 0x62, nullptr, 0, nullptr, 0,
+                                 mcp_exit_callback, nullptr);
+        if (res < 0) {
+            // Cleanup MCP
+            MCP_Close(device.mcp_fd);
+            device.mcp_fd = -1;
+            return false;
+        }
+
+        // IOSUHAX takes over MCP from the IOCTL above, and the path is only
+        // opened once, after it has had the time to do so. Opening it
+        // sooner may reach the real MCP rather than IOSUHAX.
+        OSSleepTicks(OSMillisecondsToTicks(mcp_timeout_ms));
+
+        device.iosu_fd = IOS_Open("/dev/mcp", (IOSOpenMode) 0);
+        if (device.iosu_fd < 0) {
+            // Cleanup MCP
+            MCP_Close(device.mcp_fd);
+            device.mcp_fd = -1;
+            return false;
+        }
 
-bool IOSUFSA::close_mcp() {
-    bool good = true;
+        if (!check_iosuhax(device.iosu_fd)) {
+            close_mcp();
+            return false;
+        }
 
-    int res = IOS_Close(iosu_fd);
-    iosu_fd = -1;
-    good &= (res >= 0);
-    OSSleepTicks(OSSecondsToTicks(1));
+        return true;
+    }
+
+    void acquire_device() {
+        DeviceLock lock;
+        bool opened = device.shared.acquire([]() -> bool {
+            bool iosu = open_dev();
+            if (!iosu) iosu = open_mcp();
+            if (iosu) LOG("IOSUHAX Opened");
+            return iosu;
+        });
+        if (!opened) throw IOSUFSA::no_iosuhax{};
+    }
 
-    res = MCP_Close(mcp_fd);
-    mcp_fd = -1;
-    good &= (res >= 0);
+    bool release_device() {
+        DeviceLock lock;
+        return device.shared.release([]() -> bool {
+            LOG("IOSUHAX Closed");
+            if (device.mcp_fd >= 0) return close_mcp();
+            else return close_dev();
+        });
+    }
+}
 
-    return good;
+IOSUFSA::~IOSUFSA() {
+    if (is_open()) try {
+        LOG("IOSUFSA destructed while open");
+        close();
+    } catch (error &e) {
+        LOG("ERROR in ~IOSUFSA: %s", e.what());
+    }
 }
 
 void IOSUFSA::open() {
     if (is_open()) return;
 
-    bool iosu = open_dev();
-    if (!iosu) iosu = open_mcp();
-    if (!iosu) throw no_iosuhax{};
+    acquire_device();
+    iosu_fd = device.iosu_fd;
+    mcp_fd = device.mcp_fd;
 
     // Init FSA
     alignas(0x40) std::int32_t recv[1];
     int res = IOS_Ioctl(iosu_fd, IOCTL_FSA_OPEN, nullptr, 0, recv, sizeof(recv));
     if (res < 0 || recv[0] < 0) {
         // Cleanup IOSUHAX
-        if (mcp_fd) close_mcp();
-        else close_dev();
+        iosu_fd = mcp_fd = -1;
+        release_device();
         throw error("IOSUHAX: Open FSA");
     }
     fsa_fd = recv[0];
@@ -156,26 +234,52 @@ void IOSUFSA::close() {
     fsa_fd = -1;
     bool fsa_good = (res >= 0);
 
-    bool iosu_good;
-    if (mcp_fd >= 0) iosu_good = close_mcp();
-    else iosu_good = close_dev();
+    iosu_fd = mcp_fd = -1;
+    bool iosu_good = release_device();
 
     if (!iosu_good) throw error("IOSUHAX: Close HAX");
     if (!fsa_good) throw error("IOSUHAX: Close FSA");
 }
 
+IOSUFSA::PoolBuffer::PoolBuffer(const IOSUFSA &fsa) : fsa(fsa) {
+    if (!fsa.pool.empty()) {
+        buffer = std::move(fsa.pool.back());
+        fsa.pool.pop_back();
+    }
+}
+
+IOSUFSA::PoolBuffer::~PoolBuffer() {
+    if (fsa.pool.size() < max_pooled) fsa.pool.push_back(std::move(buffer));
+}
+
 bool IOSUFSA::remove(std::string_view path) const {
     if (!is_open()) throw error("IOSUHAX: Remove: Not Open");
 
     aligned::vector<std::uint8_t, 0x40> msg = make_msg_strings<0x40>(fsa_fd, { path });
 
     alignas(0x40) std::int32_t recv[1];
+    std::uint64_t start = Stats::now_us();
     int res = IOS_Ioctl(iosu_fd, IOCTL_FSA_REMOVE, msg.data(), msg.size(), recv, sizeof(recv));
+    counters.add(Stats::REMOVE, Stats::now_us() - start);
     if (res < 0) throw error("IOSUHAX: Remove: IOS_Ioctl Failed");
 
     return (recv[0] >= 0);
 }
 
+bool IOSUFSA::rename(std::string_view from, std::string_view to) const {
+    if (!is_open()) throw error("IOSUHAX: Rename: Not Open");
+
+    aligned::vector<std::uint8_t, 0x40> msg = make_msg_strings<0x40>(fsa_fd, { from, to });
+
+    alignas(0x40) std::int32_t recv[1];
+    std::uint64_t start = Stats::now_us();
+    int res = IOS_Ioctl(iosu_fd, IOCTL_FSA_RENAME, msg.data(), msg.size(), recv, sizeof(recv));
+    counters.add(Stats::RENAME, Stats::now_us() - start);
+    if (res < 0) throw error("IOSUHAX: Rename: IOS_Ioctl Failed");
+
+    return (recv[0] >= 0);
+}
+
 bool IOSUFSA::flush_volume(std::string_view path) const {
     if (!is_open()) throw error("IOSUHAX: FlushVolume: Not Open");
     if (mcp_fd < 0) return true;
@@ -183,7 +287,9 @@ bool IOSUFSA::flush_volume(std::string_view path) const {
     aligned::vector<std::uint8_t, 0x40> msg = make_msg_strings<0x40>(fsa_fd, { path });
 
     alignas(0x40) std::int32_t recv[1];
+    std::uint64_t start = Stats::now_us();
     int res = IOS_Ioctl(iosu_fd, IOCTL_FSA_FLUSHVOLUME, msg.data(), msg.size(), recv, sizeof(recv));
+    counters.add(Stats::FLUSHVOLUME, Stats::now_us() - start);
     // Mocha lacks the command, so soft-fail in this case
     if (res == ERROR_INVALID_ARG) return false;
     if (res < 0) throw error("IOSUHAX: FlushVolume: IOS_Ioctl Failed");
@@ -191,6 +297,97 @@ bool IOSUFSA::flush_volume(std::string_view path) const {
     return (recv[0] >= 0);
 }
 
+bool IOSUFSA::stat(std::string_view path, Stat &stat) const {
+    if (!is_open()) throw error("IOSUHAX: GetStat: Not Open");
+
+    aligned::vector<std::uint8_t, 0x40> msg = make_msg_strings<0x40>(fsa_fd, { path });
+
+    alignas(0x40) std::uint8_t recv[(4 + stat_size + 0x3F) & ~0x3F];
+    std::uint64_t start = Stats::now_us();
+    int res = IOS_Ioctl(iosu_fd, IOCTL_FSA_GETSTAT, msg.data(), msg.size(), recv, sizeof(recv));
+    counters.add(Stats::GETSTAT, Stats::now_us() - start);
+    if (res < 0) throw error("IOSUHAX: GetStat: IOS_Ioctl Failed");
+    if (*reinterpret_cast<std::int32_t *>(recv) < 0) return false;
+
+    std::uint32_t flag, size;
+    std::memcpy(&flag, recv + 4 + stat_flag_off, sizeof(flag));
+    std::memcpy(&size, recv + 4 + stat_size_off, sizeof(size));
+    stat.is_dir = (flag & DIR_ENTRY_IS_DIRECTORY) != 0;
+    stat.size = size;
+    return true;
+}
+
+IOSUFSA::Dir::~Dir() {
+    if (is_open()) try {
+        LOG("Dir destructed while open");
+        close();
+    } catch (error &e) {
+        LOG("ERROR in ~Dir: %s", e.what());
+    }
+}
+
+bool IOSUFSA::Dir::open(std::string_view path) {
+    if (!fsa.is_open()) throw error("IOSUHAX: DirOpen: FSA Not Open");
+    if (dir_fd >= 0) close();
+
+    aligned::vector<std::uint8_t, 0x40> msg = make_msg_strings<0x40>(fsa.fsa_fd, { path });
+
+    alignas(0x40) std::int32_t recv[2];
+    std::uint64_t start = Stats::now_us();
+    int res = IOS_Ioctl(fsa.iosu_fd, IOCTL_FSA_OPENDIR, msg.data(), msg.size(), recv, sizeof(recv));
+    fsa.counters.add(Stats::OPENDIR, Stats::now_us() - start);
+    if (res < 0) throw error("IOSUHAX: DirOpen: IOS_Ioctl Failed");
+
+    if (recv[0] >= 0) {
+        if (recv[1] < 0) throw error("IOSUHAX: DirOpen: Bad Handle");
+        dir_fd = recv[1];
+        return true;
+    } else return false;
+}
+
+bool IOSUFSA::Dir::close() {
+    if (!is_open()) return true;
+    if (!fsa.is_open()) throw error("IOSUHAX: DirClose: FSA Not Open");
+
+    alignas(0x40) std::int32_t msg[2];
+    msg[0] = fsa.fsa_fd;
+    msg[1] = dir_fd;
+
+    alignas(0x40) std::int32_t recv[1];
+    std::uint64_t start = Stats::now_us();
+    int res = IOS_Ioctl(fsa.iosu_fd, IOCTL_FSA_CLOSEDIR, msg, sizeof(msg), recv, sizeof(recv));
+    fsa.counters.add(Stats::CLOSEDIR, Stats::now_us() - start);
+    dir_fd = -1;
+
+    if (res < 0) throw error("IOSUHAX: DirClose: IOS_Ioctl Failed");
+    return (recv[0] >= 0);
+}
+
+bool IOSUFSA::Dir::read(Entry &entry) const {
+    if (!is_open()) throw error("IOSUHAX: DirRead: Not Open");
+
+    alignas(0x40) std::int32_t msg[2];
+    msg[0] = fsa.fsa_fd;
+    msg[1] = dir_fd;
+
+    alignas(0x40) std::uint8_t recv[(4 + stat_size + dir_name_size + 0x3F) & ~0x3F];
+    std::uint64_t start = Stats::now_us();
+    int res = IOS_Ioctl(fsa.iosu_fd, IOCTL_FSA_READDIR, msg, sizeof(msg), recv, sizeof(recv));
+    fsa.counters.add(Stats::READDIR, Stats::now_us() - start);
+    if (res < 0) throw error("IOSUHAX: DirRead: IOS_Ioctl Failed");
+    if (*reinterpret_cast<std::int32_t *>(recv) < 0) return false;
+
+    const std::uint8_t *stat = recv + 4;
+    const char *name = reinterpret_cast<const char *>(stat + stat_size);
+    std::uint32_t flag, size;
+    std::memcpy(&flag, stat + stat_flag_off, sizeof(flag));
+    std::memcpy(&size, stat + stat_size_off, sizeof(size));
+    entry.name.assign(name, strnlen(name, dir_name_size));
+    entry.is_dir = (flag & DIR_ENTRY_IS_DIRECTORY) != 0;
+    entry.size = size;
+    return true;
+}
+
 IOSUFSA::File::~File() {
     if (is_open()) try {
         LOG("File destructed while open");
@@ -200,6 +397,14 @@ IOSUFSA::File::~File() {
     }
 }
 
+IOSUFSA::File::File(File &&o) : fsa(o.fsa), file_fd(o.file_fd) { o.file_fd = -1; }
+
+IOSUFSA::File &IOSUFSA::File::operator=(File &&o) {
+    if (std::addressof(o.fsa) != std::addressof(fsa))
+        throw error("FSA: File Move");
+    close(); file_fd = o.file_fd; o.file_fd = -1; return *this;
+}
+
 bool IOSUFSA::File::open(std::string_view path, std::string_view mode) {
     if (!fsa.is_open()) throw error("IOSUHAX: FileOpen: FSA Not Open");
     if (file_fd >= 0) close();
@@ -207,7 +412,9 @@ bool IOSUFSA::File::open(std::string_view path, std::string_view mode) {
     aligned::vector<std::uint8_t, 0x40> msg = make_msg_strings<0x40>(fsa.fsa_fd, { path, mode });
 
     alignas(0x40) std::int32_t recv[2];
+    std::uint64_t start = Stats::now_us();
     int res = IOS_Ioctl(fsa.iosu_fd, IOCTL_FSA_OPENFILE, msg.data(), msg.size(), recv, sizeof(recv));
+    fsa.counters.add(Stats::OPENFILE, Stats::now_us() - start);
     if (res < 0) throw error("IOSUHAX: FileOpen: IOS_Ioctl Failed");
 
     if (recv[0] >= 0) {
@@ -226,7 +433,9 @@ bool IOSUFSA::File::close() {
     msg[1] = file_fd;
 
     alignas(0x40) std::int32_t recv[1];
+    std::uint64_t start = Stats::now_us();
     int res = IOS_Ioctl(fsa.iosu_fd, IOCTL_FSA_CLOSEFILE, msg, sizeof(msg), recv, sizeof(recv));
+    fsa.counters.add(Stats::CLOSEFILE, Stats::now_us() - start);
     file_fd = -1;
 
     if (res < 0) throw error("IOSUHAX: FileClose: IOS_Ioctl Failed");
@@ -244,25 +453,32 @@ std::int32_t IOSUFSA::File::read_impl(void *data, std::size_t size, std::size_t
 
     aligned::vector<std::uint8_t, 0x40> &recv = buffer;
     recv.resize((size * count + 0x7F) & ~0x3F);
+    std::uint64_t start = Stats::now_us();
     int res = IOS_Ioctl(fsa.iosu_fd, IOCTL_FSA_READFILE, msg, sizeof(msg), recv.data(), recv.size());
-    if (res < 0) throw error("IOSUHAX: FileRead: IOS_Ioctl Failed");
+    std::uint64_t us = Stats::now_us() - start;
+    if (res < 0) {
+        fsa.counters.add(Stats::READFILE, us);
+        throw error("IOSUHAX: FileRead: IOS_Ioctl Failed");
+    }
 
     std::int32_t out = reinterpret_cast<std::int32_t *>(recv.data())[0];
-    if (data && out > 0) std::memcpy(data, recv.data() + 0x40, size * count);
+    bool copy = data && out > 0;
+    if (copy) std::memcpy(data, recv.data() + 0x40, size * count);
+    fsa.counters.add(Stats::READFILE, us, out > 0 ? out * size : 0, copy ? size * count : 0);
     return out;
 }
 
 std::int32_t IOSUFSA::File::read(void *data, std::size_t size, std::size_t count) const {
     if (!is_open()) throw error("IOSUHAX: FileRead: Not Open");
 
-    aligned::vector<std::uint8_t, 0x40> buffer;
+    PoolBuffer buffer(fsa);
     return read_impl(data, size, count, buffer);
 }
 
 bool IOSUFSA::File::readall(void *data, std::size_t size) const {
     if (!is_open()) throw error("IOSUHAX: FileReadAll: Not Open");
 
-    aligned::vector<std::uint8_t, 0x40> buffer;
+    PoolBuffer buffer(fsa);
     unsigned char *bdata = reinterpret_cast<unsigned char *>(data);
     while (size > 0) {
         std::int32_t count = read_impl(bdata, 1, std::min(max_io, size), buffer);
@@ -274,10 +490,51 @@ bool IOSUFSA::File::readall(void *data, std::size_t size) const {
     return true;
 }
 
+// The IOCTL header goes in the 0x40 bytes before data. Past the first chunk
+// of a Buffer those hold data from the previous chunk, which is restored.
+std::int32_t IOSUFSA::File::read_direct(std::uint8_t *data, std::size_t size) const {
+    alignas(0x40) std::int32_t msg[5];
+    msg[0] = fsa.fsa_fd;
+    msg[1] = 1;
+    msg[2] = size;
+    msg[3] = file_fd;
+    msg[4] = 0;
+
+    std::uint8_t *recv = data - 0x40;
+    std::uint8_t saved[0x40];
+    std::memcpy(saved, recv, sizeof(saved));
+    std::uint64_t start = Stats::now_us();
+    int res = IOS_Ioctl(fsa.iosu_fd, IOCTL_FSA_READFILE, msg, sizeof(msg),
+                        recv, (size + 0x7F) & ~0x3F);
+    std::int32_t out = reinterpret_cast<std::int32_t *>(recv)[0];
+    std::memcpy(recv, saved, sizeof(saved));
+    fsa.counters.add(Stats::READFILE, Stats::now_us() - start,
+                     (res >= 0 && out > 0) ? out : 0);
+    if (res < 0) throw error("IOSUHAX: FileRead: IOS_Ioctl Failed");
+
+    return out;
+}
+
+bool IOSUFSA::File::readall(Buffer &buffer) const {
+    if (!is_open()) throw error("IOSUHAX: FileReadAll: Not Open");
+
+    std::size_t off = 0;
+    while (off < buffer.size()) {
+        std::size_t size = std::min(max_io, buffer.size() - off);
+        std::int32_t count;
+        // A short read leaves the rest unaligned, so finish through a copy
+        if ((off & 0x3F) == 0) count = read_direct(buffer.data() + off, size);
+        else return readall(buffer.data() + off, buffer.size() - off);
+        if (count <= 0) return false;
+        off += std::min(static_cast<std::size_t>(count), size);
+    }
+    return true;
+}
+
 bool IOSUFSA::File::skip(std::size_t size) const {
     if (!is_open()) throw error("IOSUHAX: FileSkip: Not Open");
 
-    aligned::vector<std::uint8_t, 0x40> buffer;
+    PoolBuffer buffer(fsa);
     while (size > 0) {
         std::int32_t count = read_impl(nullptr, 1, std::min(max_io, size), buffer);
         if (count <= 0) return false;
@@ -300,7 +557,10 @@ std::int32_t IOSUFSA::File::write_impl(const void *data, std::size_t size, std::
     std::memcpy(msg.data() + 0x40, data, size * count);
 
     alignas(0x40) std::int32_t recv[1];
+    std::uint64_t start = Stats::now_us();
     int res = IOS_Ioctl(fsa.iosu_fd, IOCTL_FSA_WRITEFILE, msg.data(), msg.size(), recv, sizeof(recv));
+    fsa.counters.add(Stats::WRITEFILE, Stats::now_us() - start,
+                     (res >= 0 && recv[0] > 0) ? recv[0] * size : 0, size * count);
     if (res < 0) throw error("IOSUHAX: FileWrite: IOS_Ioctl Failed");
 
     return recv[0];
@@ -309,14 +569,14 @@ std::int32_t IOSUFSA::File::write_impl(const void *data, std::size_t size, std::
 std::int32_t IOSUFSA::File::write(const void *data, std::size_t size, std::size_t count) const {
     if (!is_open()) throw error("IOSUHAX: FileWrite: Not Open");
 
-    aligned::vector<std::uint8_t, 0x40> buffer;
+    PoolBuffer buffer(fsa);
     return write_impl(data, size, count, buffer);
 }
 
 bool IOSUFSA::File::writeall(const void *data, std::size_t size) const {
     if (!is_open()) throw error("IOSUHAX: FileWriteAll: Not Open");
 
-    aligned::vector<std::uint8_t, 0x40> buffer;
+    PoolBuffer buffer(fsa);
     const unsigned char *bdata = reinterpret_cast<const unsigned char *>(data);
     while (size > 0) {
         std::int32_t count = write_impl(bdata, 1, std::min(max_io, size), buffer);
@@ -328,6 +588,45 @@ bool IOSUFSA::File::writeall(const void *data, std::size_t size) const {
     return true;
 }
 
+std::int32_t IOSUFSA::File::write_direct(std::uint8_t *data, std::size_t size) const {
+    std::uint8_t *msg = data - 0x40;
+    std::uint8_t saved[0x40];
+    std::memcpy(saved, msg, sizeof(saved));
+    std::int32_t *header = reinterpret_cast<std::int32_t *>(msg);
+    header[0] = fsa.fsa_fd;
+    header[1] = 1;
+    header[2] = size;
+    header[3] = file_fd;
+    header[4] = 0;
+
+    alignas(0x40) std::int32_t recv[1];
+    std::uint64_t start = Stats::now_us();
+    int res = IOS_Ioctl(fsa.iosu_fd, IOCTL_FSA_WRITEFILE, msg, (size + 0x7F) & ~0x3F,
+                        recv, sizeof(recv));
+    fsa.counters.add(Stats::WRITEFILE, Stats::now_us() - start,
+                     (res >= 0 && recv[0] > 0) ? recv[0] : 0);
+    std::memcpy(msg, saved, sizeof(saved));
+    if (res < 0) throw error("IOSUHAX: FileWrite: IOS_Ioctl Failed");
+
+    return recv[0];
+}
+
+bool IOSUFSA::File::writeall(Buffer &buffer) const {
+    if (!is_open()) throw error("IOSUHAX: FileWriteAll: Not Open");
+
+    std::size_t off = 0;
+    while (off < buffer.size()) {
+        std::size_t size = std::min(max_io, buffer.size() - off);
+        std::int32_t count;
+        // A short write leaves the rest unaligned, so finish through a copy
+        if ((off & 0x3F) == 0) count = write_direct(buffer.data() + off, size);
+        else return writeall(buffer.data() + off, buffer.size() - off);
+        if (count <= 0) return false;
+        off += std::min(static_cast<std::size_t>(count), size);
+    }
+    return true;
+}
+
 bool IOSUFSA::File::seek(std::size_t position) const {
     if (!is_open()) throw error("IOSUHAX: FileSeek: Not Open");
 
@@ -337,8 +636,118 @@ bool IOSUFSA::File::seek(std::size_t position) const {
     msg[2] = position;
 
     alignas(0x40) std::int32_t recv[1];
+    std::uint64_t start = Stats::now_us();
     int res = IOS_Ioctl(fsa.iosu_fd, IOCTL_FSA_SETFILEPOS, msg, sizeof(msg), recv, sizeof(recv));
+    fsa.counters.add(Stats::SETFILEPOS, Stats::now_us() - start);
     if (res < 0) throw error("IOSUHAX: FileSeek: IOS_Ioctl Failed");
 
     return (recv[0] >= 0);
 }
+
+bool IOSUFSA::File::size(std::size_t &size) const {
+    if (!is_open()) throw error("IOSUHAX: FileStat: Not Open");
+
+    alignas(0x40) std::int32_t msg[2];
+    msg[0] = fsa.fsa_fd;
+    msg[1] = file_fd;
+
+    alignas(0x40) std::uint8_t recv[(4 + stat_size + 0x3F) & ~0x3F];
+    std::uint64_t start = Stats::now_us();
+    int res = IOS_Ioctl(fsa.iosu_fd, IOCTL_FSA_STATFILE, msg, sizeof(msg), recv, sizeof(recv));
+    fsa.counters.add(Stats::STATFILE, Stats::now_us() - start);
+    if (res < 0) throw error("IOSUHAX: FileStat: IOS_Ioctl Failed");
+    if (*reinterpret_cast<std::int32_t *>(recv) < 0) return false;
+
+    std::uint32_t len;
+    std::memcpy(&len, recv + 4 + stat_size_off, sizeof(len));
+    size = len;
+    return true;
+}
+
+struct IOSUFSA::File::Request::State {
+    alignas(0x40) std::int32_t msg[5];
+    alignas(0x40) std::int32_t recv[1];
+    std::int32_t *count;
+    IOSError result;
+    OSEvent event;
+    // Counted once waited on, but timed to when IOSU answered
+    Stats *stats;
+    Stats::Command command;
+    std::uint64_t start_us;
+    std::uint64_t end_us;
+
+    void begin(const IOSUFSA &fsa, Stats::Command command) {
+        this->stats = &fsa.counters;
+        this->command = command;
+        start_us = Stats::now_us();
+    }
+
+    static void callback(IOSError result, void *context) {
+        State *state = reinterpret_cast<State *>(context);
+        state->end_us = Stats::now_us();
+        state->result = result;
+        OSSignalEvent(&state->event);
+    }
+};
+
+IOSUFSA::File::Request::Request() : state(std::make_unique<State>()) {
+    OSInitEvent(&state->event, false, OS_EVENT_MODE_AUTO);
+}
+
+IOSUFSA::File::Request::~Request() {
+    // The IOCTL still refers to the state, so it must complete first
+    if (busy) OSWaitEvent(&state->event);
+}
+
+std::int32_t IOSUFSA::File::Request::wait() {
+    if (!busy) throw error("IOSUHAX: Request: Not Pending");
+    OSWaitEvent(&state->event);
+    busy = false;
+    std::int32_t moved = state->result < 0 ? 0 : std::max(*state->count, std::int32_t{0});
+    state->stats->add(state->command, state->end_us - state->start_us, moved);
+    if (state->result < 0) throw error("IOSUHAX: Request: IOS_IoctlAsync Failed");
+    return *state->count;
+}
+
+void IOSUFSA::File::read_async(Buffer &buffer, std::size_t size, Request &request) const {
+    if (!is_open()) throw error("IOSUHAX: FileReadAsync: Not Open");
+    if (request.pending()) throw error("IOSUHAX: FileReadAsync: Request Busy");
+    if (size > max_io || size > buffer.size()) throw error("IOSUHAX: FileReadAsync: Size");
+
+    Request::State &state = *request.state;
+    state.msg[0] = fsa.fsa_fd;
+    state.msg[1] = 1;
+    state.msg[2] = size;
+    state.msg[3] = file_fd;
+    state.msg[4] = 0;
+    std::uint8_t *recv = buffer.data() - 0x40;
+    state.count = reinterpret_cast<std::int32_t *>(recv);
+    state.begin(fsa, Stats::READFILE);
+
+    int res = IOS_IoctlAsync(fsa.iosu_fd, IOCTL_FSA_READFILE, state.msg, sizeof(state.msg),
+                             recv, (size + 0x7F) & ~0x3F, &Request::State::callback, &state);
+    if (res < 0) throw error("IOSUHAX: FileReadAsync: IOS_IoctlAsync Failed");
+    request.busy = true;
+}
+
+void IOSUFSA::File::write_async(Buffer &buffer, std::size_t size, Request &request) const {
+    if (!is_open()) throw error("IOSUHAX: FileWriteAsync: Not Open");
+    if (request.pending()) throw error("IOSUHAX: FileWriteAsync: Request Busy");
+    if (size > max_io || size > buffer.size()) throw error("IOSUHAX: FileWriteAsync: Size");
+
+    Request::State &state = *request.state;
+    std::uint8_t *msg = buffer.data() - 0x40;
+    std::int32_t *header = reinterpret_cast<std::int32_t *>(msg);
+    header[0] = fsa.fsa_fd;
+    header[1] = 1;
+    header[2] = size;
+    header[3] = file_fd;
+    header[4] = 0;
+    state.count = state.recv;
+    state.begin(fsa, Stats::WRITEFILE);
+
+    int res = IOS_IoctlAsync(fsa.iosu_fd, IOCTL_FSA_WRITEFILE, msg, (size + 0x7F) & ~0x3F,
+                             state.recv, sizeof(state.recv), &Request::State::callback, &state);
+    if (res < 0) throw error("IOSUHAX: FileWriteAsync: IOS_IoctlAsync Failed");
+    request.busy = true;
+}
@@ -1,12 +1,16 @@
 #ifndef IOSUFSA_HPP
 #define IOSUFSA_HPP
 
+#include <array>
 #include <cstdint>
+#include <cstdio>
 #include <exception>
 #include <iterator>
 #include <memory>
 #include <optional>
+#include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include "aligned.hpp"
@@ -19,6 +23,9 @@ public:
         virtual const char *what() const noexcept override { return "No IOSUHAX"; }
     };
 
+    // Largest transfer issued in a single IOCTL
+    static constexpr std::size_t max_io = 0x10'0000; // 1MiB
+
     IOSUFSA() = default;
     ~IOSUFSA();
 
@@ -34,8 +41,102 @@ public:
     bool is_open() const noexcept { return fsa_fd >= 0; }
 
     bool remove(std::string_view path) const;
+    // Fails if to already exists, on the console at least
+    bool rename(std::string_view from, std::string_view to) const;
     bool flush_volume(std::string_view path) const;
 
+    struct Stat {
+        bool is_dir = false;
+        std::uint32_t size = 0;
+    };
+    // Looks up a path with a single IOCTL, without opening it
+    bool stat(std::string_view path, Stat &stat) const;
+
+    // Tally of the IOCTLs a session has made, kept at all times so a run
+    // can be split between waiting on IOSU and everything else. Take one
+    // before and after, and the difference is what happened in between.
+    // On the host, each call stands in for the IOCTL it replaces.
+    struct Stats {
+        enum Command : std::size_t {
+            OPENFILE,
+            CLOSEFILE,
+            READFILE,
+            WRITEFILE,
+            SETFILEPOS,
+            STATFILE,
+            GETSTAT,
+            REMOVE,
+            RENAME,
+            FLUSHVOLUME,
+            OPENDIR,
+            READDIR,
+            CLOSEDIR,
+            COMMANDS,
+        };
+        // Latencies are counted by log2 of microseconds, the last bucket
+        // taking everything from about 2 seconds up
+        static constexpr std::size_t buckets = 23;
+
+        struct Counter {
+            std::uint32_t count = 0;
+            // Moved by the IOCTLs, and copied through bounce buffers
+            std::uint64_t bytes = 0;
+            std::uint64_t copied = 0;
+            std::uint64_t total_us = 0;
+            std::array<std::uint32_t, buckets> latency = { };
+        };
+        std::array<Counter, COMMANDS> commands;
+
+        static const char *name(Command command);
+        static std::uint64_t now_us();
+        void add(Command command, std::uint64_t us, std::uint64_t bytes = 0,
+                 std::uint64_t copied = 0);
+
+        Stats &operator+=(const Stats &o);
+        Stats &operator-=(const Stats &o);
+        friend Stats operator-(Stats a, const Stats &b) { return a -= b; }
+
+        // One line per command used, with the latencies that occurred
+        void log() const;
+        bool write(std::FILE *file) const;
+        bool save(const std::string &path) const;
+    };
+    // Snapshot of the session's counters. Only the thread using the
+    // session may take one.
+    Stats stats() const { return counters; }
+
+    // Data buffer with space reserved ahead of it for the IOCTL header, so
+    // File can read and write it in place instead of through a copy.
+    class Buffer {
+    public:
+        Buffer() = default;
+        explicit Buffer(std::size_t size) { resize(size); }
+
+        std::uint8_t *data() noexcept { return raw.data() + header_size; }
+        const std::uint8_t *data() const noexcept { return raw.data() + header_size; }
+        std::size_t size() const noexcept { return len; }
+        bool empty() const noexcept { return len == 0; }
+        std::uint8_t &operator[](std::size_t i) noexcept { return data()[i]; }
+        const std::uint8_t &operator[](std::size_t i) const noexcept { return data()[i]; }
+        std::uint8_t *begin() noexcept { return data(); }
+        std::uint8_t *end() noexcept { return data() + len; }
+        const std::uint8_t *begin() const noexcept { return data(); }
+        const std::uint8_t *end() const noexcept { return data() + len; }
+
+        void resize(std::size_t size) {
+            raw.resize(header_size + ((size + 0x3F) & ~0x3F));
+            len = size;
+        }
+        void swap(Buffer &o) noexcept { raw.swap(o.raw); std::swap(len, o.len); }
+
+    private:
+        static constexpr std::size_t header_size = 0x40;
+        aligned::vector<std::uint8_t, 0x40> raw = aligned::vector<std::uint8_t, 0x40>(header_size);
+        std::size_t len = 0;
+
+        friend class File;
+    };
+
     class File {
     public:
         explicit File(const IOSUFSA &fsa) : fsa(fsa) { }
@@ -44,12 +145,8 @@ public:
         // Move Only
         File(const File &) = delete;
         File &operator=(const File &) = delete;
-        File(File &&o) : fsa(o.fsa), file_fd(o.file_fd) { o.file_fd = -1; }
-        File &operator=(File &&o) {
-            if (std::addressof(o.fsa) != std::addressof(fsa))
-                throw error("FSA: File Move");
-            close(); file_fd = o.file_fd; o.file_fd = -1; return *this;
-        }
+        File(File &&o);
+        File &operator=(File &&o);
 
         bool open(std::string_view path, std::string_view mode);
         bool close();
@@ -59,23 +156,218 @@ public:
         bool readall(void *data, std::size_t size) const;
         template<typename T> bool readall(std::vector<T> &v) const
             { return readall(v.data(), sizeof(T) * v.size()); }
+        // Reads in place, without a bounce buffer
+        bool readall(Buffer &buffer) const;
         bool skip(std::size_t size) const;
 
         std::int32_t write(const void *data, std::size_t size, std::size_t count) const;
         bool writeall(const void *data, std::size_t size) const;
         template<typename T> bool writeall(const std::vector<T> &v) const
             { return writeall(v.data(), sizeof(T) * v.size()); }
+        // Writes in place, without a bounce buffer. The contents are left
+        // unchanged, but the buffer is briefly used for the IOCTL header.
+        bool writeall(Buffer &buffer) const;
 
         bool seek(std::size_t position) const;
+        bool size(std::size_t &size) const;
+
+        // Asynchronous transfer of up to max_io bytes at the start of a
+        // Buffer. The buffer must not be touched until the request is done.
+        // Requests on one file are serviced in the order they are issued.
+        class Request {
+        public:
+            Request();
+            ~Request();
+
+            Request(const Request &) = delete;
+            Request &operator=(const Request &) = delete;
+
+            bool pending() const noexcept { return busy; }
+            // Returns the transfer count, as read and write do
+            std::int32_t wait();
+
+        private:
+            struct State;
+            std::unique_ptr<State> state;
+            bool busy = false;
+
+            friend class File;
+        };
+        void read_async(Buffer &buffer, std::size_t size, Request &request) const;
+        void write_async(Buffer &buffer, std::size_t size, Request &request) const;
 
     private:
         const IOSUFSA &fsa;
         int file_fd = -1;
+#ifndef __WIIU__
+        // Host backend: inputs are mapped, and the position is kept here so
+        // that requests can use pread and pwrite at a known offset
+        const std::uint8_t *map = nullptr;
+        std::size_t map_len = 0;
+        mutable std::size_t pos = 0;
+#endif
 
         std::int32_t read_impl(void *data, std::size_t size, std::size_t count,
                                aligned::vector<std::uint8_t, 0x40> &buffer) const;
         std::int32_t write_impl(const void *data, std::size_t size, std::size_t count,
                                 aligned::vector<std::uint8_t, 0x40> &buffer) const;
+        std::int32_t read_direct(std::uint8_t *data, std::size_t size) const;
+        std::int32_t write_direct(std::uint8_t *data, std::size_t size) const;
+    };
+
+    // File written beside path, with ".tmp" added, and moved over it by
+    // commit. Until then path is left as it was, so it can be read while
+    // its replacement is written, and a failed write never touches it.
+    // Without a commit, the file is removed. Where the FSA won't rename over
+    // a file, path is first moved aside to ".bak", so a commit cut short can
+    // leave path missing beside a complete new file or the old one. recover
+    // puts one of them back in place.
+    class NewFile : public File {
+    public:
+        NewFile(const IOSUFSA &fsa, std::string_view path);
+        ~NewFile();
+
+        NewFile(const NewFile &) = delete;
+        NewFile &operator=(const NewFile &) = delete;
+
+        bool open();
+        // Closes the file and moves it over path
+        bool commit();
+
+        // Puts back a missing path from what a commit cut short left beside
+        // it, preferring the new file once the old one was moved aside.
+        // Returns whether path exists after.
+        static bool recover(const IOSUFSA &fsa, std::string_view path);
+
+    private:
+        const IOSUFSA &fsa;
+        std::string path;
+        std::string temp;
+        std::string backup;
+        // Opened and not yet committed
+        bool written = false;
+    };
+
+    class Dir {
+    public:
+        struct Entry {
+            std::string name;
+            bool is_dir = false;
+            std::uint32_t size = 0;
+        };
+
+        explicit Dir(const IOSUFSA &fsa) : fsa(fsa) { }
+        ~Dir();
+
+        Dir(const Dir &) = delete;
+        Dir &operator=(const Dir &) = delete;
+
+        bool open(std::string_view path);
+        bool close();
+        bool is_open() const noexcept { return dir_fd >= 0; }
+
+        // Returns false once every entry has been read
+        bool read(Entry &entry) const;
+
+    private:
+        const IOSUFSA &fsa;
+        int dir_fd = -1;
+#ifndef __WIIU__
+        // Host backend: the DIR stream
+        void *dir = nullptr;
+#endif
+    };
+
+    // Sequential reader that keeps reads in flight ahead of the consumer,
+    // so the next chunk is read while the current one is processed.
+    class AsyncReader {
+    public:
+        static constexpr std::size_t depth = 2;
+
+        // Reads length bytes from the current position of file
+        AsyncReader(const File &file, std::size_t length, std::size_t chunk);
+        ~AsyncReader() = default;
+
+        AsyncReader(const AsyncReader &) = delete;
+        AsyncReader &operator=(const AsyncReader &) = delete;
+
+        // Returns the next chunk, or nullptr once length bytes were read.
+        // The chunk stays valid until the following call.
+        const Buffer *next();
+
+    private:
+        const File &file;
+        const std::size_t chunk;
+        std::size_t remaining;
+        std::size_t head = 0;
+        std::size_t inflight = 0;
+        bool handed_out = false;
+        std::array<Buffer, depth> buffers;
+        std::array<File::Request, depth> requests;
+
+        void submit(std::size_t slot);
+    };
+
+    // Sequential writer that gathers data into chunks and keeps writes in
+    // flight, so the next chunk is produced while the last one is written.
+    class AsyncWriter {
+    public:
+        static constexpr std::size_t depth = 2;
+
+        AsyncWriter(const File &file, std::size_t chunk);
+        ~AsyncWriter();
+
+        AsyncWriter(const AsyncWriter &) = delete;
+        AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+        bool write(const void *data, std::size_t size);
+        // Writes out any partial chunk and waits for all writes
+        bool flush();
+
+    private:
+        const File &file;
+        const std::size_t chunk;
+        std::size_t current = 0;
+        bool good = true;
+        std::array<Buffer, depth> buffers;
+        std::array<File::Request, depth> requests;
+        std::array<std::size_t, depth> sizes = { };
+
+        void submit();
+        void wait(std::size_t slot);
+    };
+
+    // Reader that fills a window of the file at a time, so nearby small
+    // reads share one IOCTL. Seeks and skips within the window don't touch
+    // the file, and those past it only move where the next fill starts.
+    class BufferedReader {
+    public:
+        // Reads from position, which must be where file currently is
+        BufferedReader(const File &file, std::size_t window, std::size_t position = 0);
+        ~BufferedReader() = default;
+
+        BufferedReader(const BufferedReader &) = delete;
+        BufferedReader &operator=(const BufferedReader &) = delete;
+
+        bool readall(void *data, std::size_t size);
+        template<typename T> bool readall(std::vector<T> &v)
+            { return readall(v.data(), v.size() * sizeof(T)); }
+        void skip(std::size_t size) { seek(tell() + size); }
+        void seek(std::size_t position);
+        std::size_t tell() const noexcept { return start + offset; }
+
+    private:
+        const File &file;
+        const std::size_t window;
+        // Where the window is in the file, and where the file is
+        std::size_t start;
+        std::size_t file_pos;
+        std::size_t offset = 0;
+        std::size_t filled = 0;
+        Buffer buffer;
+        File::Request request;
+
+        bool fill();
     };
 
 private:
@@ -83,10 +375,20 @@ private:
     int mcp_fd = -1;
     int fsa_fd = -1;
 
-    bool open_dev();
-    bool close_dev();
-    bool open_mcp();
-    bool close_mcp();
+    // Bounce buffers reused by all files of the session. A session is
+    // only used from one thread at a time, so this needs no locking.
+    class PoolBuffer {
+    public:
+        explicit PoolBuffer(const IOSUFSA &fsa);
+        ~PoolBuffer();
+        operator aligned::vector<std::uint8_t, 0x40> &() noexcept { return buffer; }
+
+    private:
+        const IOSUFSA &fsa;
+        aligned::vector<std::uint8_t, 0x40> buffer;
+    };
+    mutable std::vector<aligned::vector<std::uint8_t, 0x40>> pool;
+    mutable Stats counters;
 };
 
 #endif // IOSUFSA_HPP
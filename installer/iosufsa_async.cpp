@@ -0,0 +1,137 @@
+#include "iosufsa.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "exception.hpp"
+#include "log.hpp"
+
+// Built on File::read_async and File::write_async, so shared by both the
+// console and the host backends
+
+IOSUFSA::AsyncReader::AsyncReader(const File &file, std::size_t length, std::size_t chunk) :
+        file(file), chunk(std::min(chunk, max_io)), remaining(length) {
+    for (std::size_t i = 0; i < depth && remaining > 0; ++i) {
+        buffers[i].resize(this->chunk);
+        submit(i);
+    }
+}
+
+void IOSUFSA::AsyncReader::submit(std::size_t slot) {
+    std::size_t size = std::min(chunk, remaining);
+    buffers[slot].resize(size);
+    file.read_async(buffers[slot], size, requests[slot]);
+    remaining -= size;
+    ++inflight;
+}
+
+const IOSUFSA::Buffer *IOSUFSA::AsyncReader::next() {
+    // The chunk handed out last is done with, so reuse it for the next read
+    if (handed_out) {
+        std::size_t last = (head + depth - 1) % depth;
+        if (remaining > 0) submit(last);
+        handed_out = false;
+    }
+    if (inflight == 0) return nullptr;
+
+    std::size_t slot = head;
+    head = (head + 1) % depth;
+    --inflight;
+    std::int32_t count = requests[slot].wait();
+    if (count < 0 || static_cast<std::size_t>(count) != buffers[slot].size())
+        throw error("IOSUHAX: AsyncRead: Short Read");
+    handed_out = true;
+    return &buffers[slot];
+}
+
+IOSUFSA::AsyncWriter::AsyncWriter(const File &file, std::size_t chunk) :
+        file(file), chunk(std::min(chunk, max_io)) {
+    for (Buffer &buffer : buffers) buffer.resize(this->chunk);
+}
+
+IOSUFSA::AsyncWriter::~AsyncWriter() {
+    for (std::size_t i = 0; i < depth; ++i) {
+        if (requests[i].pending()) try {
+            wait(i);
+        } catch (error &e) {
+            LOG("ERROR in ~AsyncWriter: %s", e.what());
+        }
+    }
+}
+
+void IOSUFSA::AsyncWriter::wait(std::size_t slot) {
+    std::int32_t count = requests[slot].wait();
+    if (count < 0 || static_cast<std::size_t>(count) != sizes[slot]) good = false;
+    sizes[slot] = 0;
+}
+
+void IOSUFSA::AsyncWriter::submit() {
+    file.write_async(buffers[current], sizes[current], requests[current]);
+    current = (current + 1) % depth;
+    if (requests[current].pending()) wait(current);
+}
+
+bool IOSUFSA::AsyncWriter::write(const void *data, std::size_t size) {
+    const std::uint8_t *bdata = reinterpret_cast<const std::uint8_t *>(data);
+    while (size > 0) {
+        std::size_t &filled = sizes[current];
+        std::size_t len = std::min(size, chunk - filled);
+        std::memcpy(buffers[current].data() + filled, bdata, len);
+        filled += len;
+        bdata += len;
+        size -= len;
+        if (filled == chunk) submit();
+    }
+    return good;
+}
+
+bool IOSUFSA::AsyncWriter::flush() {
+    if (sizes[current] > 0) submit();
+    for (std::size_t i = 0; i < depth; ++i) {
+        if (requests[i].pending()) wait(i);
+    }
+    return good;
+}
+
+IOSUFSA::BufferedReader::BufferedReader(const File &file, std::size_t window,
+                                        std::size_t position) :
+        file(file), window(std::min(window, max_io)), start(position), file_pos(position),
+        buffer(this->window) { }
+
+bool IOSUFSA::BufferedReader::fill() {
+    std::size_t position = tell();
+    if (file_pos != position) {
+        if (!file.seek(position)) return false;
+        file_pos = position;
+    }
+    file.read_async(buffer, window, request);
+    std::int32_t count = request.wait();
+    start = position;
+    offset = 0;
+    filled = count > 0 ? static_cast<std::size_t>(count) : 0;
+    file_pos += filled;
+    return filled > 0;
+}
+
+bool IOSUFSA::BufferedReader::readall(void *data, std::size_t size) {
+    std::uint8_t *bdata = reinterpret_cast<std::uint8_t *>(data);
+    while (size > 0) {
+        if (offset == filled && !fill()) return false;
+        std::size_t len = std::min(size, filled - offset);
+        std::memcpy(bdata, buffer.data() + offset, len);
+        offset += len;
+        bdata += len;
+        size -= len;
+    }
+    return true;
+}
+
+void IOSUFSA::BufferedReader::seek(std::size_t position) {
+    if (position >= start && position <= start + filled) {
+        offset = position - start;
+    } else {
+        start = position;
+        offset = filled = 0;
+    }
+}
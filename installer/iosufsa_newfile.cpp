@@ -0,0 +1,88 @@
+#include "iosufsa.hpp"
+
+#include <string>
+#include <string_view>
+
+#include "exception.hpp"
+#include "log.hpp"
+
+using namespace std::string_view_literals;
+
+// Built on File and the path commands, so shared by both the console and
+// the host backends
+
+IOSUFSA::NewFile::NewFile(const IOSUFSA &fsa, std::string_view path) :
+        File(fsa), fsa(fsa), path(path), temp(path), backup(path) {
+    temp += ".tmp"sv;
+    backup += ".bak"sv;
+}
+
+IOSUFSA::NewFile::~NewFile() {
+    if (!written) return;
+    try {
+        LOG("NewFile destructed without commit");
+        close();
+        fsa.remove(temp);
+    } catch (error &e) {
+        LOG("ERROR in ~NewFile: %s", e.what());
+    }
+}
+
+bool IOSUFSA::NewFile::open() {
+    // A temp file already beside path is from a commit cut short, which is
+    // finished first, or from a write that never got to its commit
+    Stat stat;
+    if (fsa.stat(temp, stat)) {
+        recover(fsa, path);
+        if (fsa.remove(temp)) LOG("NewFile: Removed Leftover %s", temp.c_str());
+    }
+    written = File::open(temp, "wb");
+    return written;
+}
+
+bool IOSUFSA::NewFile::commit() {
+    if (!written) throw error("FSA: NewFile Commit: Not Open");
+    if (!close()) return false;
+    if (fsa.rename(temp, path)) {
+        written = false;
+        return true;
+    }
+    // The FSA won't rename over a file, so the old one is moved aside and
+    // only removed once the new one has taken its place. A commit cut
+    // short in between is finished by recover.
+    fsa.remove(backup);
+    if (!fsa.rename(path, backup)) return false;
+    if (!fsa.rename(temp, path)) {
+        fsa.rename(backup, path);
+        return false;
+    }
+    written = false;
+    if (!fsa.remove(backup)) LOG("NewFile: Can't Remove %s", backup.c_str());
+    return true;
+}
+
+bool IOSUFSA::NewFile::recover(const IOSUFSA &fsa, std::string_view path) {
+    Stat stat;
+    if (fsa.stat(path, stat)) return true;
+
+    // commit moves path aside to the backup, and only then moves the new
+    // file, already closed, from the temp to path. With path missing, a
+    // temp and a backup together mean the commit stopped between the two,
+    // so the temp is complete and taken. A temp alone is a file that was
+    // never committed, and may be cut short, so it's left for the next
+    // NewFile to remove. A backup alone is put back.
+    std::string temp(path), backup(path);
+    temp += ".tmp"sv;
+    backup += ".bak"sv;
+    if (fsa.stat(backup, stat) && fsa.stat(temp, stat)) {
+        LOG("NewFile: Finishing Commit of %s", temp.c_str());
+        if (!fsa.rename(temp, path)) return false;
+        fsa.remove(backup);
+        return true;
+    }
+    if (fsa.stat(backup, stat)) {
+        LOG("NewFile: Restoring %s", backup.c_str());
+        return fsa.rename(backup, path);
+    }
+    return false;
+}
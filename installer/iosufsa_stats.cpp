@@ -0,0 +1,139 @@
+#include "iosufsa.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#ifdef __WIIU__
+#include <coreinit/time.h>
+#else
+#include <chrono>
+#endif
+
+#include "log.hpp"
+
+// Shared by both the console and the host backends, which only differ in
+// the clock
+
+namespace {
+    // Bucket 0 holds IOCTLs under a microsecond, and bucket n those from
+    // 2^(n-1) microseconds up
+    std::size_t bucket(std::uint64_t us) {
+        std::size_t n = 0;
+        while (us > 0 && n + 1 < IOSUFSA::Stats::buckets) {
+            us >>= 1;
+            ++n;
+        }
+        return n;
+    }
+
+    // Summary and latencies of a command, or nothing if it wasn't used
+    std::string describe(IOSUFSA::Stats::Command command, const IOSUFSA::Stats::Counter &c) {
+        std::string line;
+        if (c.count == 0) return line;
+        char buf[0x80];
+        std::snprintf(buf, sizeof(buf), "%-11s %7" PRIu32 " ioctls %11" PRIu64 " bytes %11"
+                      PRIu64 " copied %9" PRIu64 " us |", IOSUFSA::Stats::name(command),
+                      c.count, c.bytes, c.copied, c.total_us);
+        line = buf;
+        for (std::size_t i = 0; i < IOSUFSA::Stats::buckets; ++i) {
+            if (c.latency[i] == 0) continue;
+            bool last = i + 1 == IOSUFSA::Stats::buckets;
+            std::snprintf(buf, sizeof(buf), " %s%" PRIu64 "us:%" PRIu32, last ? ">=" : "<",
+                          std::uint64_t{1} << (last ? i - 1 : i), c.latency[i]);
+            line += buf;
+        }
+        return line;
+    }
+}
+
+const char *IOSUFSA::Stats::name(Command command) {
+    switch (command) {
+        case OPENFILE: return "OPENFILE";
+        case CLOSEFILE: return "CLOSEFILE";
+        case READFILE: return "READFILE";
+        case WRITEFILE: return "WRITEFILE";
+        case SETFILEPOS: return "SETFILEPOS";
+        case STATFILE: return "STATFILE";
+        case GETSTAT: return "GETSTAT";
+        case REMOVE: return "REMOVE";
+        case RENAME: return "RENAME";
+        case FLUSHVOLUME: return "FLUSHVOLUME";
+        case OPENDIR: return "OPENDIR";
+        case READDIR: return "READDIR";
+        case CLOSEDIR: return "CLOSEDIR";
+        case COMMANDS: break;
+    }
+    return "UNKNOWN";
+}
+
+std::uint64_t IOSUFSA::Stats::now_us() {
+#ifdef __WIIU__
+    return OSTicksToMicroseconds(OSGetSystemTime());
+#else
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void IOSUFSA::Stats::add(Command command, std::uint64_t us, std::uint64_t bytes,
+                         std::uint64_t copied) {
+    Counter &c = commands[command];
+    ++c.count;
+    c.bytes += bytes;
+    c.copied += copied;
+    c.total_us += us;
+    ++c.latency[bucket(us)];
+}
+
+IOSUFSA::Stats &IOSUFSA::Stats::operator+=(const Stats &o) {
+    for (std::size_t i = 0; i < COMMANDS; ++i) {
+        Counter &c = commands[i];
+        const Counter &oc = o.commands[i];
+        c.count += oc.count;
+        c.bytes += oc.bytes;
+        c.copied += oc.copied;
+        c.total_us += oc.total_us;
+        for (std::size_t j = 0; j < buckets; ++j) c.latency[j] += oc.latency[j];
+    }
+    return *this;
+}
+
+IOSUFSA::Stats &IOSUFSA::Stats::operator-=(const Stats &o) {
+    for (std::size_t i = 0; i < COMMANDS; ++i) {
+        Counter &c = commands[i];
+        const Counter &oc = o.commands[i];
+        c.count -= oc.count;
+        c.bytes -= oc.bytes;
+        c.copied -= oc.copied;
+        c.total_us -= oc.total_us;
+        for (std::size_t j = 0; j < buckets; ++j) c.latency[j] -= oc.latency[j];
+    }
+    return *this;
+}
+
+void IOSUFSA::Stats::log() const {
+    for (std::size_t i = 0; i < COMMANDS; ++i) {
+        std::string line = describe(static_cast<Command>(i), commands[i]);
+        if (!line.empty()) LOG("IOSTATS %s", line.c_str());
+    }
+}
+
+bool IOSUFSA::Stats::write(std::FILE *file) const {
+    bool good = true;
+    for (std::size_t i = 0; i < COMMANDS; ++i) {
+        std::string line = describe(static_cast<Command>(i), commands[i]);
+        if (!line.empty()) good &= std::fprintf(file, "%s\n", line.c_str()) > 0;
+    }
+    return good;
+}
+
+bool IOSUFSA::Stats::save(const std::string &path) const {
+    std::FILE *file = std::fopen(path.c_str(), "w");
+    if (!file) return false;
+    bool good = write(file);
+    good &= std::fclose(file) == 0;
+    return good;
+}
@@ -1,7 +1,16 @@
 #ifndef LOG_HPP
 #define LOG_HPP
 
-#if DEBUG_LOG >= 2
+#if DEBUG_LOG && !defined(__WIIU__)
+
+#include <cstdio>
+
+// Host builds log to stderr
+#define LOGINIT() ((void) 0)
+#define LOGFINISH() ((void) 0)
+#define LOG(...) do { std::fprintf(stderr, __VA_ARGS__); std::fputc('\n', stderr); } while(0)
+
+#elif DEBUG_LOG >= 2
 
 #include <whb/crash.h>
 #include <whb/log.h>
@@ -1,20 +1,27 @@
 #include <algorithm>
 #include <cstdint>
+#include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 
 #include <coreinit/thread.h>
 #include <coreinit/time.h>
 
+#include <sys/stat.h>
+
 #include "controls.hpp"
-#include "hachi_patch.hpp"
 #include "iosufsa.hpp"
 #include "log.hpp"
 #include "messages.hpp"
-#include "ntr_patch.hpp"
 #include "patch.hpp"
+#include "patch_cache.hpp"
+#include "patch_worker.hpp"
 #include "proc.hpp"
+#include "progress.hpp"
 #include "save_clean.hpp"
+#include "scan_cache.hpp"
+#include "scanner.hpp"
 #include "screen.hpp"
 #include "title.hpp"
 #include "util.hpp"
@@ -27,6 +34,16 @@ namespace {
     constexpr std::uint64_t SM64DS_USA_TITLE_ID = 0x00050000'101C3400;
     constexpr std::uint64_t SM64DS_EUR_TITLE_ID = 0x00050000'101C3500;
 
+    // Everything kept on the SD card lives beside the app
+    constexpr std::string_view app_dir = "fs:/vol/external01/wiiu/apps/am64ds/"sv;
+    constexpr std::string_view scan_cache_file = "am64ds.cache"sv;
+    constexpr std::string_view patch_cache_dir = "patched"sv;
+    constexpr std::string_view io_stats_file = "iostats.txt"sv;
+
+    std::string app_path(std::string_view name) {
+        return util::concat_sv({ app_dir, name });
+    }
+
     enum class ControlState {
         SELECT,
         CONFIRM,
@@ -39,80 +56,85 @@ namespace {
                title.get_id() == SM64DS_EUR_TITLE_ID;
     }
 
-    Title::Filtered scan_titles(std::vector<Title> &titles, bool full) {
-        Title::Filtered filtered;
-        LOG("Init IOSUHAX...");
-        IOSUFSA fsa;
-        fsa.open();
-
-        filtered = Title::filter(titles,
-            [&fsa, full](Title &title) -> bool {
-                return (!full && !check_titleid(title)) ||
-                       title.get_status(fsa) <= Patch::Status::UNTESTED;
-            });
+    // Starts checking the titles in the background. Titles already checked
+    // by an earlier scan are kept as they are.
+    std::unique_ptr<Scanner> start_scan(WUProc &proc, ScanCache &cache,
+                                        std::vector<Title> &titles, bool full) {
+        return std::make_unique<Scanner>(proc, cache, Title::filter(titles,
+            [full](Title &title) -> bool {
+                return !full && !check_titleid(title);
+            }));
+    }
 
-        LOG("Closing IOSUHAX");
-        fsa.close();
-        return filtered;
+    // Patched files are only kept once their directory has been made on the
+    // SD card, by hand or by copying one filled by am64ds-cli seed
+    bool use_patch_cache() {
+        struct stat st;
+        return ::stat(app_path(patch_cache_dir).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
     }
 
-    void patch_title(Screen &screen, Title &title) {
-        Messages::patch(screen, 0);
+    void patch_titles(WUProc &proc, Screen &screen, IOSUFSA &fsa, const Title::Filtered &titles) {
         LOG("Init IOSUHAX...");
-        IOSUFSA fsa;
         fsa.open();
 
-        LOG("Patching Hachi...");
-        std::unique_ptr<Patch> hachi = hachi_patch(fsa, title.get_path());
-        LOG("Read Hachi");
-        Messages::patch(screen, 1);
-        hachi->Read();
-        LOG("Patch Hachi");
-        Messages::patch(screen, 2);
-        hachi->Modify();
-        LOG("Write Hachi");
-        Messages::patch(screen, 3);
-        hachi->Write();
-        hachi.release();
-
-        LOG("Patching NTR...");
-        std::unique_ptr<Patch> ntr = ntr_patch(fsa, title.get_path());
-        LOG("Read NTR");
-        Messages::patch(screen, 4);
-        ntr->Read();
-        LOG("Patch NTR");
-        Messages::patch(screen, 5);
-        ntr->Modify();
-        LOG("Write NTR");
-        Messages::patch(screen, 6);
-        ntr->Write();
-        ntr.release();
-
-        LOG("Start Savestate Cleaning...");
-        Messages::patch(screen, 7);
-        save_clean(fsa, title.get_path());
-        LOG("Savestate Cleaning Done");
-
-        std::string dev = util::concat_sv({ "/vol/storage_"sv, title.get_dev(), "01"sv });
-        LOG("Flush Volume %s ...", dev.c_str());
-        bool status = fsa.flush_volume(dev);
-
-        if (status) {
-            LOG("Flush Volume Successful");
-        } else {
-            LOG("FLUSH VOLUME FAILURE");
+        std::vector<std::string> paths;
+        std::vector<std::string_view> devs;
+        for (const Title &title : titles) {
+            paths.push_back(title.get_path());
+            if (std::find(devs.begin(), devs.end(), title.get_dev()) == devs.end())
+                devs.push_back(title.get_dev());
         }
-        title.flag_patched();
 
-        LOG("Closing IOSUHAX");
-        fsa.close();
+        Progress progress;
+        PatchCache cache { app_path(patch_cache_dir) };
+        PatchOptions options;
+        if (use_patch_cache()) options.cache = &cache;
+        PatchWorker worker(fsa, std::move(paths), progress,
+            [&titles](const IOSUFSA &session, std::size_t i) {
+                LOG("Start Savestate Cleaning...");
+                save_clean(session, titles[i].get().get_path());
+                LOG("Savestate Cleaning Done");
+            },
+            // Each volume is flushed once, after all of its titles
+            [&devs](const IOSUFSA &session) {
+                for (std::string_view dev_name : devs) {
+                    std::string dev = util::concat_sv({ "/vol/storage_"sv, dev_name, "01"sv });
+                    LOG("Flush Volume %s ...", dev.c_str());
+                    bool status = session.flush_volume(dev);
+
+                    if (status) {
+                        LOG("Flush Volume Successful");
+                    } else {
+                        LOG("FLUSH VOLUME FAILURE");
+                    }
+                }
+            }, options);
+
+        // ProcUI is serviced throughout, as the compress steps take a while.
+        // The patch can't be stopped halfway, so an exit waits for it.
+        while (!worker.done()) {
+            proc.update();
+            Messages::patch(screen, progress.snapshot());
+            OSSleepTicks(OSMillisecondsToTicks(50));
+        }
+        worker.join();
+
+        Progress::Snapshot done = progress.snapshot();
+        LOG("Patched %u titles: %u bytes read, %u inflated, %u deflated, %u written in %u ms",
+            done.titles_done, done.total(Progress::Bytes::READ),
+            done.total(Progress::Bytes::INFLATED), done.total(Progress::Bytes::DEFLATED),
+            done.total(Progress::Bytes::WRITTEN), done.elapsed_ms);
+        // Kept on the SD card as well, to tell slow storage from slow patching
+        worker.io_stats().log();
+        if (!worker.io_stats().save(app_path(io_stats_file))) LOG("SAVE IO STATS FAILURE");
+        for (Title &title : titles) title.flag_patched();
     }
 
-    bool has_status(const std::vector<Title> &titles, Patch::Status status) {
-        return std::any_of(titles.begin(), titles.end(),
-            [status](const Title &title) -> bool {
-                return title.get_status_raw() == status;
-            });
+    void drop_unlisted(Title::Filtered &filtered) {
+        filtered.erase(std::remove_if(filtered.begin(), filtered.end(),
+            [](const Title &title) -> bool {
+                return title.get_status_raw() <= Patch::Status::UNTESTED;
+            }), filtered.end());
     }
 }
 
@@ -122,55 +144,98 @@ int main(int argc, char **argv) {
     Controls controls;
     LOGINIT();
 
+    // One IOSUHAX session serves every patch until exit, while each scan
+    // brings its own for the background thread. The HOME menu is kept
+    // closed for as long as the session is open.
+    std::optional<WUForegroundHold> fsa_hold;
+    IOSUFSA fsa;
+    ScanCache cache { app_path(scan_cache_file) };
     std::vector<Title> titles;
     Title::Filtered filtered;
+    std::unique_ptr<Scanner> scanner;
     std::size_t selected = 0;
     ControlState state = ControlState::SELECT;
     bool full = false, haxchi = false, patched = false;
 
+    // Entries after the titles, only offered once the current scan has
+    // finished: patching all of the titles listed, then the full scan
+    auto offer_all = [&filtered, &scanner]() -> bool { return !scanner && filtered.size() > 1; };
+    auto offer_full = [&full, &scanner]() -> bool { return !full && !scanner; };
+    auto is_all = [&]() -> bool { return selected == filtered.size() && offer_all(); };
+    auto show_select = [&]() {
+        Messages::select(screen, filtered, selected, full, haxchi, patched, proc.is_hbl(),
+                         scanner ? scanner->scanned() : 0, scanner ? scanner->total() : 0);
+    };
+
     try {
         {
             WUHomeLock home_lock(proc, controls);
             Messages::scanning(screen, full);
 
+            cache.load();
             titles = Title::get_titles();
-            filtered = scan_titles(titles, full);
-
-            for (Title &title : filtered) {
-                LOG("FOUND: %s", title.get_path().c_str());
-                LOG("FOUND NAME: %s", title.get_name().c_str());
-            }
+            LOG("Init IOSUHAX...");
+            fsa_hold.emplace(proc);
+            fsa.open();
+            scanner = start_scan(proc, cache, titles, full);
         }
 
-        haxchi = has_status(titles, Patch::Status::IS_HAXCHI);
-        patched = has_status(titles, Patch::Status::PATCHED);
-
-        Messages::select(screen, filtered, selected, full, haxchi, patched, proc.is_hbl());
+        show_select();
+        std::size_t shown = scanner->scanned();
 
         LOG("Entering Proc Loop...");
         while (proc.update()) {
             OSSleepTicks(OSMillisecondsToTicks(25));
 
+            if (scanner) {
+                // Checked before polling, so nothing found is left behind
+                bool finished = scanner->done();
+                Title *current = (selected < filtered.size()) ? &filtered[selected].get() : nullptr;
+                bool changed = scanner->poll(filtered);
+                if (current) {
+                    selected = std::find_if(filtered.begin(), filtered.end(),
+                        [current](const Title &title) -> bool { return &title == current; })
+                        - filtered.begin();
+                }
+                haxchi = haxchi || scanner->seen(Patch::Status::IS_HAXCHI);
+                patched = patched || scanner->seen(Patch::Status::PATCHED);
+                if (finished) {
+                    LOG("Scan Finished");
+                    scanner->finish();
+                    scanner.reset();
+                    changed = true;
+                } else if (scanner->scanned() != shown) {
+                    shown = scanner->scanned();
+                    changed = true;
+                }
+                if (changed && state == ControlState::SELECT) show_select();
+            }
+
             switch (state) {
                 case ControlState::SELECT:
                     switch (controls.get()) {
                         case Controls::Input::A:
-                            if (selected < filtered.size())
+                            if (selected < filtered.size()) {
                                 Messages::confirm(screen, filtered[selected], proc.is_hbl());
-                            else if (!full)
+                                state = ControlState::CONFIRM;
+                            } else if (is_all()) {
+                                Messages::confirm_all(screen, filtered, proc.is_hbl());
+                                state = ControlState::CONFIRM;
+                            } else if (offer_full()) {
                                 Messages::full_warn(screen, proc.is_hbl());
-                            state = ControlState::CONFIRM;
+                                state = ControlState::CONFIRM;
+                            }
                             break;
                         case Controls::Input::Up:
                             if (selected > 0) {
-                                Messages::select(screen, filtered, --selected,
-                                                 full, haxchi, patched, proc.is_hbl());
+                                --selected;
+                                show_select();
                             }
                             break;
                         case Controls::Input::Down:
-                            if (selected < (filtered.size() + !full) - 1) {
-                                Messages::select(screen, filtered, ++selected,
-                                                 full, haxchi, patched, proc.is_hbl());
+                            if (selected + 1 < filtered.size() + offer_all() + offer_full()) {
+                                ++selected;
+                                show_select();
                             }
                             break;
                         default:
@@ -180,29 +245,26 @@ int main(int argc, char **argv) {
                 case ControlState::CONFIRM:
                     switch (controls.get()) {
                         case Controls::Input::A:
-                            if (selected < filtered.size()) {
+                            if (selected < filtered.size() || is_all()) {
                                 WUHomeLock home_lock(proc, controls);
                                 proc.flag_dirty();
-                                patch_title(screen, filtered[selected]);
-                                filtered = scan_titles(titles, full);
+                                if (is_all()) patch_titles(proc, screen, fsa, filtered);
+                                else patch_titles(proc, screen, fsa, { filtered[selected] });
+                                drop_unlisted(filtered);
                                 patched = true;
                                 Messages::post_patch(screen);
                                 state = ControlState::CLEAR;
                             } else {
-                                WUHomeLock home_lock(proc, controls);
                                 full = true;
-                                Messages::scanning(screen, full);
-                                filtered = scan_titles(titles, full);
-                                patched = has_status(titles, Patch::Status::PATCHED);
+                                scanner = start_scan(proc, cache, titles, full);
+                                shown = scanner->scanned();
                                 selected = 0;
-                                Messages::select(screen, filtered, selected,
-                                                 full, haxchi, patched, proc.is_hbl());
+                                show_select();
                                 state = ControlState::SELECT;
                             }
                             break;
                         case Controls::Input::B:
-                            Messages::select(screen, filtered, selected,
-                                             full, haxchi, patched, proc.is_hbl());
+                            show_select();
                             state = ControlState::SELECT;
                             break;
                         default:
@@ -212,8 +274,8 @@ int main(int argc, char **argv) {
                 case ControlState::CLEAR:
                     switch (controls.get()) {
                         case Controls::Input::B:
-                            Messages::select(screen, filtered, (selected = 0),
-                                             full, haxchi, patched, proc.is_hbl());
+                            selected = 0;
+                            show_select();
                             state = ControlState::SELECT;
                             break;
                         default:
@@ -222,6 +284,11 @@ int main(int argc, char **argv) {
                     break;
             }
         }
+
+        scanner.reset();
+        LOG("Closing IOSUHAX");
+        fsa.close();
+        fsa_hold.reset();
     } catch (error &e) {
         LOG("Error: %s", e.what());
         Messages::except(screen, e.what(), proc.is_hbl());
@@ -236,6 +303,8 @@ int main(int argc, char **argv) {
             OSSleepTicks(OSMillisecondsToTicks(25));
     }
 
+    // Stops a scan left running by an error
+    scanner.reset();
     LOG("Exiting... good bye.");
 
     LOGFINISH();
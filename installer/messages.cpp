@@ -25,10 +25,17 @@ namespace {
     constexpr Screen::Line wait = { 2, 0, "Scanning your system,"};
     constexpr Screen::Line wait_part = { 2, 22, "please wait..." };
     constexpr Screen::Line wait_full = { 2, 22, "this may take a few minutes." };
+    constexpr std::string_view progress_template = "Scanning... 0000/0000"sv;
+    constexpr std::size_t progress_row = 11;
+    constexpr std::size_t progress_column = 2;
+    constexpr std::size_t progress_scanned_off = 12;
+    constexpr std::size_t progress_total_off = 17;
+    constexpr std::size_t progress_digits = 4;
 
     constexpr Screen::Line list_head = { 2, 0, "Select the title to patch:" };
     constexpr std::string_view title_template = "  00000000:00000000 [XXX]"sv;
     constexpr std::string_view scan_template = "  Perform Full System Scan"sv;
+    constexpr std::string_view all_template = "  Patch All Listed Titles"sv;
     constexpr std::size_t reg_len = 3;
     constexpr std::array<char[reg_len + 1], 4> regions = { "JPN", "USA", "EUR", "KOR" };
     constexpr char select_char = '>';
@@ -63,6 +70,15 @@ namespace {
         "will need to delete the game in System Settings under\n"
         "Data Management and reinstall it." };
     constexpr Screen::Line install_a = { bottom - 3, 2, "Press A to patch the game" };
+
+    constexpr Screen::Line all_head = { 2, 2, "Install the AM64DS patch to all of these titles?" };
+    constexpr std::size_t all_title_row = 3;
+    constexpr Screen::Line all_more = { 3 + select_count, 4, "..." };
+    constexpr Screen::Line all_msg = { 9, 0,
+        "Once the patch is installed, you will need to use a CFW when\n"
+        "launching the games. To uninstall the patch, delete the game\n"
+        "in System Settings under Data Management and reinstall it." };
+    constexpr Screen::Line all_a = { bottom - 3, 2, "Press A to patch the games" };
     constexpr Screen::Line install_b = { bottom - 2, 2, "Press B to go back" };
 
     constexpr Screen::Line full_head = { 2, 2, "Scan all installed titles?" };
@@ -75,13 +91,39 @@ namespace {
     constexpr Screen::Line full_a = { bottom - 3, 2, "Press A to perform a Full System Scan" };
 
     constexpr Screen::Line patch_head = { 2, 2, "Patching SM64DS. This may take a minute..." };
-    constexpr Screen::Line patch_rpx_read = { 4, 0, "Read Hachi RPX" };
-    constexpr Screen::Line patch_rpx_modify = { 5, 0, "Patch Hachi RPX" };
-    constexpr Screen::Line patch_rpx_write = { 6, 0, "Write Hachi RPX" };
-    constexpr Screen::Line patch_ntr_read = { 7, 0, "Read NTR ROM" };
-    constexpr Screen::Line patch_ntr_modify = { 8, 0, "Patch NTR ROM" };
-    constexpr Screen::Line patch_ntr_write = { 9, 0, "Write NTR ROM" };
-    constexpr Screen::Line patch_final = { 10, 0, "Finalizing Patch" };
+    // Indexed by step, each shown once started and marked while running
+    constexpr std::array<Screen::Line, Progress::steps> patch_steps = { {
+        { 4, 0, "Read Hachi RPX" },
+        { 5, 0, "Read NTR ROM" },
+        { 6, 0, "Patch Hachi RPX" },
+        { 7, 0, "Write Hachi RPX" },
+        { 8, 0, "Patch NTR ROM" },
+        { 9, 0, "Write NTR ROM" },
+        { 10, 0, "Clean Savestates" },
+        { 11, 0, "Flush Volumes" },
+    } };
+    constexpr const char *patch_running = "...";
+    constexpr std::size_t patch_running_column = 18;
+    constexpr std::string_view bar_template = "[                                        ]    %"sv;
+    constexpr std::size_t bar_row = 12;
+    constexpr std::size_t bar_column = 2;
+    constexpr std::size_t bar_len = 40;
+    constexpr std::size_t bar_pct_off = bar_len + 3;
+    constexpr char bar_char = '#';
+    constexpr std::string_view rate_template = "    .   MiB/s, about   :   left"sv;
+    constexpr std::size_t rate_row = 13;
+    constexpr std::size_t rate_column = 2;
+    constexpr std::size_t rate_int_off = 0;
+    constexpr std::size_t rate_frac_off = 5;
+    constexpr std::size_t eta_min_off = 21;
+    constexpr std::size_t eta_sec_off = 24;
+    constexpr std::string_view batch_template = "Title     of     (    .   titles/min)"sv;
+    constexpr std::size_t batch_row = 14;
+    constexpr std::size_t batch_column = 2;
+    constexpr std::size_t batch_title_off = 6;
+    constexpr std::size_t batch_count_off = 13;
+    constexpr std::size_t batch_rate_int_off = 18;
+    constexpr std::size_t batch_rate_frac_off = 23;
 
     constexpr Screen::Line post_head = { 2, 2, "Patching Complete" };
     constexpr Screen::Line post_msg = { 4, 0,
@@ -104,6 +146,16 @@ namespace {
         "This patching tool requires a CFW such as Mocha or Haxhi\n"
         "to be running for the installer to work. Please make sure\n"
         "your CFW is running and restart this tool." };
+
+    // Fills in a line made from title_template
+    void fill_title(std::string &line, const Title &title) {
+        util::write_hex(title.get_id() >> 32, line, high_off);
+        util::write_hex(title.get_id(), line, low_off);
+        std::size_t reg_ind = static_cast<std::size_t>(title.get_status_raw()) -
+                              static_cast<std::size_t>(Patch::Status::IS_JPN);
+        for (std::size_t j = 0; j < reg_len; ++j)
+            line[reg_off + j] = regions[reg_ind][j];
+    }
 }
 
 void Messages::scanning(Screen &screen, bool full) {
@@ -116,9 +168,24 @@ void Messages::scanning(Screen &screen, bool full) {
 
 void Messages::select(Screen &screen, const Title::Filtered &titles,
                       std::size_t selected, bool full, bool haxchi,
-                      bool patched, bool hbl) {
+                      bool patched, bool hbl,
+                      std::size_t scanned, std::size_t total) {
+    // Matches the entries offered by main
+    bool scanning = total > 0;
+    bool offer_all = !scanning && titles.size() > 1;
+    bool offer_full = !full && !scanning;
     screen.put(title_line);
-    if (titles.empty()) {
+    if (scanning) {
+        std::string line(progress_template);
+        util::write_dec(scanned, line, progress_scanned_off, progress_digits);
+        util::write_dec(total, line, progress_total_off, progress_digits);
+        screen.put(progress_row, progress_column, line);
+    }
+    if (titles.empty() && scanning) {
+        screen.put(wait);
+        if (full) screen.put(wait_full);
+        else screen.put(wait_part);
+    } else if (titles.empty()) {
         if (patched) screen.put(patched_list);
         else screen.put(no_list);
         if (!full) {
@@ -129,9 +196,10 @@ void Messages::select(Screen &screen, const Title::Filtered &titles,
     } else {
         screen.put(list_head);
         std::string line;
-        line.reserve(std::max(title_template.length(), scan_template.length()));
+        line.reserve(std::max({ title_template.length(), scan_template.length(),
+                                all_template.length() }));
         line = title_template;
-        std::size_t count = titles.size() + (!full);
+        std::size_t count = titles.size() + offer_all + offer_full;
         std::size_t show = std::min(count, select_count);
         std::size_t start;
         if (count <= select_count) {
@@ -149,16 +217,12 @@ void Messages::select(Screen &screen, const Title::Filtered &titles,
         }
         for (std::size_t i = 0; i < show; ++i) {
             std::size_t off = start + i;
-            if (off == titles.size()) {
+            if (off == titles.size() && offer_all) {
+                line = all_template;
+            } else if (off >= titles.size()) {
                 line = scan_template;
             } else {
-                Title &title = titles[off];
-                util::write_hex(title.get_id() >> 32, line, high_off);
-                util::write_hex(title.get_id(), line, low_off);
-                std::size_t reg_ind = static_cast<std::size_t>(title.get_status_raw()) -
-                                      static_cast<std::size_t>(Patch::Status::IS_JPN);
-                for (std::size_t j = 0; j < reg_len; ++j)
-                    line[reg_off + j] = regions[reg_ind][j];
+                fill_title(line, titles[off]);
             }
             if (off == selected) line[0] = select_char;
             else line[0] = title_template[0];
@@ -176,12 +240,7 @@ void Messages::confirm(Screen &screen, Title &title, bool hbl) {
     screen.put(install_head);
 
     std::string line(title_template);
-    util::write_hex(title.get_id() >> 32, line, high_off);
-    util::write_hex(title.get_id(), line, low_off);
-    std::size_t reg_ind = static_cast<std::size_t>(title.get_status_raw()) -
-                          static_cast<std::size_t>(Patch::Status::IS_JPN);
-    for (std::size_t j = 0; j < reg_len; ++j)
-        line[reg_off + j] = regions[reg_ind][j];
+    fill_title(line, title);
     screen.put(install_title_row, install_title_column, line);
 
     screen.put(install_msg);
@@ -192,6 +251,25 @@ void Messages::confirm(Screen &screen, Title &title, bool hbl) {
     screen.swap();
 }
 
+void Messages::confirm_all(Screen &screen, const Title::Filtered &titles, bool hbl) {
+    screen.put(title_line);
+    screen.put(all_head);
+
+    std::string line(title_template);
+    for (std::size_t i = 0; i < std::min(titles.size(), select_count); ++i) {
+        fill_title(line, titles[i]);
+        screen.put(all_title_row + i, install_title_column, line);
+    }
+    if (titles.size() > select_count) screen.put(all_more);
+
+    screen.put(all_msg);
+    screen.put(all_a);
+    screen.put(install_b);
+    if (hbl) screen.put(home_hbl);
+    else screen.put(home_menu);
+    screen.swap();
+}
+
 void Messages::full_warn(Screen &screen, bool hbl) {
     screen.put(title_line);
     screen.put(full_head);
@@ -203,16 +281,45 @@ void Messages::full_warn(Screen &screen, bool hbl) {
     screen.swap();
 }
 
-void Messages::patch(Screen &screen, int step) {
+void Messages::patch(Screen &screen, const Progress::Snapshot &progress) {
     screen.put(title_line);
     screen.put(patch_head);
-    if (step >= 1) screen.put(patch_rpx_read);
-    if (step >= 2) screen.put(patch_rpx_modify);
-    if (step >= 3) screen.put(patch_rpx_write);
-    if (step >= 4) screen.put(patch_ntr_read);
-    if (step >= 5) screen.put(patch_ntr_modify);
-    if (step >= 6) screen.put(patch_ntr_write);
-    if (step >= 7) screen.put(patch_final);
+    for (std::size_t i = 0; i < patch_steps.size(); ++i) {
+        int step = static_cast<int>(i) + 1;
+        if (!progress.has_started(step)) continue;
+        screen.put(patch_steps[i]);
+        if (progress.is_running(step))
+            screen.put(patch_steps[i].row, patch_running_column, patch_running);
+    }
+
+    std::uint32_t permille = progress.permille();
+    std::string bar(bar_template);
+    std::fill_n(bar.begin() + 1, permille * bar_len / 1000, bar_char);
+    util::write_dec(permille / 10, bar, bar_pct_off, 3);
+    screen.put(bar_row, bar_column, bar);
+
+    std::uint32_t eta = (progress.eta_ms() + 999) / 1000;
+    if (eta > 0) {
+        // Rate in hundredths of a MiB
+        std::uint32_t rate = static_cast<std::uint32_t>(
+            static_cast<std::uint64_t>(progress.rate()) * 100 / 0x10'0000);
+        std::string line(rate_template);
+        util::write_dec(rate / 100, line, rate_int_off, 4);
+        util::write_dec(rate % 100, line, rate_frac_off, 2, '0');
+        util::write_dec(std::min<std::uint32_t>(eta / 60, 99), line, eta_min_off, 2);
+        util::write_dec(eta % 60, line, eta_sec_off, 2, '0');
+        screen.put(rate_row, rate_column, line);
+    }
+
+    if (progress.titles > 1) {
+        std::uint32_t rate = progress.titles_per_min();
+        std::string line(batch_template);
+        util::write_dec(std::min(progress.titles_done + 1, progress.titles), line, batch_title_off, 3);
+        util::write_dec(progress.titles, line, batch_count_off, 3);
+        util::write_dec(rate / 100, line, batch_rate_int_off, 4);
+        util::write_dec(rate % 100, line, batch_rate_frac_off, 2, '0');
+        screen.put(batch_row, batch_column, line);
+    }
     screen.swap();
 }
 
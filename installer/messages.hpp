@@ -1,17 +1,21 @@
 #ifndef MESSAGES_HPP
 #define MESSAGES_HPP
 
+#include "progress.hpp"
 #include "screen.hpp"
 #include "title.hpp"
 
 namespace Messages {
     void scanning(Screen &screen, bool full = false);
+    // total is non-zero while a scan is running in the background
     void select(Screen &screen, const Title::Filtered &titles,
                 std::size_t selected, bool full, bool haxchi,
-                bool patched, bool hbl);
+                bool patched, bool hbl,
+                std::size_t scanned = 0, std::size_t total = 0);
     void confirm(Screen &screen, Title &title, bool hbl);
+    void confirm_all(Screen &screen, const Title::Filtered &titles, bool hbl);
     void full_warn(Screen &screen, bool hbl);
-    void patch(Screen &screen, int step);
+    void patch(Screen &screen, const Progress::Snapshot &progress);
     void post_patch(Screen &screen);
     void except(Screen &screen, const char *msg, bool hbl);
     void no_iosuhax(Screen &screen, bool hbl);
@@ -1,14 +1,14 @@
 #include "ntr_patch.hpp"
 
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <utility>
 #include <vector>
 
-#include <machine/endian.h>
-
 #include "exception.hpp"
 #include "iosufsa.hpp"
 #include "log.hpp"
@@ -21,12 +21,6 @@
 using namespace std::string_view_literals;
 
 namespace {
-    // Overloads for automatically selecting the correct sized bswap
-    inline __attribute__((always_inline)) std::uint16_t
-        bswap(std::uint16_t v) { return __bswap16(v); }
-    inline __attribute__((always_inline)) std::uint32_t
-        bswap(std::uint32_t v) { return __bswap32(v); }
-
     struct sm64ds_offsets {
         std::uint32_t touch_buttons;
         std::uint32_t direction_input;
@@ -35,8 +29,6 @@ namespace {
         std::uint32_t draw_touch_buttons;
     };
 
-    constexpr std::string_view zip_file = "/content/0010/rom.zip"sv;
-
     constexpr sm64ds_offsets patch_offsets[6] {
         { 0x020244EC, 0x0202B320, 0x02073324, 0x020F0D88, 0x020F2584 }, // ASMEr0
         { 0x02024724, 0x0202B5A8, 0x020738C8, 0x020F0588, 0x020F1D98 }, // ASMJr0
@@ -100,21 +92,21 @@ namespace {
     void make_b(std::vector<std::uint8_t> &data, std::size_t data_offset,
                        std::uint32_t target_inst_offset) {
         std::uint32_t inst = 0xEA000000 | target_inst_offset;
-        *reinterpret_cast<std::uint32_t *>(data.data() + data_offset) = bswap(inst);
+        *reinterpret_cast<std::uint32_t *>(data.data() + data_offset) = util::le(inst);
     }
 
     void make_mov(std::vector<std::uint8_t> &data, std::size_t offset,
                          std::uint8_t dest, std::uint8_t rot, std::uint8_t imm) {
         std::uint32_t inst = 0xE3A00000 | (dest << 12) | ((rot / 2) << 8) | imm;
-        *reinterpret_cast<std::uint32_t *>(data.data() + offset) = bswap(inst);
+        *reinterpret_cast<std::uint32_t *>(data.data() + offset) = util::le(inst);
     }
 
     void make_u16(std::vector<std::uint8_t> &data, std::size_t offset, std::uint16_t value) {
-        *reinterpret_cast<std::uint16_t *>(data.data() + offset) = bswap(value);
+        *reinterpret_cast<std::uint16_t *>(data.data() + offset) = util::le(value);
     }
 
     void make_u32(std::vector<std::uint8_t> &data, std::size_t offset, std::uint32_t value) {
-        *reinterpret_cast<std::uint32_t *>(data.data() + offset) = bswap(value);
+        *reinterpret_cast<std::uint32_t *>(data.data() + offset) = util::le(value);
     }
 
     // Start of padding shared by all versions
@@ -124,6 +116,35 @@ namespace {
     // Bitmask indicating an overlay instruction patch
     constexpr std::uint32_t overlay_pat = 0x80000000;
 
+    // Length of the ROM prefix needed to identify it and check the padding
+    constexpr std::size_t check_len = any_pat_off + any_pat_len;
+    // Compressed data read per step when inflating the checked prefix
+    constexpr std::size_t check_chunk = 0x4000;
+    // Read or written per FSA request when streaming the ROM. AsyncReader and
+    // AsyncWriter each keep two in flight, so four are held at once. It is a
+    // multiple of the FSA's 0x40 buffer alignment and well under max_io, and
+    // at 64 KiB a 16 MiB ROM is still only 256 requests each way.
+    constexpr std::size_t write_chunk = 0x10000;
+    // Size of the inflate and deflate windows used when patching the ROM
+    constexpr std::size_t stream_window = 0x10000;
+    // Read at a time for the ZIP headers, enough for the local header and
+    // the compressed data checked after it
+    constexpr std::size_t header_window = 0x8000;
+
+    // Patched bytes to overlay onto the ROM as it is streamed
+    struct rom_edit {
+        std::size_t offset = 0;
+        std::vector<std::uint8_t> data;
+    };
+
+    void apply_edit(const rom_edit &edit, std::uint8_t *window,
+                    std::size_t pos, std::size_t len) {
+        std::size_t start = std::max(pos, edit.offset);
+        std::size_t end = std::min(pos + len, edit.offset + edit.data.size());
+        if (start < end)
+            std::memcpy(window + (start - pos), edit.data.data() + (start - edit.offset), end - start);
+    }
+
     class NtrPatch : public Patch {
     public:
         NtrPatch(const IOSUFSA &fsa, std::string_view title) :
@@ -134,131 +155,245 @@ namespace {
             LOG("Open ZIP");
             IOSUFSA::File zip(fsa);
             if (!zip.open(path, "rb")) throw error("NTR: Read FileOpen");
+            IOSUFSA::BufferedReader reader(zip, header_window);
 
             LOG("Read Local Header");
-            if (!zip.readall(&local, sizeof(local))) throw error("NTR: Read Local");
-            if (local.signature != zip_local_magic) throw error("NTR: Bad Local");
-            if (bswap(local.method) != 0 && bswap(local.method) != 8)
+            if (!reader.readall(&local, sizeof(local))) throw error("NTR: Read Local");
+            if (util::be(local.signature) != zip_local_magic) throw error("NTR: Bad Local");
+            if (util::le(local.method) != 0 && util::le(local.method) != 8)
                 throw error("NTR: Bad Local");
-            local_name.resize(bswap(local.name_len));
-            if (!zip.readall(local_name)) throw error("NTR: Read Local Name");
-            local_extra.resize(bswap(local.extra_len));
-            if (!zip.readall(local_extra)) throw error("NTR: Read Local Extra");
-
-            LOG("Read NTR");
-            data.resize(bswap(local.cmp_size));
-            if (!zip.readall(data)) throw error("NTR: Read NTR");
+            local_name.resize(util::le(local.name_len));
+            if (!reader.readall(local_name)) throw error("NTR: Read Local Name");
+            local_extra.resize(util::le(local.extra_len));
+            if (!reader.readall(local_extra)) throw error("NTR: Read Local Extra");
+
+            // The ROM is streamed from here by Write. Only enough is read now
+            // to tell which version it is.
+            LOG("Read NTR Header");
+            const std::size_t cmp_size = util::le(local.cmp_size);
+            data_off = sizeof(local) + local_name.size() + local_extra.size();
+            std::vector<std::uint8_t> prefix(std::min(cmp_size, check_chunk));
+            if (!reader.readall(prefix)) throw error("NTR: Read NTR");
+            if (util::le(local.method) == 8) {
+                Zlib::Inflater inflater(false);
+                inflater.input(prefix.data(), prefix.size());
+                std::size_t len = 0;
+                while (len < sizeof(header) && !inflater.finished() && !inflater.needs_input())
+                    len += inflater.inflate(header + len, sizeof(header) - len);
+                if (len < sizeof(header)) throw error("NTR: Short NTR");
+            } else {
+                if (prefix.size() < sizeof(header)) throw error("NTR: Short NTR");
+                std::memcpy(header, prefix.data(), sizeof(header));
+            }
 
             LOG("Read Central");
-            if (!zip.readall(&central, sizeof(central))) throw error("NTR: Read Central");
-            if (central.signature != zip_central_magic) throw error("NTR: Bad Central");
-            central_name.resize(bswap(central.name_len));
-            if (!zip.readall(central_name)) throw error("NTR: Read Central Name");
-            central_extra.resize(bswap(central.extra_len));
-            if (!zip.readall(central_extra)) throw error("NTR: Read Central Extra");
-            central_comment.resize(bswap(central.comment_len));
-            if (!zip.readall(central_comment)) throw error("NTR: Read Central Comment");
+            reader.seek(data_off + cmp_size);
+            if (!reader.readall(&central, sizeof(central))) throw error("NTR: Read Central");
+            if (util::be(central.signature) != zip_central_magic) throw error("NTR: Bad Central");
+            central_name.resize(util::le(central.name_len));
+            if (!reader.readall(central_name)) throw error("NTR: Read Central Name");
+            central_extra.resize(util::le(central.extra_len));
+            if (!reader.readall(central_extra)) throw error("NTR: Read Central Extra");
+            central_comment.resize(util::le(central.comment_len));
+            if (!reader.readall(central_comment)) throw error("NTR: Read Central Comment");
 
             LOG("Read End");
-            if (!zip.readall(&end, sizeof(end))) throw error("NTR: Read End");
-            if (end.signature != zip_end_magic) throw error("NTR: Bad End");
-            end.comment_len = bswap(std::uint16_t{0});
+            if (!reader.readall(&end, sizeof(end))) throw error("NTR: Read End");
+            if (util::be(end.signature) != zip_end_magic) throw error("NTR: Bad End");
+            end.comment_len = util::le(std::uint16_t{0});
 
             LOG("Close NTR");
+            count(Progress::Bytes::READ, sizeof(local) + local_name.size() + local_extra.size() +
+                  sizeof(central) + central_name.size() + central_extra.size() +
+                  central_comment.size() + sizeof(end));
             if (!zip.close()) throw error("NTR: Read CloseFile");
         }
 
         virtual void Modify() override {
-            if (bswap(local.method) == 8) {
-                LOG("Decompress NTR");
-                data = Zlib::decompress(data, bswap(local.dec_size), false);
-            }
-
             LOG("Identify NTR");
+            if (util::le(local.dec_size) < check_len) throw error("NTR: Short NTR");
             // Magic Hash
-            const sm64ds_offsets &offsets = patch_offsets[((data[0x0F] - 1) & 0x3) | (data[0x1E] << 2)];
+            const sm64ds_offsets &offsets = patch_offsets[((header[0x0F] - 1) & 0x3) | (header[0x1E] << 2)];
 
             LOG("Patch NTR");
-            make_b(data, 0x495C, (any_pat_off - 0x4964) / 4);
-            std::memcpy(data.data() + any_pat_off, any_pat_bin, any_pat_bin_size);
-            std::size_t off = any_pat_off + any_pat_bin_size;
-
-            make_u32(data, off, 1);
-            make_u32(data, off + 4, offsets.touch_buttons);
-            make_b(  data, off + 8, 0x0C);
+            branch.offset = 0x495C;
+            branch.data.resize(4);
+            make_b(branch.data, 0, (any_pat_off - 0x4964) / 4);
+
+            std::vector<std::uint8_t> &pat = any_pat.data;
+            any_pat.offset = any_pat_off;
+            pat.resize(any_pat_len);
+            std::memcpy(pat.data(), any_pat_bin, any_pat_bin_size);
+            std::size_t off = any_pat_bin_size;
+
+            make_u32(pat, off, 1);
+            make_u32(pat, off + 4, offsets.touch_buttons);
+            make_b(  pat, off + 8, 0x0C);
             off += 12;
 
-            make_u32(data, off, get_analog_bin_size / 4);
-            make_u32(data, off + 4, offsets.direction_input);
-            std::memcpy(data.data() + off + 8, get_analog_bin, get_analog_bin_size);
+            make_u32(pat, off, get_analog_bin_size / 4);
+            make_u32(pat, off + 4, offsets.direction_input);
+            std::memcpy(pat.data() + off + 8, get_analog_bin, get_analog_bin_size);
             off += 8 + get_analog_bin_size;
 
-            make_u32(data, off, 4 / 2);
-            make_u32(data, off + 4, offsets.dpad_mapping);
-            make_u16(data, off +  8, 0x0100);
-            make_u16(data, off + 10, 0x0200);
-            make_u16(data, off + 12, 0x0000);
-            make_u16(data, off + 14, 0x0000);
+            make_u32(pat, off, 4 / 2);
+            make_u32(pat, off + 4, offsets.dpad_mapping);
+            make_u16(pat, off +  8, 0x0100);
+            make_u16(pat, off + 10, 0x0200);
+            make_u16(pat, off + 12, 0x0000);
+            make_u16(pat, off + 14, 0x0000);
             off += 16;
 
-            make_u32(data, off, overlay_pat | 1);
-            make_u32(data, off +  4, offsets.draw_target);
-            make_u32(data, off +  8, 0xE7D22001); // Overwritten Instruction
-            make_mov(data, off + 12, 2, 0, 0); // mov r2, #0
+            make_u32(pat, off, overlay_pat | 1);
+            make_u32(pat, off +  4, offsets.draw_target);
+            make_u32(pat, off +  8, 0xE7D22001); // Overwritten Instruction
+            make_mov(pat, off + 12, 2, 0, 0); // mov r2, #0
             off += 16;
 
-            make_u32(data, off, overlay_pat | 1);
-            make_u32(data, off +  4, offsets.draw_touch_buttons);
-            make_u32(data, off +  8, 0xE19100B0); // Overwritten Instruction
-            make_b(  data, off + 12, 0x70);
+            make_u32(pat, off, overlay_pat | 1);
+            make_u32(pat, off +  4, offsets.draw_touch_buttons);
+            make_u32(pat, off +  8, 0xE19100B0); // Overwritten Instruction
+            make_b(  pat, off + 12, 0x70);
             off += 16;
-
-            LOG("Calc CRC");
-            std::uint32_t crc = Zlib::crc32(data);
-            local.crc = central.crc = bswap(crc);
-
-            LOG("Compress NTR");
-            {
-                std::vector<std::uint8_t> cmp = Zlib::compress(data, false);
-                if (cmp.size() < data.size()) {
-                    data = std::move(cmp);
-                    local.method = central.method = bswap(std::uint16_t{8});
-                } else {
-                    local.method = central.method = bswap(std::uint16_t{0});
-                }
-            }
-            local.cmp_size = central.cmp_size = bswap(std::uint32_t{data.size()});
-
-            central.local_offset = bswap(std::uint32_t{0});
-            std::uint32_t central_off = sizeof(local) + local_name.size() +
-                                        local_extra.size() + data.size();
-            end.central_offset = bswap(central_off);
+            pat.resize(off);
         }
 
         virtual void Write() override {
+            // The ROM is read from the old file as the new one is written
+            LOG("Open ZIP Stream");
+            IOSUFSA::File src(fsa);
+            if (!src.open(path, "rb")) throw error("NTR: Stream OpenFile");
+            if (!src.seek(data_off)) throw error("NTR: Seek NTR");
+
             LOG("Open ZIP Write");
-            IOSUFSA::File zip(fsa);
-            if (!zip.open(path, "wb")) throw error("NTR: Write OpenFile");
+            IOSUFSA::NewFile zip(fsa, path);
+            if (!zip.open()) throw error("NTR: Write OpenFile");
 
+            // The headers go through the same writer as the ROM, so they
+            // don't take IOCTLs of their own. The local header is rewritten
+            // with the CRC and size at the end.
+            IOSUFSA::AsyncWriter writer(zip, write_chunk);
             LOG("Write Local");
-            if (!zip.writeall(&local, sizeof(local))) throw error("NTR: Write Local");
-            if (!zip.writeall(local_name)) throw error("NTR: Write Local Name");
-            if (!zip.writeall(local_extra)) throw error("NTR: Write Local Extra");
+            if (!writer.write(&local, sizeof(local))) throw error("NTR: Write Local");
+            if (!writer.write(local_name.data(), local_name.size()))
+                throw error("NTR: Write Local Name");
+            if (!writer.write(local_extra.data(), local_extra.size()))
+                throw error("NTR: Write Local Extra");
+
+            LOG("Stream NTR");
+            const bool deflated = util::le(local.method) == 8;
+            const std::size_t dec_size = util::le(local.dec_size);
+            std::uint32_t cmp_size = 0;
+            std::uint32_t crc;
+            // CRC32 of the ROM as read, checked against the local header
+            // before anything is committed
+            std::uint32_t in_crc = 0;
+            {
+                Zlib::Inflater inflater(false);
+                IOSUFSA::AsyncReader reader(src, util::le(local.cmp_size), write_chunk);
+                const IOSUFSA::Buffer *chunk = nullptr;
+                std::size_t chunk_pos = 0;
+                auto next_chunk = [this, &reader, &chunk, &chunk_pos]() {
+                    chunk = reader.next();
+                    if (chunk == nullptr) throw error("NTR: Short NTR");
+                    chunk_pos = 0;
+                    count(Progress::Bytes::READ, chunk->size());
+                };
+                auto write_data = [this, &writer, &cmp_size](const std::uint8_t *data,
+                                                             std::size_t len) {
+                    if (!writer.write(data, len)) throw error("NTR: Write Data");
+                    cmp_size += len;
+                    count(Progress::Bytes::WRITTEN, len);
+                };
+                // A ROM that was stored is written back stored, so the ZIP
+                // keeps the method it came with
+                std::optional<Zlib::Deflater> deflater;
+                if (deflated) deflater.emplace(false, write_data);
+                std::uint32_t out_crc = 0;
+                std::vector<std::uint8_t> window(stream_window);
+
+                for (std::size_t pos = 0; pos < dec_size; ) {
+                    std::size_t len = std::min(window.size(), dec_size - pos);
+                    if (deflated) {
+                        if (inflater.needs_input()) {
+                            next_chunk();
+                            inflater.input(chunk->data(), chunk->size());
+                        }
+                        len = inflater.inflate(window.data(), len);
+                        if (len == 0) {
+                            if (!inflater.needs_input()) throw error("NTR: Short NTR");
+                            continue;
+                        }
+                        count(Progress::Bytes::INFLATED, len);
+                    } else {
+                        if (chunk == nullptr || chunk_pos == chunk->size()) next_chunk();
+                        len = std::min(len, chunk->size() - chunk_pos);
+                        std::memcpy(window.data(), chunk->data() + chunk_pos, len);
+                        chunk_pos += len;
+                        in_crc = Zlib::crc32(in_crc, window.data(), len);
+                    }
+                    apply_edit(branch, window.data(), pos, len);
+                    apply_edit(any_pat, window.data(), pos, len);
+                    if (deflated) {
+                        deflater->write(window.data(), len);
+                        count(Progress::Bytes::DEFLATED, len);
+                    } else {
+                        write_data(window.data(), len);
+                        out_crc = Zlib::crc32(out_crc, window.data(), len);
+                    }
+                    pos += len;
+                }
+                if (deflated) {
+                    // The end of the stream may still be pending once the
+                    // ROM is out, and the stream must end with the ROM
+                    std::uint8_t extra;
+                    while (!inflater.finished()) {
+                        if (inflater.needs_input()) {
+                            next_chunk();
+                            inflater.input(chunk->data(), chunk->size());
+                        }
+                        if (inflater.inflate(&extra, 1) != 0) throw error("NTR: Long NTR");
+                    }
+                    in_crc = inflater.crc();
+                }
+                if (in_crc != util::le(local.crc)) throw error("NTR: Bad CRC");
+                if (deflated) {
+                    deflater->finish();
+                    out_crc = deflater->crc();
+                }
+                crc = out_crc;
+            }
+            if (!src.close()) throw error("NTR: Stream CloseFile");
 
-            LOG("Write NTR");
-            if (!zip.writeall(data)) throw error("NTR: Write Data");
+            local.crc = central.crc = util::le(crc);
+            local.cmp_size = central.cmp_size = util::le(cmp_size);
+            central.local_offset = util::le(std::uint32_t{0});
+            std::uint32_t central_off = sizeof(local) + local_name.size() +
+                                        local_extra.size() + cmp_size;
+            end.central_offset = util::le(central_off);
 
             LOG("Write Central");
-            if (!zip.writeall(&central, sizeof(central))) throw error("NTR: Write Central");
-            if (!zip.writeall(central_name)) throw error("NTR: Write Central Name");
-            if (!zip.writeall(central_extra)) throw error("NTR: Write Central Extra");
-            if (!zip.writeall(central_comment)) throw error("NTR: Write Central Comment");
+            if (!writer.write(&central, sizeof(central))) throw error("NTR: Write Central");
+            if (!writer.write(central_name.data(), central_name.size()))
+                throw error("NTR: Write Central Name");
+            if (!writer.write(central_extra.data(), central_extra.size()))
+                throw error("NTR: Write Central Extra");
+            if (!writer.write(central_comment.data(), central_comment.size()))
+                throw error("NTR: Write Central Comment");
 
             LOG("Write End");
-            if (!zip.writeall(&end, sizeof(end))) throw error("NTR: Write End");
-
-            LOG("Close ZIP Write");
-            if (!zip.close()) throw error("NTR: Write CloseFile");
+            if (!writer.write(&end, sizeof(end))) throw error("NTR: Write End");
+            if (!writer.flush()) throw error("NTR: Write Data");
+            count(Progress::Bytes::WRITTEN, sizeof(local) + local_name.size() + local_extra.size() +
+                  sizeof(central) + central_name.size() + central_extra.size() +
+                  central_comment.size() + sizeof(end));
+
+            LOG("Rewrite Local");
+            if (!zip.seek(0)) throw error("NTR: Seek Local");
+            if (!zip.writeall(&local, sizeof(local))) throw error("NTR: Rewrite Local");
+
+            LOG("Commit ZIP Write");
+            if (!zip.commit()) throw error("NTR: Write Commit");
         }
 
     private:
@@ -268,7 +403,10 @@ namespace {
         zip_local local;
         std::vector<std::uint8_t> local_name;
         std::vector<std::uint8_t> local_extra;
-        std::vector<std::uint8_t> data;
+        std::size_t data_off = 0;
+        std::uint8_t header[0x20];
+        rom_edit branch;
+        rom_edit any_pat;
         zip_central central;
         std::vector<std::uint8_t> central_name;
         std::vector<std::uint8_t> central_extra;
@@ -277,6 +415,20 @@ namespace {
     };
 }
 
+Patch::Status ntr_stat_check(const IOSUFSA &fsa, std::string_view title) {
+    // Smallest ZIP with a single file
+    constexpr std::uint32_t min_size = sizeof(zip_local) + sizeof(zip_central) + sizeof(zip_end);
+
+    std::string path = util::concat_sv({ title, zip_file });
+    IOSUFSA::Stat stat;
+    bool found = fsa.stat(path, stat);
+    // A commit cut short is finished here, or the title would be dropped
+    if (!found) found = IOSUFSA::NewFile::recover(fsa, path) && fsa.stat(path, stat);
+    if (!found || stat.is_dir) return Patch::Status::INVALID_ZIP;
+    if (stat.size < min_size) return Patch::Status::INVALID_ZIP;
+    return Patch::Status::UNTESTED;
+}
+
 #define ret(X) do { zip.close(); return X; } while(0)
 
 Patch::Status ntr_check(const IOSUFSA &fsa, std::string_view title) {
@@ -284,42 +436,69 @@ Patch::Status ntr_check(const IOSUFSA &fsa, std::string_view title) {
     LOG("Open ZIP");
     IOSUFSA::File zip(fsa);
     if (!zip.open(zip_path, "rb")) ret(Patch::Status::INVALID_ZIP);
+    IOSUFSA::BufferedReader reader(zip, header_window);
 
     LOG("Read Local Header");
     zip_local local;
-    if (!zip.readall(&local, sizeof(local))) ret(Patch::Status::INVALID_ZIP);
-    if (local.signature != zip_local_magic) ret(Patch::Status::INVALID_ZIP);
-    if (bswap(local.method) != 0 && bswap(local.method) != 8) ret(Patch::Status::INVALID_ZIP);
-    if (!zip.skip(bswap(local.name_len) + bswap(local.extra_len))) ret(Patch::Status::INVALID_ZIP);
-
-    LOG("Read NTR");
-    std::vector<std::uint8_t> data(bswap(local.cmp_size));
-    if (!zip.readall(data)) ret(Patch::Status::INVALID_ZIP);
+    if (!reader.readall(&local, sizeof(local))) ret(Patch::Status::INVALID_ZIP);
+    if (util::be(local.signature) != zip_local_magic) ret(Patch::Status::INVALID_ZIP);
+    if (util::le(local.method) != 0 && util::le(local.method) != 8) ret(Patch::Status::INVALID_ZIP);
+    std::size_t data_off = sizeof(local) + util::le(local.name_len) + util::le(local.extra_len);
+
+    // The prefix is read while it's still in the window with the local
+    // header, but only judged after the headers, as before
+    LOG("Read NTR Prefix");
+    std::vector<std::uint8_t> data(check_len);
+    bool prefix_good = false;
+    reader.seek(data_off);
+    if (util::le(local.method) == 8) {
+        LOG("Decompress NTR Prefix");
+        Zlib::Inflater inflater(false);
+        std::vector<std::uint8_t> chunk(check_chunk);
+        std::size_t left = util::le(local.cmp_size);
+        std::size_t dec_len = 0;
+        try {
+            while (dec_len < check_len && !inflater.finished()) {
+                if (inflater.needs_input()) {
+                    std::size_t len = std::min(left, chunk.size());
+                    if (len == 0 || !reader.readall(chunk.data(), len)) break;
+                    inflater.input(chunk.data(), len);
+                    left -= len;
+                }
+                dec_len += inflater.inflate(data.data() + dec_len, check_len - dec_len);
+            }
+        } catch (error &e) {
+            LOG("ERROR in ntr_check: %s", e.what());
+        }
+        prefix_good = dec_len == check_len;
+    } else {
+        prefix_good = reader.readall(data);
+    }
 
     LOG("Read Central");
     zip_central central;
-    if (!zip.readall(&central, sizeof(central))) ret(Patch::Status::INVALID_ZIP);
-    if (central.signature != zip_central_magic) ret(Patch::Status::INVALID_ZIP);
-    if (!zip.skip(bswap(central.name_len) + bswap(central.extra_len) +
-                  bswap(central.comment_len))) ret(Patch::Status::INVALID_ZIP);
+    reader.seek(data_off + util::le(local.cmp_size));
+    if (!reader.readall(&central, sizeof(central))) ret(Patch::Status::INVALID_ZIP);
+    if (util::be(central.signature) != zip_central_magic) ret(Patch::Status::INVALID_ZIP);
+    std::size_t end_off = data_off + util::le(local.cmp_size) + sizeof(central) +
+        util::le(central.name_len) + util::le(central.extra_len) + util::le(central.comment_len);
 
     LOG("Read End");
     zip_end end;
-    if (!zip.readall(&end, sizeof(end))) ret(Patch::Status::INVALID_ZIP);
-    if (end.signature != zip_end_magic) ret(Patch::Status::INVALID_ZIP);
+    reader.seek(end_off);
+    if (!reader.readall(&end, sizeof(end))) ret(Patch::Status::INVALID_ZIP);
+    if (util::be(end.signature) != zip_end_magic) ret(Patch::Status::INVALID_ZIP);
+
+    if (util::le(local.method) != util::le(central.method)) ret(Patch::Status::INVALID_ZIP);
+    if (util::le(local.dec_size) < check_len) ret(Patch::Status::INVALID_NTR);
+    if (!prefix_good) ret(Patch::Status::INVALID_ZIP);
 
     LOG("Close NTR");
     if (!zip.close()) ret(Patch::Status::INVALID_ZIP);
 
-    if (bswap(local.method) != bswap(central.method)) ret(Patch::Status::INVALID_ZIP);
-    if (bswap(local.method) == 8) {
-        LOG("Decompress NTR");
-        data = Zlib::decompress(data, bswap(local.dec_size), false);
-    } else if (bswap(local.method) != 0) ret(Patch::Status::INVALID_ZIP);
-
     LOG("Check ROM Title");
-    std::uint32_t code = *reinterpret_cast<std::uint32_t *>(data.data() + 0x0C);
-    std::uint16_t maker = *reinterpret_cast<std::uint16_t *>(data.data() + 0x10);
+    std::uint32_t code = util::be(*reinterpret_cast<std::uint32_t *>(data.data() + 0x0C));
+    std::uint16_t maker = util::be(*reinterpret_cast<std::uint16_t *>(data.data() + 0x10));
     std::uint8_t revision = *reinterpret_cast<std::uint8_t *>(data.data() + 0x1E);
     switch (code) {
         case util::magic_const("ASMJ"):
@@ -355,3 +534,11 @@ Patch::Status ntr_check(const IOSUFSA &fsa, std::string_view title) {
 std::unique_ptr<Patch> ntr_patch(const IOSUFSA &fsa, std::string_view title) {
     return std::make_unique<NtrPatch>(fsa, title);
 }
+
+std::uint32_t ntr_version() {
+    // Bump along with any change to Modify or Write. The payloads speak
+    // for themselves.
+    constexpr std::uint32_t revision = 4;
+    std::uint32_t crc = Zlib::crc32(revision, any_pat_bin, any_pat_bin_size);
+    return Zlib::crc32(crc, get_analog_bin, get_analog_bin_size);
+}
@@ -1,12 +1,22 @@
 #ifndef NTR_PATCH_HPP
 #define NTR_PATCH_HPP
 
+#include <cstdint>
+#include <memory>
 #include <string_view>
 
 #include "iosufsa.hpp"
 #include "patch.hpp"
 
+// ZIP holding the NTR ROM, relative to the title path
+constexpr std::string_view zip_file = "/content/0010/rom.zip";
+
+// Quick check that rejects a missing or truncated ZIP before ntr_check.
+// It returns UNTESTED when the title may still be valid.
+Patch::Status ntr_stat_check(const IOSUFSA &fsa, std::string_view title);
 Patch::Status ntr_check(const IOSUFSA &fsa, std::string_view title);
 std::unique_ptr<Patch> ntr_patch(const IOSUFSA &fsa, std::string_view title);
+// Changes whenever the ZIP ntr_patch writes for a given input would
+std::uint32_t ntr_version();
 
 #endif // NTR_PATCH_HPP
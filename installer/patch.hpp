@@ -3,6 +3,8 @@
 
 #include <cstdint>
 
+#include "progress.hpp"
+
 class Patch {
 public:
     enum class Status : std::int_fast8_t {
@@ -28,6 +30,21 @@ public:
     virtual void Read() = 0;
     virtual void Modify() = 0;
     virtual void Write() = 0;
+
+    // Counts the bytes moved by the patch into progress, if given
+    void track(Progress *progress, Progress::Stage stage) {
+        this->progress = progress;
+        this->stage = stage;
+    }
+
+protected:
+    void count(Progress::Bytes kind, std::size_t size) {
+        if (progress) progress->add(stage, kind, size);
+    }
+
+private:
+    Progress *progress = nullptr;
+    Progress::Stage stage = Progress::Stage::HACHI;
 };
 
 #endif // PATCH_HPP
@@ -0,0 +1,274 @@
+#include "patch_cache.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "exception.hpp"
+#include "log.hpp"
+#include "util.hpp"
+#include "zlib.hpp"
+
+using namespace std::string_view_literals;
+
+namespace {
+    constexpr std::uint32_t entry_magic = util::magic_const("AMPC");
+    // Bump whenever the layout of an entry changes. Version 1 entries may
+    // hold RPXs whose text has its length stored little-endian.
+    constexpr std::uint32_t entry_version = 2;
+
+    // Stored big-endian ahead of the output, like the scan cache
+    struct EntryHeader {
+        std::uint32_t magic;
+        std::uint32_t version;
+        std::uint32_t patch_version;
+        std::uint32_t in_crc;
+        std::uint32_t in_size;
+        std::uint32_t out_crc;
+        std::uint32_t out_size;
+    };
+    static_assert(sizeof(EntryHeader) == 28);
+
+    void be_header(EntryHeader &header) {
+        header.magic = util::be(header.magic);
+        header.version = util::be(header.version);
+        header.patch_version = util::be(header.patch_version);
+        header.in_crc = util::be(header.in_crc);
+        header.in_size = util::be(header.in_size);
+        header.out_crc = util::be(header.out_crc);
+        header.out_size = util::be(header.out_size);
+    }
+
+    // Entries and title files are streamed a chunk at a time, so only a
+    // few chunks are ever held
+    constexpr std::size_t chunk_size = IOSUFSA::max_io;
+
+    // Space left free on the cache's volume, so the cache never fills it
+    constexpr std::uint64_t reserve = 0x1000000;
+
+    // Whether the volume holding dir has room for size more bytes
+    bool has_room(const std::string &dir, std::uint64_t size) {
+        struct statvfs vfs;
+        if (::statvfs(dir.c_str(), &vfs) != 0) return false;
+        return static_cast<std::uint64_t>(vfs.f_bavail) * vfs.f_frsize >= size + reserve;
+    }
+
+    // CRC32 and size of a whole file
+    bool fingerprint(const IOSUFSA &fsa, const std::string &path,
+                     std::uint32_t &crc, std::uint32_t &size) {
+        IOSUFSA::File file(fsa);
+        if (!file.open(path, "rb")) return false;
+        std::size_t length;
+        bool good = file.size(length);
+        crc = 0;
+        size = static_cast<std::uint32_t>(length);
+        if (good) {
+            IOSUFSA::AsyncReader reader(file, length, chunk_size);
+            while (const IOSUFSA::Buffer *chunk = reader.next())
+                crc = Zlib::crc32(crc, chunk->data(), chunk->size());
+        }
+        good &= file.close();
+        return good;
+    }
+
+    // Opens an entry, checking its header against what it should hold. The
+    // output follows the header.
+    std::FILE *open_entry(const std::string &entry, EntryHeader &header) {
+        std::FILE *file = std::fopen(entry.c_str(), "rb");
+        if (!file) return nullptr;
+        EntryHeader expected = header;
+        bool good = std::fread(&header, sizeof(header), 1, file) == 1;
+        be_header(header);
+        good = good && header.magic == expected.magic && header.version == expected.version &&
+               header.patch_version == expected.patch_version &&
+               header.in_crc == expected.in_crc && header.in_size == expected.in_size;
+        if (good) return file;
+        std::fclose(file);
+        return nullptr;
+    }
+
+    class CachedPatch : public Patch {
+    public:
+        CachedPatch(std::unique_ptr<Patch> patch, const IOSUFSA &fsa, std::string path,
+                    const std::string &dir, std::string_view kind, std::uint32_t version,
+                    PatchCache::MakeCheck make_check) :
+            patch(std::move(patch)), fsa(fsa), path(std::move(path)), dir(dir), kind(kind),
+            version(version), make_check(make_check) { }
+        virtual ~CachedPatch() override = default;
+
+        virtual void Read() override {
+            if (fingerprint(fsa, path, in_crc, in_size)) {
+                count(Progress::Bytes::READ, in_size);
+                // Named <kind>_<input crc>_<input size>.bin
+                std::string key = "_00000000_00000000.bin";
+                util::write_hex(in_crc, key, 1);
+                util::write_hex(in_size, key, 10);
+                entry = util::concat_sv({ dir, "/"sv, kind, key });
+                hit = verify();
+            }
+            if (hit) {
+                LOG("Patch Cache: Hit %s", entry.c_str());
+                return;
+            }
+            patch->Read();
+        }
+
+        virtual void Modify() override {
+            if (!hit) patch->Modify();
+        }
+
+        virtual void Write() override {
+            if (!hit) {
+                patch->Write();
+                if (!entry.empty()) store();
+                return;
+            }
+
+            // The entry was checked on Read, and is checked again as it's
+            // copied, in case it changed since
+            EntryHeader header = expected();
+            std::FILE *in = open_entry(entry, header);
+            if (!in) throw error("Cache: Open Entry");
+            IOSUFSA::NewFile file(fsa, path);
+            if (!file.open()) {
+                std::fclose(in);
+                throw error("Cache: Write FileOpen");
+            }
+            std::uint32_t crc = 0;
+            bool good = true;
+            {
+                IOSUFSA::AsyncWriter writer(file, chunk_size);
+                std::vector<std::uint8_t> chunk(chunk_size);
+                for (std::size_t left = header.out_size; good && left > 0; ) {
+                    std::size_t len = std::min(left, chunk.size());
+                    good = std::fread(chunk.data(), 1, len, in) == len &&
+                           writer.write(chunk.data(), len);
+                    crc = Zlib::crc32(crc, chunk.data(), len);
+                    count(Progress::Bytes::WRITTEN, len);
+                    left -= len;
+                }
+                good &= writer.flush();
+            }
+            std::fclose(in);
+            if (!good) throw error("Cache: Write Data");
+            if (crc != header.out_crc) throw error("Cache: Entry Changed");
+            if (!file.commit()) throw error("Cache: Write Commit");
+        }
+
+    private:
+        std::unique_ptr<Patch> patch;
+        const IOSUFSA &fsa;
+        std::string path;
+        std::string dir;
+        std::string kind;
+        std::uint32_t version;
+        PatchCache::MakeCheck make_check;
+
+        std::string entry;
+        std::uint32_t in_crc = 0;
+        std::uint32_t in_size = 0;
+        bool hit = false;
+
+        EntryHeader expected() const {
+            return { entry_magic, entry_version, version, in_crc, in_size, 0, 0 };
+        }
+
+        // Checks the entry for the input by streaming it through its CRC,
+        // and through the patch's own check if it has one
+        bool verify() {
+            EntryHeader header = expected();
+            std::FILE *file = open_entry(entry, header);
+            if (!file) return false;
+            std::unique_ptr<PatchCache::Check> check;
+            if (make_check) check = make_check();
+            std::vector<std::uint8_t> chunk(chunk_size);
+            std::uint32_t crc = 0;
+            std::size_t size = 0;
+            for (std::size_t len; (len = std::fread(chunk.data(), 1, chunk.size(), file)) > 0; ) {
+                crc = Zlib::crc32(crc, chunk.data(), len);
+                if (check) check->feed(chunk.data(), len);
+                size += len;
+            }
+            std::fclose(file);
+            if (size == header.out_size && crc == header.out_crc && (!check || check->good()))
+                return true;
+
+            LOG("Patch Cache: Bad Entry %s", entry.c_str());
+            std::remove(entry.c_str());
+            return false;
+        }
+
+        // Copies the patched file into a new entry, which takes the place of
+        // the old one only once it's complete
+        void store() {
+            IOSUFSA::Stat stat;
+            if (!fsa.stat(path, stat)) {
+                LOG("Patch Cache: Can't Stat %s", path.c_str());
+                return;
+            }
+            ::mkdir(dir.c_str(), 0777);
+            if (!has_room(dir, sizeof(EntryHeader) + std::uint64_t(stat.size))) {
+                LOG("Patch Cache: No Room for %s", entry.c_str());
+                return;
+            }
+
+            std::string temp = util::concat_sv({ entry, ".tmp"sv });
+            std::FILE *out = std::fopen(temp.c_str(), "wb");
+            if (!out) {
+                LOG("Patch Cache: Can't Write %s", temp.c_str());
+                return;
+            }
+
+            EntryHeader header = expected();
+            bool good = std::fwrite(&header, sizeof(header), 1, out) == 1;
+            IOSUFSA::File file(fsa);
+            if (good && file.open(path, "rb")) {
+                std::size_t length;
+                good = file.size(length);
+                header.out_size = static_cast<std::uint32_t>(length);
+                if (good) try {
+                    IOSUFSA::AsyncReader reader(file, length, chunk_size);
+                    while (const IOSUFSA::Buffer *chunk = reader.next()) {
+                        good &= std::fwrite(chunk->data(), 1, chunk->size(), out) ==
+                                chunk->size();
+                        header.out_crc = Zlib::crc32(header.out_crc, chunk->data(),
+                                                     chunk->size());
+                    }
+                } catch (error &e) {
+                    LOG("Patch Cache: %s", e.what());
+                    good = false;
+                }
+                good &= file.close();
+            } else {
+                good = false;
+            }
+            be_header(header);
+            good = good && std::fseek(out, 0, SEEK_SET) == 0 &&
+                   std::fwrite(&header, sizeof(header), 1, out) == 1;
+            good &= std::fclose(out) == 0;
+
+            std::remove(entry.c_str());
+            if (good && std::rename(temp.c_str(), entry.c_str()) == 0) {
+                LOG("Patch Cache: Stored %s", entry.c_str());
+            } else {
+                LOG("Patch Cache: Store Failed %s", entry.c_str());
+                std::remove(temp.c_str());
+            }
+        }
+    };
+}
+
+std::unique_ptr<Patch> PatchCache::wrap(std::unique_ptr<Patch> patch, const IOSUFSA &fsa,
+                                        std::string path, std::string_view kind,
+                                        std::uint32_t version, MakeCheck make_check) const {
+    return std::make_unique<CachedPatch>(std::move(patch), fsa, std::move(path), dir, kind,
+                                         version, make_check);
+}
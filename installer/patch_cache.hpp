@@ -0,0 +1,50 @@
+#ifndef PATCH_CACHE_HPP
+#define PATCH_CACHE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "iosufsa.hpp"
+#include "patch.hpp"
+
+// Patched files kept on the SD card, so a title patched before is restored
+// with a copy instead of being patched again. Entries are keyed by the
+// version of the patch and the CRC32 and size of the file it was applied
+// to, and hold the CRC32 of the output, which is checked before the output
+// is written. Hits are streamed a chunk at a time, so restoring a title is
+// bound by I/O. Entries can come from elsewhere, such as am64ds-cli seed, so
+// a patch can also check the contents of its entries as they're streamed.
+// The cache is optional: a missing or bad entry is a miss, and failing to
+// store one is only logged. Outputs aren't stored while the cache's volume
+// is nearly full.
+class PatchCache {
+public:
+    // Checks the output held by an entry, given a chunk at a time in order,
+    // beyond matching the CRC32 it was stored with
+    class Check {
+    public:
+        virtual ~Check() = default;
+
+        virtual void feed(const std::uint8_t *data, std::size_t size) = 0;
+        // Whether all that was fed is a good output
+        virtual bool good() = 0;
+    };
+    using MakeCheck = std::unique_ptr<Check> (*)();
+
+    explicit PatchCache(std::string dir) : dir(std::move(dir)) { }
+
+    // Wraps the patch of the file at path. On a hit, the patch is skipped
+    // and the cached output written in its place. On a miss, the patch is
+    // run and its output stored once written. Entries failing make_check,
+    // if given, are misses.
+    std::unique_ptr<Patch> wrap(std::unique_ptr<Patch> patch, const IOSUFSA &fsa,
+                                std::string path, std::string_view kind,
+                                std::uint32_t version, MakeCheck make_check = nullptr) const;
+
+private:
+    std::string dir;
+};
+
+#endif // PATCH_CACHE_HPP
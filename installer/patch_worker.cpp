@@ -0,0 +1,183 @@
+#include "patch_worker.hpp"
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "hachi_patch.hpp"
+#include "log.hpp"
+#include "ntr_patch.hpp"
+#include "patch.hpp"
+#include "util.hpp"
+
+using namespace std::string_view_literals;
+
+namespace {
+    // Output is about the size of the input, so the bar expects every
+    // byte of both files to be read once and written once
+    std::uint32_t expected_io(const IOSUFSA &fsa, std::string_view title) {
+        std::uint32_t total = 0;
+        IOSUFSA::Stat stat;
+        if (fsa.stat(util::concat_sv({ title, hachi_file }), stat)) total += 2 * stat.size;
+        if (fsa.stat(util::concat_sv({ title, zip_file }), stat)) total += 2 * stat.size;
+        return total;
+    }
+}
+
+PatchWorker::PatchWorker(const IOSUFSA &fsa, std::vector<std::string> titles, Progress &progress,
+                         Written written, Finish finish, PatchOptions options) :
+        fsa(fsa), base(fsa.stats()), progress(progress), titles(std::move(titles)),
+        files(this->titles.size()),
+        written(std::move(written)), finish(std::move(finish)), options(options) {
+    std::uint32_t expected = 0;
+    for (std::size_t i = 0; i < this->titles.size(); ++i) {
+        files[i].expected_io = expected_io(fsa, this->titles[i]);
+        files[i].progress.feed(&progress);
+        expected += files[i].expected_io;
+    }
+    progress.start(expected, this->titles.size());
+
+    const IOSUFSA *hachi_fsa = &fsa;
+    bool pipeline = options.pipeline;
+    const IOSUFSA *ntr_fsa = pipeline ? &open_session() : &fsa;
+    const IOSUFSA *save_fsa = (pipeline && this->written) ? &open_session() : &fsa;
+    int hachi_core = Thread::next_core();
+    int ntr_core = (hachi_core + 1) % static_cast<int>(Thread::cores());
+
+    // Serially, each task waits on the one added before it. A title's
+    // progress starts with the first of its tasks to run.
+    auto add = [this, pipeline](std::string name, std::size_t title, int step,
+                                std::function<void()> func, std::vector<TaskGraph::Id> deps,
+                                int core) -> TaskGraph::Id {
+        if (!pipeline && graph.size() > 0) deps.push_back(graph.size() - 1);
+        return graph.add(std::move(name), [this, title, step, func = std::move(func)]() {
+            if (title != no_title && !files[title].started.exchange(true))
+                files[title].progress.start(files[title].expected_io);
+            if (step > 0) this->progress.begin_step(step);
+            try {
+                func();
+            } catch (...) {
+                std::size_t none = no_title;
+                failed_title.compare_exchange_strong(none, title, std::memory_order_acq_rel);
+                throw;
+            }
+            if (step > 0) this->progress.end_step(step);
+        }, deps, core);
+    };
+
+    // Each chain takes one title at a time, so a task waits on the last
+    // task its chain ran for the title before
+    std::vector<TaskGraph::Id> hachi_chain, ntr_chain, save_chain, titles_done;
+    for (std::size_t i = 0; i < this->titles.size(); ++i) {
+        std::string n = " " + std::to_string(i + 1);
+        Files &title = files[i];
+        const std::string &path = this->titles[i];
+
+        TaskGraph::Id hachi_read = add("Hachi Read" + n, i, 1,
+                                       [this, &title, &path, hachi_fsa]() {
+            LOG("Reading %s", path.c_str());
+            HachiMode mode = this->options.hachi_mode;
+            title.hachi = prepare(hachi_patch(*hachi_fsa, path, mode), *hachi_fsa,
+                                  title.progress, Progress::Stage::HACHI,
+                                  util::concat_sv({ path, hachi_file }), "hachi"sv,
+                                  hachi_version(mode), hachi_cache_check);
+            title.hachi->Read();
+        }, hachi_chain, hachi_core);
+        TaskGraph::Id ntr_read = add("NTR Read" + n, i, 2, [this, &title, &path, ntr_fsa]() {
+            title.ntr = prepare(ntr_patch(*ntr_fsa, path), *ntr_fsa, title.progress,
+                                Progress::Stage::NTR, util::concat_sv({ path, zip_file }),
+                                "ntr"sv, ntr_version());
+            title.ntr->Read();
+        }, ntr_chain, ntr_core);
+
+        // Neither file is written until both have been read, so a title
+        // that fails to read is left as it was
+        TaskGraph::Id hachi_modify = add("Hachi Modify" + n, i, 3, [&title]() {
+            LOG("Patching Hachi...");
+            title.hachi->Modify();
+        }, { hachi_read }, hachi_core);
+        TaskGraph::Id hachi_write = add("Hachi Write" + n, i, 4, [&title]() {
+            title.hachi->Write();
+            title.hachi.reset();
+        }, { hachi_modify, ntr_read }, hachi_core);
+        TaskGraph::Id ntr_modify = add("NTR Modify" + n, i, 5, [&title]() {
+            LOG("Patching NTR...");
+            title.ntr->Modify();
+        }, { ntr_read }, ntr_core);
+        TaskGraph::Id ntr_write = add("NTR Write" + n, i, 6, [&title]() {
+            title.ntr->Write();
+            title.ntr.reset();
+        }, { ntr_modify, hachi_read }, ntr_core);
+        hachi_chain = { hachi_write };
+        ntr_chain = { ntr_write };
+
+        std::vector<TaskGraph::Id> title_deps = { hachi_write, ntr_write };
+        if (this->written) {
+            // Both files read means the title is what it was taken for
+            save_chain.push_back(hachi_read);
+            save_chain.push_back(ntr_read);
+            TaskGraph::Id save = add("Savestates" + n, i, 7, [this, i, save_fsa]() {
+                this->written(*save_fsa, i);
+            }, save_chain, Thread::any_core);
+            save_chain = { save };
+            title_deps.push_back(save);
+        }
+        titles_done.push_back(add("Title" + n, i, 0, [this, &title]() {
+            title.progress.title_done();
+            title.progress.finish();
+            title.done = title.progress.snapshot();
+            this->progress.title_done();
+        }, title_deps, Thread::any_core));
+    }
+    if (this->finish) {
+        add("Finish", no_title, 8, [this, &fsa]() { this->finish(fsa); }, titles_done, hachi_core);
+    }
+
+    thread = Thread([this]() {
+        struct finished_guard {
+            Progress &progress;
+            ~finished_guard() { progress.finish(); }
+        } guard { this->progress };
+        graph.run();
+        graph.log_trace();
+    }, Thread::next_core());
+}
+
+std::unique_ptr<Patch> PatchWorker::prepare(std::unique_ptr<Patch> patch, const IOSUFSA &fsa,
+                                            Progress &progress, Progress::Stage stage,
+                                            std::string path, std::string_view kind,
+                                            std::uint32_t version,
+                                            PatchCache::MakeCheck make_check) const {
+    patch->track(&progress, stage);
+    if (!options.cache) return patch;
+    patch = options.cache->wrap(std::move(patch), fsa, std::move(path), kind, version,
+                                make_check);
+    patch->track(&progress, stage);
+    return patch;
+}
+
+// Sessions are opened and closed here, on the calling thread
+const IOSUFSA &PatchWorker::open_session() {
+    sessions.push_back(std::make_unique<IOSUFSA>());
+    sessions.back()->open();
+    return *sessions.back();
+}
+
+void PatchWorker::join() {
+    std::exception_ptr error;
+    try {
+        thread.join();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    io = fsa.stats() - base;
+    for (auto &session : sessions) {
+        io += session->stats();
+        session->close();
+    }
+    if (error) std::rethrow_exception(error);
+}
@@ -0,0 +1,111 @@
+#ifndef PATCH_WORKER_HPP
+#define PATCH_WORKER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hachi_patch.hpp"
+#include "iosufsa.hpp"
+#include "patch_cache.hpp"
+#include "patch.hpp"
+#include "progress.hpp"
+#include "task_graph.hpp"
+#include "thread.hpp"
+
+struct PatchOptions {
+    // Otherwise the tasks run one at a time
+    bool pipeline = true;
+    const PatchCache *cache = nullptr;
+    HachiMode hachi_mode = HachiMode::REWRITE;
+};
+
+// Patches titles on a worker thread, so the caller stays free to service
+// the system and draw the progress. The steps match Messages::patch.
+//
+// The work is laid out as a TaskGraph. Each file is read, modified and
+// written by a chain of its own, with the Hachi and NTR chains on different
+// cores, and the savestates of a title are cleaned once both of its files
+// have been read, while they are compressed. Neither file of a title is
+// written until both have been read. The chains run on sessions of their
+// own, opened here, so no session is used by two threads at once. Once a
+// chain is done with a title it moves on to the next, so a batch is
+// pipelined. Without pipeline, the tasks run one at a time: each file read,
+// modified and written in turn, then the savestates cleaned.
+//
+// With a cache, titles patched before are restored from it, and the rest
+// are stored in it once written.
+//
+// Each title's progress is also kept on its own, from when its first file
+// starts being read until it's done. A title that fails is noted as well.
+//
+// written runs after both files of a title have been read, and finish after
+// everything else, as the final barrier. The session and progress are used
+// by the worker until done() returns true.
+//
+// The IOCTLs made for the worker, on the given session and its own, are
+// tallied once joined.
+class PatchWorker {
+public:
+    using Written = std::function<void(const IOSUFSA &fsa, std::size_t title)>;
+    using Finish = std::function<void(const IOSUFSA &fsa)>;
+    static constexpr std::size_t no_title = -1;
+
+    PatchWorker(const IOSUFSA &fsa, std::vector<std::string> titles, Progress &progress,
+                Written written = nullptr, Finish finish = nullptr,
+                PatchOptions options = PatchOptions());
+    ~PatchWorker() = default;
+
+    PatchWorker(const PatchWorker &) = delete;
+    PatchWorker &operator=(const PatchWorker &) = delete;
+
+    bool done() const noexcept { return progress.is_finished(); }
+    // Waits for the worker, rethrowing its error
+    void join();
+    // Spans of the tasks, once joined
+    std::vector<TaskGraph::Span> trace() const { return graph.trace(); }
+    // IOCTLs of all sessions, once joined
+    const IOSUFSA::Stats &io_stats() const noexcept { return io; }
+    // The title whose task threw, once joined, or no_title
+    std::size_t failed() const noexcept { return failed_title.load(std::memory_order_acquire); }
+    // Progress of a title alone, once joined, finished if the title was done
+    const Progress::Snapshot &title_progress(std::size_t title) const {
+        return files[title].done;
+    }
+
+private:
+    struct Files {
+        std::unique_ptr<Patch> hachi;
+        std::unique_ptr<Patch> ntr;
+        std::uint32_t expected_io = 0;
+        std::atomic<bool> started { false };
+        Progress progress;
+        Progress::Snapshot done;
+    };
+
+    const IOSUFSA &open_session();
+    std::unique_ptr<Patch> prepare(std::unique_ptr<Patch> patch, const IOSUFSA &fsa,
+                                   Progress &progress, Progress::Stage stage, std::string path,
+                                   std::string_view kind, std::uint32_t version,
+                                   PatchCache::MakeCheck make_check = nullptr) const;
+
+    const IOSUFSA &fsa;
+    const IOSUFSA::Stats base;
+    IOSUFSA::Stats io;
+    Progress &progress;
+    std::vector<std::string> titles;
+    std::vector<Files> files;
+    Written written;
+    Finish finish;
+    PatchOptions options;
+    std::vector<std::unique_ptr<IOSUFSA>> sessions;
+    std::atomic<std::size_t> failed_title { no_title };
+    TaskGraph graph;
+    Thread thread;
+};
+
+#endif // PATCH_WORKER_HPP
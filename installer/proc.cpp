@@ -30,19 +30,21 @@ WUProc::WUProc() {
             OSSavesDone_ReadyToRelease();
             return 0;
         }, nullptr);
-    if (hbc) {
-        ProcUIRegisterCallback(PROCUI_CALLBACK_HOME_BUTTON_DENIED,
-            +[](void *param) -> std::uint32_t {
-                WUProc *proc = reinterpret_cast<WUProc *>(param);
-                if (proc->home) proc->running = false;
-                return 0;
-            }, this, 100);
-    }
+    ProcUIRegisterCallback(PROCUI_CALLBACK_HOME_BUTTON_DENIED,
+        +[](void *param) -> std::uint32_t {
+            WUProc *proc = reinterpret_cast<WUProc *>(param);
+            if (proc->home) {
+                proc->running = false;
+                proc->quit = true;
+            }
+            return 0;
+        }, this, 100);
 }
 
 WUProc::~WUProc() {
-    if (dirty) {
-        OSForceFullRelaunch();
+    // Quitting on HOME outside of the HBL goes back to the Wii U Menu
+    if (dirty || (quit && !hbc)) {
+        if (dirty) OSForceFullRelaunch();
         SYSLaunchMenu();
         running = true;
         while (update());
@@ -72,6 +74,16 @@ void WUProc::block_home() {
 }
 
 void WUProc::release_home() {
-    if (!hbc) OSEnableHomeButtonMenu(true);
+    if (!hbc && holds == 0) OSEnableHomeButtonMenu(true);
     home = true;
 }
+
+void WUProc::hold_foreground() {
+    if (!hbc && holds == 0) OSEnableHomeButtonMenu(false);
+    ++holds;
+}
+
+void WUProc::release_foreground() {
+    if (--holds > 0) return;
+    if (!hbc && home) OSEnableHomeButtonMenu(true);
+}
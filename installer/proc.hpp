@@ -13,6 +13,12 @@ public:
     void release_home();
     void force_release_home();
 
+    // While any hold is taken, the HOME menu stays closed even outside of
+    // a WUHomeLock, as IOSUHAX can't be left running under it. HOME quits
+    // instead, as it does under the HBL. Only taken on the main thread.
+    void hold_foreground();
+    void release_foreground();
+
     void flag_dirty() { dirty = true; }
     bool is_running() { return running; }
     bool is_dirty() { return dirty; }
@@ -23,6 +29,8 @@ private:
     bool running = true;
     bool dirty = false;
     bool home = true;
+    bool quit = false;
+    unsigned holds = 0;
 };
 
 class WUHomeLock {
@@ -36,4 +44,16 @@ private:
     Controls &controls;
 };
 
+class WUForegroundHold {
+public:
+    explicit WUForegroundHold(WUProc &proc) : proc(proc) { proc.hold_foreground(); }
+    ~WUForegroundHold() { proc.release_foreground(); }
+
+    WUForegroundHold(const WUForegroundHold &) = delete;
+    WUForegroundHold &operator=(const WUForegroundHold &) = delete;
+
+private:
+    WUProc &proc;
+};
+
 #endif // PROC_HPP
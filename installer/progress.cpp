@@ -0,0 +1,79 @@
+#include "progress.hpp"
+
+#include <algorithm>
+
+#ifdef __WIIU__
+#include <coreinit/time.h>
+#else
+#include <chrono>
+#endif
+
+namespace {
+    // Elapsed time needed before the rate is trusted for an ETA
+    constexpr std::uint32_t min_eta_ms = 1000;
+}
+
+void Progress::start(std::uint32_t expected_io, std::uint32_t titles) {
+    start_ms = now_ms();
+    expected = expected_io;
+    this->titles = titles;
+}
+
+Progress::Snapshot Progress::snapshot() const {
+    Snapshot snap;
+    snap.finished = finished.load(std::memory_order_acquire);
+    snap.elapsed_ms = static_cast<std::uint32_t>(now_ms() - start_ms);
+    snap.expected_io = expected;
+    snap.titles = titles;
+    snap.titles_done = titles_done.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < steps; ++i) {
+        // Ended first, so a step is never seen ending before it started
+        snap.ended[i] = ended[i].load(std::memory_order_acquire);
+        snap.started[i] = started[i].load(std::memory_order_acquire);
+    }
+    for (std::size_t i = 0; i < stages; ++i) {
+        for (std::size_t j = 0; j < kinds; ++j)
+            snap.counts[i][j] = counts[i][j].load(std::memory_order_relaxed);
+    }
+    return snap;
+}
+
+std::uint64_t Progress::now_ms() {
+#ifdef __WIIU__
+    return OSTicksToMilliseconds(OSGetSystemTime());
+#else
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+std::uint32_t Progress::Snapshot::total(Bytes kind) const {
+    std::uint32_t sum = 0;
+    for (const auto &stage : counts) sum += stage[static_cast<std::size_t>(kind)];
+    return sum;
+}
+
+std::uint32_t Progress::Snapshot::permille() const {
+    if (finished) return 1000;
+    if (expected_io == 0) return 0;
+    std::uint64_t done = static_cast<std::uint64_t>(io()) * 1000 / expected_io;
+    return static_cast<std::uint32_t>(std::min<std::uint64_t>(done, 999));
+}
+
+std::uint32_t Progress::Snapshot::rate() const {
+    if (elapsed_ms == 0) return 0;
+    return static_cast<std::uint32_t>(static_cast<std::uint64_t>(io()) * 1000 / elapsed_ms);
+}
+
+std::uint32_t Progress::Snapshot::eta_ms() const {
+    std::uint32_t done = permille();
+    if (finished || done == 0 || elapsed_ms < min_eta_ms) return 0;
+    return static_cast<std::uint32_t>(
+        static_cast<std::uint64_t>(elapsed_ms) * (1000 - done) / done);
+}
+
+std::uint32_t Progress::Snapshot::titles_per_min() const {
+    if (elapsed_ms == 0) return 0;
+    return static_cast<std::uint32_t>(static_cast<std::uint64_t>(titles_done) * 60'000 * 100 /
+                                      elapsed_ms);
+}
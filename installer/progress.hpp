@@ -0,0 +1,81 @@
+#ifndef PROGRESS_HPP
+#define PROGRESS_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Progress of a patch, written by the thread doing the work and read by the
+// UI without locking. Counters are 32 bits so they stay lock-free on the
+// console, which is plenty for the files patched.
+class Progress {
+public:
+    enum class Stage : std::size_t { HACHI, NTR };
+    enum class Bytes : std::size_t { READ, INFLATED, DEFLATED, WRITTEN };
+    static constexpr std::size_t stages = 2;
+    static constexpr std::size_t kinds = 4;
+    // The steps of Messages::patch, numbered from 1
+    static constexpr std::size_t steps = 8;
+
+    // The bar follows the bytes read and written, against expected_io
+    void start(std::uint32_t expected_io, std::uint32_t titles = 1);
+    // Steps of several titles, or of both files, can run at once
+    void begin_step(int step) { started[step - 1].fetch_add(1, std::memory_order_release); }
+    void end_step(int step) { ended[step - 1].fetch_add(1, std::memory_order_release); }
+    void add(Stage stage, Bytes kind, std::size_t size) {
+        counts[static_cast<std::size_t>(stage)][static_cast<std::size_t>(kind)]
+            .fetch_add(static_cast<std::uint32_t>(size), std::memory_order_relaxed);
+        if (parent) parent->add(stage, kind, size);
+    }
+    // Bytes added here are added to parent as well, so the progress of one
+    // title can be kept alongside that of its batch
+    void feed(Progress *parent) { this->parent = parent; }
+    void title_done() { titles_done.fetch_add(1, std::memory_order_release); }
+    void finish() { finished.store(true, std::memory_order_release); }
+    bool is_finished() const noexcept { return finished.load(std::memory_order_acquire); }
+
+    struct Snapshot {
+        bool finished = false;
+        std::uint32_t elapsed_ms = 0;
+        std::uint32_t expected_io = 0;
+        std::uint32_t titles = 0;
+        std::uint32_t titles_done = 0;
+        std::array<std::uint32_t, steps> started = { };
+        std::array<std::uint32_t, steps> ended = { };
+        std::array<std::array<std::uint32_t, kinds>, stages> counts = { };
+
+        bool has_started(int step) const { return started[step - 1] > 0; }
+        bool is_running(int step) const { return started[step - 1] > ended[step - 1]; }
+
+        std::uint32_t get(Stage stage, Bytes kind) const {
+            return counts[static_cast<std::size_t>(stage)][static_cast<std::size_t>(kind)];
+        }
+        std::uint32_t total(Bytes kind) const;
+        std::uint32_t io() const { return total(Bytes::READ) + total(Bytes::WRITTEN); }
+        // Completion in tenths of a percent, held below 100% until finished
+        std::uint32_t permille() const;
+        // Bytes read and written per second so far
+        std::uint32_t rate() const;
+        // Estimated time left, or 0 while there's too little to go on
+        std::uint32_t eta_ms() const;
+        // Titles finished per minute so far, in hundredths
+        std::uint32_t titles_per_min() const;
+    };
+    Snapshot snapshot() const;
+
+    // Milliseconds on a monotonic clock
+    static std::uint64_t now_ms();
+
+private:
+    Progress *parent = nullptr;
+    std::uint64_t start_ms = 0;
+    std::uint32_t expected = 0;
+    std::uint32_t titles = 0;
+    std::atomic<std::uint32_t> titles_done { 0 };
+    std::array<std::atomic<std::uint32_t>, steps> started = { };
+    std::array<std::atomic<std::uint32_t>, steps> ended = { };
+    std::atomic<bool> finished { false };
+    std::array<std::array<std::atomic<std::uint32_t>, kinds>, stages> counts = { };
+};
+
+#endif // PROGRESS_HPP
@@ -0,0 +1,240 @@
+#include "scan_cache.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hachi_patch.hpp"
+#include "log.hpp"
+#include "ntr_patch.hpp"
+#include "title.hpp"
+#include "util.hpp"
+#include "zlib.hpp"
+
+namespace {
+    constexpr std::uint32_t cache_magic = util::magic_const("AMSC");
+    // Bump whenever the layout or the meaning of a status changes
+    constexpr std::uint32_t cache_version = 1;
+    constexpr std::size_t header_size = 16;
+    constexpr std::size_t max_entries = 0x1000;
+
+    // Offsets into the ZIP local header
+    constexpr std::size_t zip_local_size = 30;
+    constexpr std::size_t zip_crc_off = 14;
+    constexpr std::size_t zip_cmp_off = 18;
+    constexpr std::size_t zip_dec_off = 22;
+
+    // The file is big-endian, like everything else the console writes
+    class Writer {
+    public:
+        void u16(std::uint16_t v) { v = util::be(v); put(&v, sizeof(v)); }
+        void u32(std::uint32_t v) { v = util::be(v); put(&v, sizeof(v)); }
+        void u64(std::uint64_t v) { u32(v >> 32); u32(v); }
+        void str(const std::string &s) { put(s.data(), s.size()); }
+        void put(const void *data, std::size_t size) {
+            const std::uint8_t *bdata = reinterpret_cast<const std::uint8_t *>(data);
+            out.insert(out.end(), bdata, bdata + size);
+        }
+
+        std::vector<std::uint8_t> out;
+    };
+
+    class Reader {
+    public:
+        Reader(const std::uint8_t *data, std::size_t size) : data(data), left(size) { }
+
+        bool u16(std::uint16_t &v) { return get(&v, sizeof(v)) && ((v = util::be(v)), true); }
+        bool u32(std::uint32_t &v) { return get(&v, sizeof(v)) && ((v = util::be(v)), true); }
+        bool u64(std::uint64_t &v) {
+            std::uint32_t hi, lo;
+            if (!u32(hi) || !u32(lo)) return false;
+            v = (static_cast<std::uint64_t>(hi) << 32) | lo;
+            return true;
+        }
+        bool str(std::string &s, std::size_t size) {
+            if (size > left) return false;
+            s.assign(reinterpret_cast<const char *>(data), size);
+            data += size;
+            left -= size;
+            return true;
+        }
+        bool get(void *out, std::size_t size) {
+            if (size > left) return false;
+            std::memcpy(out, data, size);
+            data += size;
+            left -= size;
+            return true;
+        }
+        bool done() const noexcept { return left == 0; }
+
+    private:
+        const std::uint8_t *data;
+        std::size_t left;
+    };
+
+    bool cacheable(Patch::Status status) {
+        return status != Patch::Status::UNTESTED && status != Patch::Status::UNKNOWN_ERR;
+    }
+
+    // Whether a status read back from the file is one that could be stored
+    bool cached_status(std::int32_t status) {
+        if (status < static_cast<std::int32_t>(Patch::Status::UNKNOWN_ERR) ||
+            status > static_cast<std::int32_t>(Patch::Status::IS_KOR)) return false;
+        return cacheable(static_cast<Patch::Status>(status));
+    }
+}
+
+void ScanCache::load() {
+    entries.clear();
+    dirty = false;
+
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+        LOG("Scan Cache: None");
+        return;
+    }
+    std::vector<std::uint8_t> data;
+    std::uint8_t chunk[0x1000];
+    for (std::size_t n; (n = std::fread(chunk, 1, sizeof(chunk), file)) > 0; )
+        data.insert(data.end(), chunk, chunk + n);
+    std::fclose(file);
+
+    Reader header(data.data(), std::min(data.size(), header_size));
+    std::uint32_t magic, version, count, crc;
+    if (!header.u32(magic) || !header.u32(version) || !header.u32(count) || !header.u32(crc) ||
+        magic != cache_magic || version != cache_version || count > max_entries) {
+        LOG("Scan Cache: Bad Header");
+        return;
+    }
+    const std::uint8_t *body = data.data() + header_size;
+    std::size_t body_size = data.size() - header_size;
+    if (Zlib::crc32(0, body, body_size) != crc) {
+        LOG("Scan Cache: Bad CRC");
+        return;
+    }
+
+    Reader reader(body, body_size);
+    std::vector<Entry> loaded(count);
+    for (Entry &entry : loaded) {
+        std::uint32_t status;
+        std::uint16_t path_len, dev_len;
+        if (!reader.u64(entry.id) || !reader.u32(entry.validators.rpx_size) ||
+            !reader.u32(entry.validators.zip_crc) || !reader.u32(entry.validators.zip_cmp_size) ||
+            !reader.u32(entry.validators.zip_dec_size) || !reader.u32(status) ||
+            !reader.u16(path_len) || !reader.u16(dev_len) ||
+            !reader.str(entry.path, path_len) || !reader.str(entry.dev, dev_len)) {
+            LOG("Scan Cache: Truncated");
+            return;
+        }
+        if (!cached_status(static_cast<std::int32_t>(status))) {
+            LOG("Scan Cache: Bad Status");
+            return;
+        }
+        entry.status = static_cast<Patch::Status>(static_cast<std::int32_t>(status));
+    }
+    if (!reader.done()) {
+        LOG("Scan Cache: Trailing Data");
+        return;
+    }
+
+    entries = std::move(loaded);
+    LOG("Scan Cache: %d Entries", count);
+}
+
+void ScanCache::save() {
+    if (!dirty) return;
+
+    Writer body;
+    for (const Entry &entry : entries) {
+        body.u64(entry.id);
+        body.u32(entry.validators.rpx_size);
+        body.u32(entry.validators.zip_crc);
+        body.u32(entry.validators.zip_cmp_size);
+        body.u32(entry.validators.zip_dec_size);
+        body.u32(static_cast<std::uint32_t>(static_cast<std::int32_t>(entry.status)));
+        body.u16(entry.path.size());
+        body.u16(entry.dev.size());
+        body.str(entry.path);
+        body.str(entry.dev);
+    }
+    Writer header;
+    header.u32(cache_magic);
+    header.u32(cache_version);
+    header.u32(entries.size());
+    header.u32(Zlib::crc32(0, body.out.data(), body.out.size()));
+
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        LOG("Scan Cache: Can't Write");
+        return;
+    }
+    bool good = std::fwrite(header.out.data(), 1, header.out.size(), file) == header.out.size();
+    good &= std::fwrite(body.out.data(), 1, body.out.size(), file) == body.out.size();
+    good &= std::fclose(file) == 0;
+    if (good) dirty = false;
+    else LOG("Scan Cache: Write Failed");
+}
+
+ScanCache::Validators ScanCache::validate(const IOSUFSA &fsa, std::string_view title,
+                                          std::uint32_t rpx_size) {
+    Validators validators;
+    validators.rpx_size = rpx_size;
+
+    IOSUFSA::File file(fsa);
+    std::uint8_t local[zip_local_size];
+    if (file.open(util::concat_sv({ title, zip_file }), "rb")) {
+        if (file.readall(local, sizeof(local))) {
+            auto le32 = [&local](std::size_t off) -> std::uint32_t {
+                std::uint32_t v;
+                std::memcpy(&v, local + off, sizeof(v));
+                return util::le(v);
+            };
+            validators.zip_crc = le32(zip_crc_off);
+            validators.zip_cmp_size = le32(zip_cmp_off);
+            validators.zip_dec_size = le32(zip_dec_off);
+        }
+        file.close();
+    }
+
+    return validators;
+}
+
+std::vector<ScanCache::Entry>::iterator ScanCache::lookup(const Title &title) {
+    return std::find_if(entries.begin(), entries.end(), [&title](const Entry &entry) -> bool {
+        return entry.id == title.get_id() && entry.path == title.get_path() &&
+               entry.dev == title.get_dev();
+    });
+}
+
+std::vector<ScanCache::Entry>::const_iterator ScanCache::lookup(const Title &title) const {
+    return const_cast<ScanCache *>(this)->lookup(title);
+}
+
+bool ScanCache::find(const Title &title, const Validators &validators,
+                     Patch::Status &status) const {
+    auto it = lookup(title);
+    if (it == entries.end() || !(it->validators == validators)) return false;
+    status = it->status;
+    return true;
+}
+
+void ScanCache::store(const Title &title, const Validators &validators, Patch::Status status) {
+    if (!cacheable(status)) return;
+
+    auto it = lookup(title);
+    if (it == entries.end()) {
+        if (entries.size() >= max_entries) return;
+        it = entries.insert(entries.end(), { title.get_id(), title.get_path(), title.get_dev(),
+                                             validators, status });
+    } else if (it->validators == validators && it->status == status) {
+        return;
+    } else {
+        it->validators = validators;
+        it->status = status;
+    }
+    dirty = true;
+}
@@ -0,0 +1,65 @@
+#ifndef SCAN_CACHE_HPP
+#define SCAN_CACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "iosufsa.hpp"
+#include "patch.hpp"
+
+class Title;
+
+// Scan results kept on the SD card between runs. Entries are keyed by the
+// title and hold cheap validators read from its files, so a title is only
+// checked in full again once its files have changed. A missing, outdated
+// or corrupt cache file, including one holding a status that isn't cached,
+// is treated as empty.
+class ScanCache {
+public:
+    struct Validators {
+        static constexpr std::uint32_t missing = 0xFFFFFFFF;
+
+        std::uint32_t rpx_size = missing;
+        std::uint32_t zip_crc = missing;
+        std::uint32_t zip_cmp_size = missing;
+        std::uint32_t zip_dec_size = missing;
+
+        bool operator==(const Validators &o) const noexcept {
+            return rpx_size == o.rpx_size && zip_crc == o.zip_crc &&
+                   zip_cmp_size == o.zip_cmp_size && zip_dec_size == o.zip_dec_size;
+        }
+    };
+
+    explicit ScanCache(std::string path) : path(std::move(path)) { }
+
+    void load();
+    // Writes the cache back if it changed. Failures are only logged.
+    void save();
+
+    // The RPX size is the one hachi_stat_check found, so it isn't read twice
+    static Validators validate(const IOSUFSA &fsa, std::string_view title,
+                               std::uint32_t rpx_size);
+    bool find(const Title &title, const Validators &validators, Patch::Status &status) const;
+    void store(const Title &title, const Validators &validators, Patch::Status status);
+
+private:
+    struct Entry {
+        std::uint64_t id;
+        std::string path;
+        std::string dev;
+        Validators validators;
+        Patch::Status status;
+    };
+
+    std::string path;
+    std::vector<Entry> entries;
+    bool dirty = false;
+
+    std::vector<Entry>::iterator lookup(const Title &title);
+    std::vector<Entry>::const_iterator lookup(const Title &title) const;
+};
+
+#endif // SCAN_CACHE_HPP
@@ -0,0 +1,109 @@
+#include "scanner.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <utility>
+
+#include "exception.hpp"
+#include "log.hpp"
+
+namespace {
+    bool is_found(const Title &title) {
+        return title.get_status_raw() > Patch::Status::UNTESTED;
+    }
+}
+
+Scanner::Scanner(WUProc &proc, ScanCache &cache, Title::Filtered candidates) :
+        cache(cache), candidates(std::move(candidates)),
+        checked(std::make_unique<std::atomic<bool>[]>(this->candidates.size())),
+        listed(std::make_unique<bool[]>(this->candidates.size())) {
+    // Titles checked by an earlier scan are skipped by this one
+    std::size_t tested = 0;
+    for (std::size_t i = 0; i < total(); ++i) {
+        bool done = this->candidates[i].get().get_status_raw() != Patch::Status::UNTESTED;
+        checked[i].store(done, std::memory_order_relaxed);
+        listed[i] = false;
+        if (done) ++tested;
+    }
+    count.store(tested, std::memory_order_relaxed);
+
+    LOG("Init IOSUHAX...");
+    hold.emplace(proc);
+    fsa.open();
+
+    thread = Thread([this]() {
+        struct running_guard {
+            std::atomic<bool> &running;
+            ~running_guard() { running.store(false, std::memory_order_release); }
+        } guard { running };
+
+        Title::scan(this->candidates, fsa, this->cache, [this](std::size_t i) -> bool {
+            Title &title = this->candidates[i];
+            if (is_found(title)) {
+                LOG("FOUND: %s", title.get_path().c_str());
+                try {
+                    const std::string &name = title.get_name();
+                    LOG("FOUND NAME: %s", name.c_str());
+                } catch (error &e) {
+                    LOG("No name for %s: %s", title.get_path().c_str(), e.what());
+                }
+            }
+            checked[i].store(true, std::memory_order_release);
+            count.fetch_add(1, std::memory_order_release);
+            return !stop.load(std::memory_order_relaxed);
+        });
+    }, Thread::next_core());
+}
+
+Scanner::~Scanner() {
+    stop = true;
+    try {
+        finish();
+    } catch (std::exception &e) {
+        LOG("ERROR in ~Scanner: %s", e.what());
+    }
+}
+
+bool Scanner::poll(Title::Filtered &found) {
+    bool changed = false;
+    auto pos = found.begin();
+    for (std::size_t i = 0; i < total(); ++i) {
+        Title &title = candidates[i];
+        // Titles listed earlier mark where the next new ones go
+        auto it = std::find_if(pos, found.end(),
+            [&title](const Title &other) -> bool { return &other == &title; });
+        if (it != found.end()) {
+            pos = it + 1;
+            listed[i] = true;
+            continue;
+        }
+        if (listed[i] || !checked[i].load(std::memory_order_acquire)) continue;
+        listed[i] = true;
+        if (!is_found(title)) continue;
+        pos = found.insert(pos, title) + 1;
+        changed = true;
+    }
+    return changed;
+}
+
+bool Scanner::seen(Patch::Status status) const {
+    for (std::size_t i = 0; i < total(); ++i) {
+        if (checked[i].load(std::memory_order_acquire) &&
+            candidates[i].get().get_status_raw() == status) return true;
+    }
+    return false;
+}
+
+void Scanner::finish() {
+    std::exception_ptr error;
+    try {
+        thread.join();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    cache.save();
+    if (fsa.is_open()) fsa.close();
+    hold.reset();
+    if (error) std::rethrow_exception(error);
+}
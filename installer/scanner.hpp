@@ -0,0 +1,58 @@
+#ifndef SCANNER_HPP
+#define SCANNER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+#include "iosufsa.hpp"
+#include "patch.hpp"
+#include "proc.hpp"
+#include "scan_cache.hpp"
+#include "thread.hpp"
+#include "title.hpp"
+
+// Runs Title::scan on a background thread, so the titles found can be
+// listed and patched while the rest are still being checked. Names of the
+// titles found are fetched by the scan as well. The candidates must stay
+// in place until the scan is finished or the Scanner is destroyed. The
+// HOME menu is kept closed while the scan's session is open, so the scan
+// never runs under it.
+class Scanner {
+public:
+    Scanner(WUProc &proc, ScanCache &cache, Title::Filtered candidates);
+    ~Scanner();
+
+    Scanner(const Scanner &) = delete;
+    Scanner &operator=(const Scanner &) = delete;
+
+    std::size_t scanned() const noexcept { return count.load(std::memory_order_acquire); }
+    std::size_t total() const noexcept { return candidates.size(); }
+    bool done() const noexcept { return !running.load(std::memory_order_acquire); }
+
+    // Adds titles found since the last call to found, keeping the order of
+    // the candidates. Titles already in found are skipped. Returns whether
+    // found was changed.
+    bool poll(Title::Filtered &found);
+    // Whether any title checked so far has the given status
+    bool seen(Patch::Status status) const;
+
+    // Waits for the scan, rethrowing its error, saves the cache and closes
+    // the scan's session
+    void finish();
+
+private:
+    ScanCache &cache;
+    const Title::Filtered candidates;
+    std::optional<WUForegroundHold> hold;
+    IOSUFSA fsa;
+    std::unique_ptr<std::atomic<bool>[]> checked;
+    std::unique_ptr<bool[]> listed;
+    std::atomic<std::size_t> count { 0 };
+    std::atomic<bool> stop { false };
+    std::atomic<bool> running { true };
+    Thread thread;
+};
+
+#endif // SCANNER_HPP
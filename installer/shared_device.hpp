@@ -0,0 +1,35 @@
+#ifndef SHARED_DEVICE_HPP
+#define SHARED_DEVICE_HPP
+
+#include <cstddef>
+
+// Counts the users of a device shared by every session. It is opened with
+// the first user and kept until the last one leaves, so a caller that
+// keeps a session open for the whole run only pays for it once. Callers
+// serialize acquire and release themselves.
+class SharedDevice {
+public:
+    // Opens the device with open() if it has no users. Returns false,
+    // without adding a user, if it couldn't be opened.
+    template<typename Open>
+    bool acquire(Open open) {
+        if (count == 0 && !open()) return false;
+        ++count;
+        return true;
+    }
+
+    // Closes the device with close() once the last user leaves, and
+    // returns what it does. Returns true while users remain.
+    template<typename Close>
+    bool release(Close close) {
+        if (--count > 0) return true;
+        return close();
+    }
+
+    std::size_t users() const noexcept { return count; }
+
+private:
+    std::size_t count = 0;
+};
+
+#endif // SHARED_DEVICE_HPP
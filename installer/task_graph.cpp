@@ -0,0 +1,125 @@
+#include "task_graph.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <utility>
+
+#include "exception.hpp"
+#include "log.hpp"
+#include "progress.hpp"
+
+TaskGraph::Id TaskGraph::add(std::string name, std::function<void()> func,
+                             const std::vector<Id> &deps, int core) {
+    Id id = tasks.size();
+    auto task = std::make_unique<Task>();
+    task->name = std::move(name);
+    task->func = std::move(func);
+    task->core = core;
+    for (Id dep : deps) {
+        if (dep >= id) throw error("TaskGraph: Dependency");
+        // Listed once, so it's only released once
+        if (std::find(task->deps.begin(), task->deps.end(), dep) != task->deps.end()) continue;
+        task->deps.push_back(dep);
+        tasks[dep]->dependents.push_back(id);
+    }
+    tasks.push_back(std::move(task));
+    return id;
+}
+
+void TaskGraph::run() {
+    failed.store(false, std::memory_order_relaxed);
+    for (auto &task : tasks) {
+        task->waiting.store(task->deps.size(), std::memory_order_relaxed);
+        task->ran = false;
+        task->start_ms = task->end_ms = 0;
+    }
+    base_ms = Progress::now_ms();
+
+    std::exception_ptr error;
+    try {
+        for (Id id = 0; id < tasks.size(); ++id) {
+            if (tasks[id]->deps.empty()) start(id);
+        }
+    } catch (...) {
+        failed.store(true, std::memory_order_relaxed);
+        error = std::current_exception();
+    }
+
+    // A task is started by the last of its dependencies to finish, before
+    // that one ends. Joining in order, every dependency has been joined by
+    // the time a task is reached, so its thread is there if it ever will be.
+    for (auto &task : tasks) {
+        try {
+            task->thread.join();
+        } catch (...) {
+            if (!error) error = std::current_exception();
+        }
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+void TaskGraph::start(Id id) {
+    tasks[id]->thread = Thread([this, id]() { execute(id); }, tasks[id]->core);
+}
+
+void TaskGraph::execute(Id id) {
+    Task &task = *tasks[id];
+    task.start_ms = static_cast<std::uint32_t>(Progress::now_ms() - base_ms);
+    try {
+        task.func();
+    } catch (...) {
+        failed.store(true, std::memory_order_relaxed);
+        task.end_ms = static_cast<std::uint32_t>(Progress::now_ms() - base_ms);
+        throw;
+    }
+    task.end_ms = static_cast<std::uint32_t>(Progress::now_ms() - base_ms);
+    task.ran = true;
+
+    for (Id next : task.dependents) {
+        if (tasks[next]->waiting.fetch_sub(1, std::memory_order_acq_rel) != 1) continue;
+        if (failed.load(std::memory_order_relaxed)) continue;
+        try {
+            start(next);
+        } catch (...) {
+            failed.store(true, std::memory_order_relaxed);
+            throw;
+        }
+    }
+}
+
+std::vector<TaskGraph::Span> TaskGraph::trace() const {
+    std::vector<Span> spans;
+    spans.reserve(tasks.size());
+    for (const auto &task : tasks) {
+        spans.push_back({ task->name, task->core, task->ran, false,
+                          task->start_ms, task->end_ms });
+    }
+
+    // Walks back from the task that ended last, through whichever of each
+    // task's dependencies ended last, as that's the one it waited on. Ties
+    // go to the task added later, which may be waiting on the other.
+    auto latest = [&spans](const std::vector<Id> &ids) -> Id {
+        Id found = spans.size();
+        for (Id id : ids) {
+            if (spans[id].ran && (found == spans.size() || spans[id].end_ms >= spans[found].end_ms))
+                found = id;
+        }
+        return found;
+    };
+    std::vector<Id> all(tasks.size());
+    for (Id id = 0; id < tasks.size(); ++id) all[id] = id;
+    for (Id id = latest(all); id < spans.size(); id = latest(tasks[id]->deps))
+        spans[id].critical = true;
+    return spans;
+}
+
+void TaskGraph::log_trace() const {
+    for (const Span &span : trace()) {
+        if (!span.ran) {
+            LOG("TRACE %-20s not run", span.name.c_str());
+            continue;
+        }
+        LOG("TRACE %-20s core %2d %7u - %7u ms%s", span.name.c_str(), span.core,
+            span.start_ms, span.end_ms, span.critical ? " *" : "");
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef TASK_GRAPH_HPP
+#define TASK_GRAPH_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "thread.hpp"
+
+// Tasks with dependencies between them. Each task runs on a thread of its
+// own as soon as the tasks it depends on are done, so independent chains
+// run side by side on their cores. A task depends only on tasks added
+// before it, which keeps the graph free of cycles.
+//
+// Every task is timed, so after a run the spans can be traced and the
+// critical path, the chain of tasks that decided how long the run took,
+// picked out.
+class TaskGraph {
+public:
+    using Id = std::size_t;
+
+    struct Span {
+        std::string name;
+        int core;
+        bool ran;
+        bool critical;
+        // Relative to the start of the run
+        std::uint32_t start_ms;
+        std::uint32_t end_ms;
+    };
+
+    TaskGraph() = default;
+    ~TaskGraph() = default;
+
+    TaskGraph(const TaskGraph &) = delete;
+    TaskGraph &operator=(const TaskGraph &) = delete;
+
+    Id add(std::string name, std::function<void()> func, const std::vector<Id> &deps = { },
+           int core = Thread::any_core);
+    std::size_t size() const noexcept { return tasks.size(); }
+
+    // Runs every task, returning once all of them are done. After a task
+    // throws no more are started, and the first error is rethrown.
+    void run();
+
+    // Spans of the last run, in the order the tasks were added
+    std::vector<Span> trace() const;
+    void log_trace() const;
+
+private:
+    struct Task {
+        std::string name;
+        std::function<void()> func;
+        std::vector<Id> deps;
+        std::vector<Id> dependents;
+        int core;
+        std::atomic<std::uint32_t> waiting { 0 };
+        Thread thread;
+        bool ran = false;
+        std::uint32_t start_ms = 0;
+        std::uint32_t end_ms = 0;
+    };
+
+    void start(Id id);
+    void execute(Id id);
+
+    std::vector<std::unique_ptr<Task>> tasks;
+    std::atomic<bool> failed { false };
+    std::uint64_t base_ms = 0;
+};
+
+#endif // TASK_GRAPH_HPP
@@ -0,0 +1,289 @@
+#include "thread.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#ifdef __WIIU__
+#include <coreinit/condition.h>
+#include <coreinit/core.h>
+#include <coreinit/mutex.h>
+#include <coreinit/thread.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+#include "aligned.hpp"
+#include "exception.hpp"
+#include "log.hpp"
+
+namespace {
+#ifdef __WIIU__
+    constexpr std::size_t stack_size = 0x20000;
+#endif
+
+    // Set while a parallel_for has the cores. Any parallel_for started in
+    // the meantime, such as a deflate inside a per-title job, runs on its
+    // calling thread instead of starting yet more threads.
+    std::atomic<bool> spread { false };
+
+    // A mutex and a condition waited on under it. notify wakes every waiter,
+    // as OSSignalCond does, and a waiter may wake early, so waits are looped.
+    class Monitor {
+    public:
+#ifdef __WIIU__
+        Monitor() {
+            OSInitMutex(&mutex);
+            OSInitCond(&cond);
+        }
+        void lock() { OSLockMutex(&mutex); }
+        void unlock() { OSUnlockMutex(&mutex); }
+        void wait() { OSWaitCond(&cond, &mutex); }
+        void notify() { OSSignalCond(&cond); }
+
+    private:
+        OSMutex mutex;
+        OSCondition cond;
+#else
+        void lock() { mutex.lock(); }
+        void unlock() { mutex.unlock(); }
+        void wait() {
+            std::unique_lock<std::mutex> held(mutex, std::adopt_lock);
+            cond.wait(held);
+            held.release();
+        }
+        void notify() { cond.notify_all(); }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable cond;
+#endif
+    };
+
+    // Threads kept for parallel_for, one pinned to each core, that wait for
+    // work between calls instead of being started and joined for each
+    class Pool {
+    public:
+        Pool() {
+            chosen.resize(Thread::cores());
+            threads.reserve(Thread::cores());
+            for (std::size_t i = 0; i < Thread::cores(); ++i)
+                threads.emplace_back([this, i]() { serve(i); }, static_cast<int>(i));
+        }
+
+        ~Pool() {
+            monitor.lock();
+            stop = true;
+            monitor.notify();
+            monitor.unlock();
+            threads.clear();
+        }
+
+        Pool(const Pool &) = delete;
+        Pool &operator=(const Pool &) = delete;
+
+        // Runs work on the calling thread and on up to helpers of the pool's
+        // threads, off the caller's core, returning once all of them are
+        // done. The first exception thrown is rethrown.
+        void run(const std::function<void()> &work, std::size_t helpers) {
+            int core = Thread::current_core();
+            monitor.lock();
+            this->work = &work;
+            for (std::size_t i = 0; i < chosen.size(); ++i) {
+                chosen[i] = helpers > 0 && static_cast<int>(i) != core;
+                if (chosen[i]) {
+                    --helpers;
+                    ++running;
+                }
+            }
+            error = nullptr;
+            ++generation;
+            monitor.notify();
+            monitor.unlock();
+
+            std::exception_ptr caller_error;
+            try {
+                work();
+            } catch (...) {
+                caller_error = std::current_exception();
+            }
+
+            monitor.lock();
+            while (running > 0) monitor.wait();
+            this->work = nullptr;
+            std::exception_ptr helper_error = error;
+            monitor.unlock();
+            if (caller_error) std::rethrow_exception(caller_error);
+            if (helper_error) std::rethrow_exception(helper_error);
+        }
+
+    private:
+        Monitor monitor;
+        std::vector<Thread> threads;
+        const std::function<void()> *work = nullptr;
+        std::vector<bool> chosen;
+        std::size_t running = 0;
+        std::uint32_t generation = 0;
+        std::exception_ptr error;
+        bool stop = false;
+
+        void serve(std::size_t index) {
+            std::uint32_t seen = 0;
+            monitor.lock();
+            while (true) {
+                while (!stop && generation == seen) monitor.wait();
+                if (stop) break;
+                seen = generation;
+                if (!chosen[index]) continue;
+
+                const std::function<void()> &func = *work;
+                monitor.unlock();
+                std::exception_ptr failed;
+                try {
+                    func();
+                } catch (...) {
+                    failed = std::current_exception();
+                }
+                monitor.lock();
+                if (failed && !error) error = failed;
+                if (--running == 0) monitor.notify();
+            }
+            monitor.unlock();
+        }
+    };
+
+    // Started by the first parallel_for to spread its work
+    Pool &pool() {
+        static Pool pool;
+        return pool;
+    }
+}
+
+struct Thread::State {
+    std::function<void()> func;
+    std::exception_ptr error;
+#ifdef __WIIU__
+    OSThread thread;
+    aligned::vector<std::uint8_t, 0x10> stack;
+
+    static int entry(int, const char **argv) {
+        State *state = reinterpret_cast<State *>(argv);
+        try {
+            state->func();
+        } catch (...) {
+            state->error = std::current_exception();
+        }
+        return 0;
+    }
+#else
+    std::thread thread;
+
+    void run() {
+        try {
+            func();
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+#endif
+};
+
+Thread::Thread(std::function<void()> func, int core) : state(std::make_unique<State>()) {
+    state->func = std::move(func);
+#ifdef __WIIU__
+    OSThreadAttributes affinity = (core == any_core) ? OS_THREAD_ATTRIB_AFFINITY_ANY :
+        static_cast<OSThreadAttributes>(OS_THREAD_ATTRIB_AFFINITY_CPU0 << core);
+    state->stack.resize(stack_size);
+    if (!OSCreateThread(&state->thread, &State::entry, 0, reinterpret_cast<char *>(state.get()),
+                        state->stack.data() + state->stack.size(), state->stack.size(),
+                        OSGetThreadPriority(OSGetCurrentThread()), affinity)) {
+        state.reset();
+        throw error("Thread: Create");
+    }
+    OSResumeThread(&state->thread);
+#else
+    (void) core;
+    state->thread = std::thread(&State::run, state.get());
+#endif
+}
+
+Thread::~Thread() {
+    if (joinable()) try {
+        join();
+    } catch (std::exception &e) {
+        LOG("ERROR in ~Thread: %s", e.what());
+    }
+}
+
+Thread::Thread() = default;
+Thread::Thread(Thread &&) noexcept = default;
+
+Thread &Thread::operator=(Thread &&o) {
+    if (joinable()) join();
+    state = std::move(o.state);
+    return *this;
+}
+
+void Thread::join() {
+    if (!joinable()) return;
+#ifdef __WIIU__
+    OSJoinThread(&state->thread, nullptr);
+#else
+    state->thread.join();
+#endif
+    std::exception_ptr error = state->error;
+    state.reset();
+    if (error) std::rethrow_exception(error);
+}
+
+std::size_t Thread::cores() {
+#ifdef __WIIU__
+    return OSGetCoreCount();
+#else
+    return std::max(std::thread::hardware_concurrency(), 1u);
+#endif
+}
+
+int Thread::current_core() {
+#ifdef __WIIU__
+    return OSGetCoreId();
+#else
+    return any_core;
+#endif
+}
+
+int Thread::next_core() {
+    int core = current_core();
+    if (core == any_core) return any_core;
+    return static_cast<int>((core + 1) % cores());
+}
+
+void parallel_for(std::size_t count, const std::function<void(std::size_t)> &func) {
+    if (count <= 1 || spread.exchange(true)) {
+        for (std::size_t i = 0; i < count; ++i) func(i);
+        return;
+    }
+    struct spread_guard {
+        ~spread_guard() { spread = false; }
+    } guard;
+
+    std::atomic<std::size_t> next { 0 };
+    auto work = [&next, count, &func]() {
+        try {
+            for (std::size_t i; (i = next.fetch_add(1)) < count; ) func(i);
+        } catch (...) {
+            // Keep the remaining work from being started
+            next = count;
+            throw;
+        }
+    };
+
+    std::size_t workers = std::min(count, Thread::cores());
+    pool().run(work, workers - 1);
+}
@@ -0,0 +1,45 @@
+#ifndef THREAD_HPP
+#define THREAD_HPP
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+
+// Worker thread pinned to a core. On the console this is a coreinit thread,
+// elsewhere it is a std::thread. Exceptions thrown by the function are
+// rethrown by join().
+class Thread {
+public:
+    static constexpr int any_core = -1;
+
+    Thread();
+    explicit Thread(std::function<void()> func, int core = any_core);
+    ~Thread();
+
+    // Move Only
+    Thread(const Thread &) = delete;
+    Thread &operator=(const Thread &) = delete;
+    Thread(Thread &&) noexcept;
+    Thread &operator=(Thread &&o);
+
+    bool joinable() const noexcept { return static_cast<bool>(state); }
+    void join();
+
+    static std::size_t cores();
+    static int current_core();
+    // The core after the calling thread's, to keep work off the UI core
+    static int next_core();
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+// Calls func(i) for each i in [0, count), spread over all cores with the
+// calling thread taking part. The other cores' threads are kept between
+// calls. The first exception thrown is rethrown. While one call is
+// spreading work, other calls run serially.
+void parallel_for(std::size_t count, const std::function<void(std::size_t)> &func);
+
+#endif // THREAD_HPP
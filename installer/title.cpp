@@ -1,8 +1,15 @@
 #include "title.hpp"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstring>
+#include <exception>
 #include <iterator>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <utility>
 
 #include <coreinit/mcp.h>
 #include <coreinit/userconfig.h>
@@ -14,6 +21,7 @@
 #include "hachi_patch.hpp"
 #include "log.hpp"
 #include "ntr_patch.hpp"
+#include "thread.hpp"
 
 namespace {
     class MCP {
@@ -36,11 +44,87 @@ namespace {
         std::int32_t fd;
     };
 
+    // Checks run on each title, cheapest first, so that titles which aren't
+    // DS Virtual Console cost a single GetStat. A stage passes a title on by
+    // returning UNTESTED or better, or rejects it with any status below
+    // that. The status of the last stage is the final one.
+    //
+    // The RPX was once checked in full before rom.zip, so its rejections
+    // still come first: a ZIP stage's rejection is held while the remaining
+    // RPX stages run, and only given if they all pass.
+    struct Stage {
+        const char *name;
+        Patch::Status (*check)(const IOSUFSA &fsa, std::string_view title);
+        bool zip;
+    };
+    constexpr std::array<Stage, 5> stages = {{
+        { "RPX Stat", hachi_stat_check, false },
+        { "ZIP Stat", ntr_stat_check, true },
+        { "ELF Header", hachi_header_check, false },
+        { "Hachi", hachi_check, false },
+        { "NTR", ntr_check, true },
+    }};
+    // Stages that Title::scan runs ahead of the cache lookup, as they cost
+    // less than reading the cache validators
+    constexpr std::size_t fast_stages = 2;
+    constexpr std::size_t rpx_stat = 0;
+
+    // Titles that reached each stage and that were rejected by it
+    struct StageCount {
+        std::atomic<std::uint32_t> entered { 0 };
+        std::atomic<std::uint32_t> rejected { 0 };
+    };
+    std::array<StageCount, stages.size()> stage_counts;
+
+    void reset_stage_counts() {
+        for (StageCount &count : stage_counts) {
+            count.entered.store(0, std::memory_order_relaxed);
+            count.rejected.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Runs the stages from first up to last, and past it only to settle a
+    // held rejection. With rpx_size, the RPX Stat stage gives the size it
+    // found there.
+    Patch::Status run_stages(const IOSUFSA &fsa, std::string_view title,
+                             std::size_t first, std::size_t last,
+                             std::uint32_t *rpx_size = nullptr) {
+        Patch::Status res = Patch::Status::UNTESTED;
+        Patch::Status held = Patch::Status::UNTESTED;
+        for (std::size_t i = first; i < stages.size(); ++i) {
+            bool holding = held < Patch::Status::UNTESTED;
+            if (i >= last && !holding) break;
+            if (holding && stages[i].zip) continue;
+            LOG("Checking %s...", stages[i].name);
+            stage_counts[i].entered.fetch_add(1, std::memory_order_relaxed);
+            if (i == rpx_stat && rpx_size)
+                res = hachi_stat_check(fsa, title, *rpx_size);
+            else
+                res = stages[i].check(fsa, title);
+            if (res < Patch::Status::UNTESTED) {
+                stage_counts[i].rejected.fetch_add(1, std::memory_order_relaxed);
+                if (!stages[i].zip) return res;
+                held = res;
+            }
+        }
+        return held < Patch::Status::UNTESTED ? held : res;
+    }
+
+    void log_stage_counts() {
+        for (std::size_t i = 0; i < stages.size(); ++i) {
+            LOG("Stage %s: %u checked, %u rejected", stages[i].name,
+                stage_counts[i].entered.load(std::memory_order_relaxed),
+                stage_counts[i].rejected.load(std::memory_order_relaxed));
+        }
+    }
+
     constexpr std::uint32_t max_languages = 12;
 
     int get_sys_language() {
-        // Cache result so it's only queried once
-        static std::uint32_t language = 0xFF;
+        // Cache result so it's only queried once. Names are fetched by the
+        // scan workers, so racing first queries just store the same value.
+        static std::atomic<std::uint32_t> cached { 0xFF };
+        std::uint32_t language = cached;
         if (language < max_languages) return language;
 
         UC uc;
@@ -54,6 +138,7 @@ namespace {
             throw error("Lang: bad UCReadSysConfig");
         }
         LOG("Got language: %d", language);
+        cached = language;
         return language;
     }
 }
@@ -92,15 +177,103 @@ std::string Title::get_name_impl() {
     return "Unknown Application";
 }
 
-Patch::Status Title::get_status_impl(const IOSUFSA &fsa) {
-    Patch::Status res;
-    LOG("Checking title: %s", path.c_str());
+void Title::scan(const Filtered &titles, const IOSUFSA &fsa, ScanCache &cache,
+                 const Checked &checked) {
+    // The counts logged after the scan are of this scan alone
+    reset_stage_counts();
 
-    LOG("Checking Hachi...");
-    res = hachi_check(fsa, path);
-    if (res < Patch::Status::UNTESTED) return res;
+    // Round robin over the devices, keeping the list order within each
+    std::vector<std::pair<std::string_view, std::vector<std::size_t>>> devs;
+    for (std::size_t i = 0; i < titles.size(); ++i) {
+        const Title &title = titles[i];
+        auto it = std::find_if(devs.begin(), devs.end(),
+            [&title](const auto &dev) -> bool { return dev.first == title.get_dev(); });
+        if (it == devs.end()) it = devs.insert(devs.end(), { title.get_dev(), { } });
+        it->second.push_back(i);
+    }
+    std::vector<std::size_t> order;
+    order.reserve(titles.size());
+    for (std::size_t i = 0; order.size() < titles.size(); ++i) {
+        for (auto &dev : devs) {
+            if (i < dev.second.size()) order.push_back(dev.second[i]);
+        }
+    }
+
+    // The cache is only read while the workers run, and updated after.
+    // Results are kept aside for it, as checked titles are handed out to
+    // the caller before the scan ends.
+    std::vector<std::optional<ScanCache::Validators>> validators(titles.size());
+    std::vector<Patch::Status> results(titles.size());
+    std::atomic<std::size_t> next { 0 };
+    auto work = [&titles, &order, &validators, &results, &cache, &checked, &next]
+                (const IOSUFSA &session) {
+        try {
+            for (std::size_t i; (i = next.fetch_add(1)) < order.size(); ) {
+                std::size_t index = order[i];
+                Title &title = titles[index];
+                if (title.status != Patch::Status::UNTESTED) continue;
+                std::uint32_t rpx_size = ScanCache::Validators::missing;
+                Patch::Status early = run_stages(session, title.path, 0, fast_stages,
+                                                 &rpx_size);
+                if (early < Patch::Status::UNTESTED) {
+                    // Rejects are cheaper to repeat than to cache
+                    title.status = early;
+                } else {
+                    validators[index] = ScanCache::validate(session, title.path, rpx_size);
+                    if (!cache.find(title, *validators[index], title.status))
+                        title.status = title.get_status_impl(session, fast_stages);
+                }
+                results[index] = title.status;
+                if (checked && !checked(index)) next = order.size();
+            }
+        } catch (...) {
+            // Keep the remaining titles from being started
+            next = order.size();
+            throw;
+        }
+    };
+
+    // Sessions are opened and closed here, on the calling thread
+    std::size_t workers = std::min(titles.size(), Thread::cores());
+    std::vector<std::unique_ptr<IOSUFSA>> sessions;
+    sessions.reserve(workers > 0 ? workers - 1 : 0);
+    for (std::size_t i = 1; i < workers; ++i) {
+        sessions.push_back(std::make_unique<IOSUFSA>());
+        sessions.back()->open();
+    }
+    LOG("Scanning with %d workers", workers);
+
+    std::vector<Thread> threads;
+    threads.reserve(sessions.size());
+    int core = Thread::current_core();
+    for (std::size_t i = 0; i < sessions.size(); ++i) {
+        int worker_core = (core == Thread::any_core) ? Thread::any_core :
+            static_cast<int>((core + i + 1) % Thread::cores());
+        threads.emplace_back([&work, &session = *sessions[i]]() { work(session); }, worker_core);
+    }
 
-    LOG("Checking NTR...");
-    res = ntr_check(fsa, path);
-    return res;
+    std::exception_ptr error;
+    try {
+        work(fsa);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    for (Thread &thread : threads) {
+        try {
+            thread.join();
+        } catch (...) {
+            if (!error) error = std::current_exception();
+        }
+    }
+    for (std::unique_ptr<IOSUFSA> &session : sessions) session->close();
+    for (std::size_t i = 0; i < titles.size(); ++i) {
+        if (validators[i]) cache.store(titles[i], *validators[i], results[i]);
+    }
+    log_stage_counts();
+    if (error) std::rethrow_exception(error);
+}
+
+Patch::Status Title::get_status_impl(const IOSUFSA &fsa, std::size_t first_stage) {
+    LOG("Checking title: %s", path.c_str());
+    return run_stages(fsa, path, first_stage, stages.size());
 }
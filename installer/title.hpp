@@ -11,6 +11,7 @@
 
 #include "iosufsa.hpp"
 #include "patch.hpp"
+#include "scan_cache.hpp"
 
 class Title {
 public:
@@ -41,6 +42,18 @@ public:
         return filtered;
     }
 
+    // Gets the status of each title, spread over a worker per core that
+    // each have their own FSA session. Titles are interleaved by device so
+    // that every device stays busy. Each title is checked exactly as by
+    // get_status, so the results match a serial scan. Titles whose files
+    // still match their cache entry take the cached status instead.
+    // checked is called on the workers with the index of each title that
+    // was untested, once it has a status, and stops the scan by returning
+    // false. Worker sessions are opened on the calling thread.
+    using Checked = std::function<bool(std::size_t)>;
+    static void scan(const Filtered &titles, const IOSUFSA &fsa, ScanCache &cache,
+                     const Checked &checked = nullptr);
+
 private:
     const std::uint64_t id;
     const std::string path;
@@ -49,7 +62,8 @@ private:
     Patch::Status status = Patch::Status::UNTESTED;
 
     std::string get_name_impl();
-    Patch::Status get_status_impl(const IOSUFSA &fsa);
+    // Runs the checks from first_stage on, see title.cpp
+    Patch::Status get_status_impl(const IOSUFSA &fsa, std::size_t first_stage = 0);
 };
 
 #endif // TITLE_HPP
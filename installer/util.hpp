@@ -1,6 +1,7 @@
 #ifndef UTIL_HPP
 #define UTIL_HPP
 
+#include <cstdint>
 #include <cstring>
 #include <string>
 #include <string_view>
@@ -22,6 +23,13 @@ namespace util {
             str[offset + i] = hex_digits[(value >> (28 - 4*i)) & 0xF];
     }
 
+    // Right-aligned in a field of width digits, keeping the low digits
+    inline void write_dec(std::size_t value, std::string &str, std::size_t offset,
+                          std::size_t digits, char fill = ' ') {
+        for (std::size_t i = digits; i-- > 0; value /= 10)
+            str[offset + i] = (value == 0 && i + 1 < digits) ? fill : hex_digits[value % 10];
+    }
+
     // ASCII Magic Numbers Helper
     constexpr inline std::uint32_t magic_const(const char magic[5]) {
         // Big Endian
@@ -31,6 +39,34 @@ namespace util {
                (static_cast<std::uint32_t>(magic[3]));
     }
 
+    // Byte order of file data. RPX files are big-endian like the console,
+    // while ZIP headers and NTR data are little-endian. Both convert in
+    // either direction between the file order and the native order.
+    template<typename T>
+    constexpr inline T bswap(T v) {
+        static_assert(sizeof(T) == 2 || sizeof(T) == 4);
+        if constexpr (sizeof(T) == 2) return __builtin_bswap16(v);
+        else return __builtin_bswap32(v);
+    }
+
+    template<typename T>
+    constexpr inline T be(T v) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return v;
+#else
+        return bswap(v);
+#endif
+    }
+
+    template<typename T>
+    constexpr inline T le(T v) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return bswap(v);
+#else
+        return v;
+#endif
+    }
+
     template<typename T>
     inline bool memequal(const T &given, const T &expected) {
         return std::memcmp(&given, &expected, sizeof(T)) == 0;
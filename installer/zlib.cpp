@@ -1,11 +1,49 @@
 #include "zlib.hpp"
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+
 #define ZLIB_CONST
 #include <zlib.h>
 
 #include "exception.hpp"
+#include "log.hpp"
+#include "thread.hpp"
 
 namespace {
+    // Input per parallel deflate block. Each block in flight holds a
+    // deflate state as well as its input and output, so this and mem_level
+    // set most of what the Deflater holds.
+    constexpr std::size_t block_len = 0x10000;
+    // Deflate window, used to prime each block with the data before it
+    constexpr std::size_t dict_max = 0x8000;
+    // Blocks a Deflater compresses at once, one per core of the console.
+    // Fixed, so its output is the same wherever it's made.
+    constexpr std::size_t flush_blocks = 3;
+    constexpr std::size_t flush_len = block_len * flush_blocks;
+    constexpr std::size_t pending_max = dict_max + flush_len;
+    // zlib's default. A deflate state is 256 KiB at this level, against
+    // 384 KiB at MAX_MEM_LEVEL, for output a fraction of a percent larger.
+    constexpr int mem_level = 8;
+    // Output inflated between CRC updates, small enough to stay in cache
+    constexpr std::size_t crc_window = 0x8000;
+    // zlib stream header for the default level and a 32 KiB window
+    constexpr std::uint8_t zlib_header[2] = { 0x78, 0x9C };
+
+    // zlib's state is allocated through operator new like every other
+    // buffer, so what a patch holds can be measured in one place
+    voidpf zlib_alloc(voidpf, uInt items, uInt size) {
+        return ::operator new(static_cast<std::size_t>(items) * size, std::nothrow);
+    }
+
+    void zlib_free(voidpf, voidpf address) {
+        ::operator delete(address);
+    }
+
     class DeflateGuard {
     public:
         explicit DeflateGuard(z_streamp strm) : strm(strm) { }
@@ -14,71 +52,272 @@ namespace {
         const z_streamp strm;
     };
 
-    class InflateGuard {
-    public:
-        explicit InflateGuard(z_streamp strm) : strm(strm) { }
-        ~InflateGuard() { ::inflateEnd(strm); }
-    private:
-        const z_streamp strm;
-    };
-}
+    std::size_t block_count(std::size_t len) {
+        return std::max<std::size_t>((len + block_len - 1) / block_len, 1);
+    }
 
-Zlib::bytes Zlib::compress(const bytes &data, bool rpx) {
-    bytes cmp;
-    if (rpx) {
-        cmp.resize(4);
-        *reinterpret_cast<std::uint32_t *>(cmp.data()) = data.size();
+    // zlib's conservative deflateBound, plus room for the sync flush
+    constexpr std::size_t block_bound(std::size_t len) {
+        return len + ((len + 7) >> 3) + ((len + 63) >> 6) + 5 + 16;
     }
 
-    z_stream strm;
-    strm.next_in = reinterpret_cast<const Bytef *>(data.data());
-    strm.avail_in = data.size();
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
+    // One block of a block-parallel deflate stream. The dictionary is the
+    // dict_len bytes directly before data. out has room for
+    // block_bound(len), and out_len is set to the bytes written there.
+    struct Block {
+        const std::uint8_t *data;
+        std::size_t len;
+        std::size_t dict_len;
+        bool last;
+        std::uint8_t *out;
+        std::size_t out_len;
+        std::uint32_t adler;
+        std::uint32_t crc;
+    };
+
+    // Each block ends on a byte boundary with a sync flush, or finishes the
+    // stream if it is the last, so the raw outputs can be concatenated.
+    void deflate_block(Block &block) {
+        z_stream strm;
+        strm.zalloc = zlib_alloc;
+        strm.zfree = zlib_free;
+        strm.opaque = Z_NULL;
+
+        int zres = ::deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                  -MAX_WBITS, mem_level, Z_DEFAULT_STRATEGY);
+        if (zres != Z_OK) throw error("Zlib: deflateInit2");
+        DeflateGuard guard(&strm);
+
+        if (block.dict_len > 0) {
+            zres = ::deflateSetDictionary(&strm, block.data - block.dict_len, block.dict_len);
+            if (zres != Z_OK) throw error("Zlib: deflateSetDictionary");
+        }
+
+        strm.next_in = block.data;
+        strm.avail_in = block.len;
+        strm.next_out = block.out;
+        strm.avail_out = block_bound(block.len);
+
+        zres = ::deflate(&strm, block.last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (zres != (block.last ? Z_STREAM_END : Z_OK)) throw error("Zlib: Incomplete Compression");
+        if (strm.avail_in != 0 || strm.avail_out == 0) throw error("Zlib: Too Much Compress Data");
+        block.out_len = block_bound(block.len) - strm.avail_out;
 
-    int zres = ::deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
-                            rpx ? MAX_WBITS : -MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
-    if (zres != Z_OK) throw error("Zlib: deflateInit2");
-    DeflateGuard guard(&strm);
+        block.adler = ::adler32(1, block.data, block.len);
+        block.crc = ::crc32(0, block.data, block.len);
+    }
 
-    std::size_t cmp_max_size = ::deflateBound(&strm, data.size());
-    cmp.resize(cmp_max_size + cmp.size());
-    strm.next_out = reinterpret_cast<Bytef *>(cmp.data() + (rpx ? 4 : 0));
-    strm.avail_out = cmp_max_size;
+    // Splits base[start, end) into blocks, each primed with up to dict_max
+    // bytes before it, and gives each a slice of out block_bound(block_len)
+    // apart. Both compress_into and the Deflater split at every block_len
+    // bytes of the whole input, so they give the same stream for it.
+    std::vector<Block> split_blocks(const std::uint8_t *base, std::size_t start,
+                                    std::size_t end, bool last, std::uint8_t *out) {
+        std::size_t count = block_count(end - start);
+        std::vector<Block> blocks(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            Block &block = blocks[i];
+            std::size_t off = start + i * block_len;
+            block.data = base + off;
+            block.len = std::min(block_len, end - off);
+            block.dict_len = std::min(off, dict_max);
+            block.last = last && (i == count - 1);
+            block.out = out + i * block_bound(block_len);
+        }
+        return blocks;
+    }
 
-    zres = ::deflate(&strm, Z_FINISH);
-    if (zres != Z_STREAM_END) throw error("Zlib: Incomplete Compression");
-    if (strm.avail_in != 0) throw error("Zlib: Too Much Compress Data");
-    cmp.resize(cmp.size() - strm.avail_out);
-    cmp.shrink_to_fit();
+    void deflate_blocks(std::vector<Block> &blocks) {
+        parallel_for(blocks.size(), [&blocks](std::size_t i) { deflate_block(blocks[i]); });
+    }
+
+    void store_be32(std::uint8_t *out, std::uint32_t value) {
+        for (int i = 0; i < 4; ++i)
+            out[i] = static_cast<std::uint8_t>(value >> (24 - 8 * i));
+    }
+}
 
+Zlib::bytes Zlib::compress(const bytes &data, bool rpx) {
+    bytes cmp(compress_bound(data.size(), rpx));
+    cmp.resize(compress_into(data.data(), data.size(), cmp.data(), cmp.size(), rpx));
     return cmp;
 }
 
 Zlib::bytes Zlib::decompress(const bytes &data, std::size_t dec_len, bool rpx) {
+    std::uint32_t crc;
+    return decompress(data, dec_len, rpx, crc);
+}
+
+Zlib::bytes Zlib::decompress(const bytes &data, std::size_t dec_len, bool rpx,
+                             std::uint32_t &crc) {
     bytes dec(dec_len);
+    decompress_into(data.data(), data.size(), dec.data(), dec.size(), rpx, crc);
+    return dec;
+}
 
-    z_stream strm;
-    strm.next_in = reinterpret_cast<const Bytef *>(data.data() + (rpx ? 4 : 0));
-    strm.avail_in = data.size() - (rpx ? 4 : 0);
-    strm.next_out = reinterpret_cast<Bytef *>(dec.data());
-    strm.avail_out = dec_len;
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
+std::size_t Zlib::compress_bound(std::size_t len, bool rpx) {
+    std::size_t count = block_count(len);
+    std::size_t bound = (rpx ? 4 + sizeof(zlib_header) + 4 : 0);
+    bound += (count - 1) * block_bound(block_len);
+    bound += block_bound(len - (count - 1) * block_len);
+    return bound;
+}
 
-    int zres = ::inflateInit2(&strm, rpx ? MAX_WBITS : -MAX_WBITS);
-    if (zres != Z_OK) throw error("Zlib: inflateInit2");
-    InflateGuard guard(&strm);
+std::size_t Zlib::compress_into(const std::uint8_t *data, std::size_t len,
+                                std::uint8_t *out, std::size_t out_len, bool rpx) {
+    if (out_len < compress_bound(len, rpx)) throw error("Zlib: Small Compress Buffer");
+
+    std::uint8_t *cmp = out;
+    if (rpx) {
+        store_be32(cmp, len);
+        std::memcpy(cmp + 4, zlib_header, sizeof(zlib_header));
+        cmp += 4 + sizeof(zlib_header);
+    }
 
-    zres = ::inflate(&strm, Z_FINISH);
-    if (zres != Z_STREAM_END) throw error("Zlib: Incomplete Decompression");
-    if (strm.avail_in != 0 || strm.avail_out != 0) throw error("Zlib: Too Much Decomp Data");
+    // Each block is deflated straight into its own slice of out, as laid
+    // out by compress_bound, and the slices are then packed down in place
+    std::vector<Block> blocks = split_blocks(data, 0, len, true, cmp);
+    LOG("Deflate %d blocks", blocks.size());
+    deflate_blocks(blocks);
 
-    return dec;
+    std::uint32_t adler = 1;
+    for (const Block &block : blocks) {
+        std::memmove(cmp, block.out, block.out_len);
+        cmp += block.out_len;
+        adler = ::adler32_combine(adler, block.adler, block.len);
+    }
+    if (rpx) {
+        store_be32(cmp, adler);
+        cmp += 4;
+    }
+
+    return cmp - out;
+}
+
+void Zlib::decompress_into(const std::uint8_t *data, std::size_t len,
+                           std::uint8_t *out, std::size_t dec_len, bool rpx, std::uint32_t &crc) {
+    if (len < (rpx ? 4 : 0)) throw error("Zlib: Short Compressed Data");
+    Inflater inflater(rpx);
+    inflater.input(data + (rpx ? 4 : 0), len - (rpx ? 4 : 0));
+
+    // Inflate in windows so each is still in cache when its CRC is taken
+    std::size_t dec = 0;
+    while (dec < dec_len) {
+        std::size_t n = inflater.inflate(out + dec, std::min(crc_window, dec_len - dec));
+        if (n == 0) throw error("Zlib: Incomplete Decompression");
+        dec += n;
+    }
+    // The end of the stream may still be pending once the output is full
+    std::uint8_t end;
+    if (!inflater.finished()) inflater.inflate(&end, 0);
+    if (!inflater.finished() || !inflater.needs_input()) throw error("Zlib: Too Much Decomp Data");
+
+    crc = inflater.crc();
 }
 
 std::uint32_t Zlib::crc32(const bytes &data) {
     return ::crc32(0, data.data(), data.size());
 }
+
+std::uint32_t Zlib::crc32(std::uint32_t crc, const void *data, std::size_t size) {
+    return ::crc32(crc, reinterpret_cast<const Bytef *>(data), size);
+}
+
+std::uint32_t Zlib::crc32_patch(std::uint32_t crc, std::size_t len, std::size_t offset,
+                                const void *old_data, const void *new_data, std::size_t size) {
+    // CRC32 is affine, so the change in the CRC is the CRC of the change,
+    // carried through the bytes that follow it
+    std::uint32_t diff = crc32(0, old_data, size) ^ crc32(0, new_data, size);
+    return crc ^ ::crc32_combine(diff, 0, len - offset - size);
+}
+
+Zlib::Inflater::Inflater(bool rpx) : strm(std::make_unique<z_stream>()) {
+    strm->next_in = Z_NULL;
+    strm->avail_in = 0;
+    strm->zalloc = zlib_alloc;
+    strm->zfree = zlib_free;
+    strm->opaque = Z_NULL;
+
+    int zres = ::inflateInit2(strm.get(), rpx ? MAX_WBITS : -MAX_WBITS);
+    if (zres != Z_OK) throw error("Zlib: inflateInit2");
+}
+
+Zlib::Inflater::~Inflater() {
+    ::inflateEnd(strm.get());
+}
+
+void Zlib::Inflater::input(const void *data, std::size_t size) {
+    strm->next_in = reinterpret_cast<const Bytef *>(data);
+    strm->avail_in = size;
+}
+
+bool Zlib::Inflater::needs_input() const {
+    return strm->avail_in == 0;
+}
+
+std::size_t Zlib::Inflater::inflate(void *out, std::size_t size) {
+    if (done) return 0;
+    strm->next_out = reinterpret_cast<Bytef *>(out);
+    strm->avail_out = size;
+
+    int zres = ::inflate(strm.get(), Z_NO_FLUSH);
+    if (zres == Z_STREAM_END) done = true;
+    else if (zres != Z_OK && zres != Z_BUF_ERROR) throw error("Zlib: Inflate");
+
+    std::size_t len = size - strm->avail_out;
+    out_crc = ::crc32(out_crc, reinterpret_cast<const Bytef *>(out), len);
+    return len;
+}
+
+Zlib::Deflater::Deflater(bool rpx, Sink sink) : rpx(rpx), sink(std::move(sink)) {
+    pending.reserve(pending_max);
+    deflated.resize(flush_blocks * block_bound(block_len));
+}
+
+void Zlib::Deflater::write(const void *data, std::size_t size) {
+    if (done) throw error("Zlib: Write After Finish");
+    const std::uint8_t *bdata = reinterpret_cast<const std::uint8_t *>(data);
+    while (size > 0) {
+        // A full set of blocks is only flushed once more input comes, so
+        // the last one can still end the stream, as in compress_into
+        if (pending.size() == dict_len + flush_len) flush(false);
+        std::size_t len = std::min(size, dict_len + flush_len - pending.size());
+        pending.insert(pending.end(), bdata, bdata + len);
+        bdata += len;
+        size -= len;
+    }
+}
+
+void Zlib::Deflater::finish() {
+    if (done) return;
+    flush(true);
+    done = true;
+}
+
+void Zlib::Deflater::flush(bool last) {
+    if (!started) {
+        if (rpx) sink(zlib_header, sizeof(zlib_header));
+        started = true;
+    }
+
+    std::vector<Block> blocks = split_blocks(pending.data(), dict_len, pending.size(), last,
+                                             deflated.data());
+    deflate_blocks(blocks);
+
+    for (const Block &block : blocks) {
+        sink(block.out, block.out_len);
+        adler = ::adler32_combine(adler, block.adler, block.len);
+        in_crc = ::crc32_combine(in_crc, block.crc, block.len);
+    }
+    if (last && rpx) {
+        std::uint8_t trailer[4];
+        store_be32(trailer, adler);
+        sink(trailer, sizeof(trailer));
+    }
+
+    // Keep the end of the input as the dictionary for the next blocks
+    std::size_t keep = std::min(pending.size(), dict_max);
+    std::memmove(pending.data(), pending.data() + pending.size() - keep, keep);
+    pending.resize(keep);
+    dict_len = keep;
+}
@@ -2,14 +2,95 @@
 #define ZLIB_HPP
 
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <vector>
 
+struct z_stream_s;
+
 namespace Zlib {
     using bytes = std::vector<std::uint8_t>;
 
     bytes compress(const bytes &data, bool rpx);
     bytes decompress(const bytes &data, std::size_t dec_len, bool rpx);
+    // Also returns the CRC32 of the output, computed as it is inflated
+    bytes decompress(const bytes &data, std::size_t dec_len, bool rpx, std::uint32_t &crc);
+
+    // Variants writing into a caller-provided buffer, so buffers can be
+    // reused between calls. compress_into needs out_len of at least
+    // compress_bound(len) and returns the number of bytes written.
+    std::size_t compress_bound(std::size_t len, bool rpx);
+    std::size_t compress_into(const std::uint8_t *data, std::size_t len,
+                              std::uint8_t *out, std::size_t out_len, bool rpx);
+    void decompress_into(const std::uint8_t *data, std::size_t len,
+                         std::uint8_t *out, std::size_t dec_len, bool rpx, std::uint32_t &crc);
     std::uint32_t crc32(const bytes &data);
+    std::uint32_t crc32(std::uint32_t crc, const void *data, std::size_t size);
+    // Updates the CRC32 of len bytes for size bytes at offset changing from
+    // old_data to new_data, without another pass over the unchanged bytes
+    std::uint32_t crc32_patch(std::uint32_t crc, std::size_t len, std::size_t offset,
+                              const void *old_data, const void *new_data, std::size_t size);
+
+    // Incremental inflate, for when only part of the stream is needed or
+    // the compressed data is read in pieces. The rpx flag selects the zlib
+    // wrapper, but the RPX size prefix must be skipped by the caller.
+    class Inflater {
+    public:
+        explicit Inflater(bool rpx);
+        ~Inflater();
+
+        Inflater(const Inflater &) = delete;
+        Inflater &operator=(const Inflater &) = delete;
+
+        // The input must stay valid until needs_input() returns true
+        void input(const void *data, std::size_t size);
+        bool needs_input() const;
+        bool finished() const noexcept { return done; }
+        // CRC32 of the output so far
+        std::uint32_t crc() const noexcept { return out_crc; }
+
+        // Returns the number of bytes written to out
+        std::size_t inflate(void *out, std::size_t size);
+
+    private:
+        std::unique_ptr<z_stream_s> strm;
+        std::uint32_t out_crc = 0;
+        bool done = false;
+    };
+
+    // Block-parallel deflate of a stream given in pieces. Input is split
+    // into blocks that are compressed on all cores, each primed with the
+    // preceding 32 KiB as a dictionary, and the output is passed to the
+    // sink in order. Every flush but the last is three blocks, one per core
+    // of the console, however the input is split and however many cores
+    // there are, so the stream is the one compress gives for the same
+    // input. The rpx flag selects the zlib wrapper, but the RPX size prefix
+    // must be written by the caller.
+    class Deflater {
+    public:
+        using Sink = std::function<void(const std::uint8_t *data, std::size_t size)>;
+
+        Deflater(bool rpx, Sink sink);
+
+        void write(const void *data, std::size_t size);
+        void finish();
+        // CRC32 of the input deflated so far, computed by the block workers
+        std::uint32_t crc() const noexcept { return in_crc; }
+
+    private:
+        const bool rpx;
+        const Sink sink;
+        bytes pending;
+        // Output of the blocks, reused by every flush
+        bytes deflated;
+        std::size_t dict_len = 0;
+        std::uint32_t adler = 1;
+        std::uint32_t in_crc = 0;
+        bool started = false;
+        bool done = false;
+
+        void flush(bool last);
+    };
 }
 
 #endif // ZLIB_HPP